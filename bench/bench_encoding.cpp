@@ -0,0 +1,99 @@
+#include "encoding.h"
+#include "encoding_util.h"
+#include "key_gen.h"
+#include "string_util.h"
+#include "types.h"
+#include <algorithm>
+#include <benchmark/benchmark.h>
+#include <cstddef>
+#include <random>
+#include <vector>
+
+namespace mergekv {
+namespace {
+
+void BM_CommonPrefixLen(benchmark::State &state) {
+  auto dist = KeyDistribution(state.range(0));
+  state.SetLabel(KeyDistributionName(dist));
+  auto keys = GenerateKeys(dist, 1 << 14);
+  // adjacent sorted keys, as in InMemoryBlock marshaling.
+  std::sort(keys.begin(), keys.end());
+  size_t bytes_processed = 0;
+  for (auto _ : state) {
+    size_t n = 0;
+    for (size_t i = 1; i < keys.size(); i++) {
+      n += CommonPrefixLen(StringUtil::BytesConstSpan(keys[i - 1]),
+                           StringUtil::BytesConstSpan(keys[i]));
+    }
+    benchmark::DoNotOptimize(n);
+    bytes_processed += n;
+  }
+  state.SetItemsProcessed(int64_t(state.iterations()) * (keys.size() - 1));
+  state.SetBytesProcessed(int64_t(bytes_processed));
+}
+
+// varintValues returns values fitting into max_bits bits; the lengths in
+// blocks mostly fit into one or two varint bytes.
+u64s varintValues(size_t n, int max_bits) {
+  std::mt19937_64 gen(1);
+  u64s values(n);
+  for (auto &v : values) {
+    v = max_bits == 64 ? gen() : gen() & ((uint64_t(1) << max_bits) - 1);
+  }
+  return values;
+}
+
+void BM_MarshalVarUint64s(benchmark::State &state) {
+  auto values = varintValues(4096, int(state.range(0)));
+  bytes dst;
+  for (auto _ : state) {
+    dst.clear();
+    EncodingUtil::MarshalVarUint64s(dst, values);
+    benchmark::DoNotOptimize(dst.data());
+  }
+  state.SetItemsProcessed(int64_t(state.iterations()) * values.size());
+  state.SetBytesProcessed(int64_t(state.iterations()) * dst.size());
+}
+
+void BM_UnmarshalVarUint64s(benchmark::State &state) {
+  auto values = varintValues(4096, int(state.range(0)));
+  bytes src;
+  EncodingUtil::MarshalVarUint64s(src, values);
+  u64s dst(values.size());
+  for (auto _ : state) {
+    EncodingUtil::UnmarshalVarUint64s(dst, src);
+    benchmark::DoNotOptimize(dst.data());
+  }
+  state.SetItemsProcessed(int64_t(state.iterations()) * values.size());
+  state.SetBytesProcessed(int64_t(state.iterations()) * src.size());
+}
+
+void BM_UnmarshalVarUint64(benchmark::State &state) {
+  auto values = varintValues(4096, int(state.range(0)));
+  bytes src;
+  EncodingUtil::MarshalVarUint64s(src, values);
+  for (auto _ : state) {
+    bytes_const_span tail = src;
+    uint64_t sum = 0;
+    while (!tail.empty()) {
+      auto [v, n] = EncodingUtil::UnmarshalVarUint64(tail);
+      sum += v;
+      tail = tail.subspan(n);
+    }
+    benchmark::DoNotOptimize(sum);
+  }
+  state.SetItemsProcessed(int64_t(state.iterations()) * values.size());
+  state.SetBytesProcessed(int64_t(state.iterations()) * src.size());
+}
+
+} // namespace
+
+BENCHMARK(BM_CommonPrefixLen)
+    ->Arg(int(KeyDistribution::kMetricNames))
+    ->Arg(int(KeyDistribution::kUUIDs))
+    ->Arg(int(KeyDistribution::kMonotonicIDs));
+BENCHMARK(BM_MarshalVarUint64s)->Arg(7)->Arg(14)->Arg(64);
+BENCHMARK(BM_UnmarshalVarUint64s)->Arg(7)->Arg(14)->Arg(64);
+BENCHMARK(BM_UnmarshalVarUint64)->Arg(7)->Arg(14)->Arg(64);
+
+} // namespace mergekv
@@ -0,0 +1,121 @@
+#include "inmemory_block.h"
+#include "key_gen.h"
+#include "string_util.h"
+#include "types.h"
+#include <benchmark/benchmark.h>
+#include <cstddef>
+#include <vector>
+
+namespace mergekv {
+namespace {
+
+const size_t kBenchKeys = 1 << 16;
+
+KeyDistribution distArg(benchmark::State &state) {
+  auto dist = KeyDistribution(state.range(0));
+  state.SetLabel(KeyDistributionName(dist));
+  return dist;
+}
+
+// fillBlock adds keys to ib until it is full and returns the number of the
+// added keys.
+size_t fillBlock(InMemoryBlock &ib, const std::vector<string> &keys) {
+  size_t n = 0;
+  for (auto &key : keys) {
+    if (!ib.Add(StringUtil::BytesConstSpan(key))) {
+      break;
+    }
+    n++;
+  }
+  return n;
+}
+
+void setCounters(benchmark::State &state, const InMemoryBlock &ib) {
+  state.SetItemsProcessed(int64_t(state.iterations()) * ib.items().size());
+  state.SetBytesProcessed(int64_t(state.iterations()) * ib.data().size());
+}
+
+void BM_InMemoryBlockAdd(benchmark::State &state) {
+  auto keys = GenerateKeys(distArg(state), kBenchKeys);
+  InMemoryBlock ib;
+  for (auto _ : state) {
+    ib.Reset();
+    benchmark::DoNotOptimize(fillBlock(ib, keys));
+  }
+  setCounters(state, ib);
+}
+
+void BM_InMemoryBlockSortItems(benchmark::State &state) {
+  auto keys = GenerateKeys(distArg(state), kBenchKeys);
+  InMemoryBlock src, ib;
+  fillBlock(src, keys);
+  for (auto _ : state) {
+    state.PauseTiming();
+    ib.CopyFrom(src);
+    state.ResumeTiming();
+    ib.SortItems();
+  }
+  setCounters(state, ib);
+}
+
+void BM_InMemoryBlockMarshalUnSortedData(benchmark::State &state) {
+  auto keys = GenerateKeys(distArg(state), kBenchKeys);
+  auto compress_level = int(state.range(1));
+  InMemoryBlock src, ib;
+  fillBlock(src, keys);
+  StorageBlock sb;
+  bytes first_item, common_prefix;
+  for (auto _ : state) {
+    state.PauseTiming();
+    ib.CopyFrom(src);
+    state.ResumeTiming();
+    ib.MarshalUnSortedData(sb, first_item, common_prefix, compress_level);
+  }
+  setCounters(state, ib);
+  state.counters["compression_ratio"] =
+      double(ib.data().size()) /
+      double(sb.items_data->size() + sb.lens_data->size());
+}
+
+void BM_InMemoryBlockUnmarshalData(benchmark::State &state) {
+  auto keys = GenerateKeys(distArg(state), kBenchKeys);
+  auto compress_level = int(state.range(1));
+  InMemoryBlock ib;
+  fillBlock(ib, keys);
+  StorageBlock sb;
+  bytes first_item, common_prefix;
+  auto [items_count, mt] =
+      ib.MarshalUnSortedData(sb, first_item, common_prefix, compress_level);
+
+  InMemoryBlock dst;
+  for (auto _ : state) {
+    dst.UnmarshalData(sb, first_item, common_prefix, items_count, mt);
+  }
+  setCounters(state, dst);
+}
+
+void distArgs(benchmark::internal::Benchmark *b) {
+  for (auto dist : {KeyDistribution::kMetricNames, KeyDistribution::kUUIDs,
+                    KeyDistribution::kMonotonicIDs}) {
+    b->Arg(int(dist));
+  }
+}
+
+// the flush compression level and the default zstd one.
+void distLevelArgs(benchmark::internal::Benchmark *b) {
+  for (auto dist : {KeyDistribution::kMetricNames, KeyDistribution::kUUIDs,
+                    KeyDistribution::kMonotonicIDs}) {
+    for (auto level : {-5, 3}) {
+      b->Args({int(dist), level});
+    }
+  }
+}
+
+} // namespace
+
+BENCHMARK(BM_InMemoryBlockAdd)->Apply(distArgs);
+BENCHMARK(BM_InMemoryBlockSortItems)->Apply(distArgs);
+BENCHMARK(BM_InMemoryBlockMarshalUnSortedData)->Apply(distLevelArgs);
+BENCHMARK(BM_InMemoryBlockUnmarshalData)->Apply(distLevelArgs);
+
+} // namespace mergekv
@@ -0,0 +1,59 @@
+#include "key_gen.h"
+#include <algorithm>
+#include <fmt/core.h>
+#include <random>
+
+namespace mergekv {
+
+const char *KeyDistributionName(KeyDistribution dist) {
+  switch (dist) {
+  case KeyDistribution::kMetricNames:
+    return "metric_names";
+  case KeyDistribution::kUUIDs:
+    return "uuids";
+  case KeyDistribution::kMonotonicIDs:
+    return "monotonic_ids";
+  }
+  return "unknown";
+}
+
+std::vector<string> GenerateKeys(KeyDistribution dist, size_t n,
+                                 uint64_t seed) {
+  std::mt19937_64 gen(seed);
+  std::vector<string> keys;
+  keys.reserve(n);
+  switch (dist) {
+  case KeyDistribution::kMetricNames:
+    for (size_t i = 0; i < n; i++) {
+      keys.push_back(fmt::format(
+          "http_requests_total_{}{{job=\"api-{}\",instance=\"host-{}:9100\","
+          "path=\"/v1/items/{}\"}}",
+          gen() % 20, gen() % 5, gen() % 1000, gen() % 100000));
+    }
+    std::shuffle(keys.begin(), keys.end(), gen);
+    break;
+  case KeyDistribution::kUUIDs:
+    for (size_t i = 0; i < n; i++) {
+      auto hi = gen(), lo = gen();
+      keys.push_back(fmt::format("{:08x}-{:04x}-{:04x}-{:04x}-{:012x}",
+                                 hi >> 32, (hi >> 16) & 0xffff, hi & 0xffff,
+                                 lo >> 48, lo & 0xffffffffffffULL));
+    }
+    break;
+  case KeyDistribution::kMonotonicIDs: {
+    auto id = gen() % 1000000;
+    for (size_t i = 0; i < n; i++) {
+      string key = "ns:ids:";
+      for (int shift = 56; shift >= 0; shift -= 8) {
+        key.push_back(char((id >> shift) & 0xff));
+      }
+      keys.push_back(std::move(key));
+      id += 1 + gen() % 4;
+    }
+    break;
+  }
+  }
+  return keys;
+}
+
+} // namespace mergekv
@@ -0,0 +1,28 @@
+#pragma once
+
+#include "types.h"
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace mergekv {
+
+// KeyDistribution is the shape of the keys fed to the benchmarks.
+enum class KeyDistribution {
+  // metric names with labels, sharing long prefixes.
+  kMetricNames = 0,
+  // random UUIDs in the canonical text form, without shared prefixes.
+  kUUIDs = 1,
+  // big endian 8-byte ids under a fixed namespace prefix, in order.
+  kMonotonicIDs = 2,
+};
+
+const char *KeyDistributionName(KeyDistribution dist);
+
+// GenerateKeys returns n keys with the given distribution. The keys are
+// shuffled unless the distribution is ordered, and they are the same for the
+// same seed.
+std::vector<string> GenerateKeys(KeyDistribution dist, size_t n,
+                                 uint64_t seed = 1);
+
+} // namespace mergekv
@@ -48,9 +48,9 @@ size_t BufferWriter::Write(bytes_const_span p) {
         err_msg_ = e.what();
       }
     } else {
-      auto cp_size = available();
-      std::memcpy(buf_.data() + size_, p.data(), cp_size);
-      size_ += cp_size;
+      n = available();
+      std::memcpy(buf_.data() + size_, p.data(), n);
+      size_ += n;
       Flush();
     }
     nn += n;
@@ -60,10 +60,12 @@ size_t BufferWriter::Write(bytes_const_span p) {
     throw IOException(err_msg_);
   }
 
-  auto cp_size = available();
-  std::memcpy(buf_.data() + size_, p.data(), cp_size);
-  size_ += cp_size;
-  return nn + cp_size;
+  // an empty p may have a null data(), which memcpy must not get.
+  if (!p.empty()) {
+    std::memcpy(buf_.data() + size_, p.data(), p.size());
+  }
+  size_ += p.size();
+  return nn + p.size();
 }
 
-} // namespace mergekv
\ No newline at end of file
+} // namespace mergekv
@@ -13,7 +13,7 @@ public:
   BufferWriter &operator=(const BufferWriter &) = delete;
 
   BufferWriter(std::shared_ptr<Writer> w, size_t size)
-      : w_(w), size_(size), buf_(size) {}
+      : buf_(size), size_(0), w_(w) {}
 
   size_t size() const { return size_; }
   void Flush();
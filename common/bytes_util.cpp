@@ -1,6 +1,8 @@
 #include "bytes_util.h"
 #include "exception.h"
+#include "huge_pages.h"
 #include "types.h"
+#include <algorithm>
 #include <cstddef>
 #include <cstring>
 
@@ -17,6 +19,14 @@ size_t ByteBufferReader::Read(bytes &p) {
 }
 
 size_t ByteBuffer::Write(bytes_const_span p) {
+  if (data_.use_count() > 1) {
+    // the readers keep the old contents.
+    data_ = std::make_shared<bytes>(*data_);
+  }
+  auto n = data_->size() + p.size();
+  if (huge_pages_ && n > data_->capacity()) {
+    HugePageUtil::Reserve(*data_, std::max(n, 2 * data_->capacity()));
+  }
   data_->insert(data_->end(), p.begin(), p.end());
   return p.size();
 }
@@ -28,7 +38,14 @@ void ByteBuffer::MustReadAt(bytes &p, size_t offset) {
         data_->size());
   }
 
-  std::memcpy(p.data(), data_->data(), p.size());
+  std::memcpy(p.data(), data_->data() + offset, p.size());
+}
+
+// Read reads up to p.size() bytes from the beginning of the buffer.
+size_t ByteBuffer::Read(bytes &p) {
+  size_t n = std::min(p.size(), data_->size());
+  std::memcpy(p.data(), data_->data(), n);
+  return n;
 }
 
 size_t ByteBuffer::ReadFrom(Reader &r) {
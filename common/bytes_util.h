@@ -30,7 +30,7 @@ public:
   // forbit copy
   ByteBuffer(const ByteBuffer &) = delete;
   ByteBuffer &operator=(const ByteBuffer &) = delete;
-  ByteBuffer() = default;
+  ByteBuffer() : data_(std::make_shared<bytes>()) {}
   ByteBuffer(bytes &data);
 
   string Path() const override {
@@ -38,7 +38,19 @@ public:
                        reinterpret_cast<std::uintptr_t>(this));
   }
 
-  void Reset() { data_->clear(); }
+  // Reset detaches the buffer from the readers sharing it, e.g. in-memory
+  // parts, instead of clearing it under them.
+  void Reset() {
+    if (data_.use_count() > 1) {
+      data_ = std::make_shared<bytes>();
+    } else {
+      data_->clear();
+    }
+  }
+
+  // SetHugePages makes the buffer grow in whole transparent huge pages once
+  // it reaches kHugePageSize.
+  void SetHugePages(bool enabled) { huge_pages_ = enabled; }
 
   size_t Write(bytes_const_span p);
 
@@ -58,6 +70,7 @@ public:
 
 private:
   std::shared_ptr<bytes> data_;
+  bool huge_pages_ = false;
 };
 
 } // namespace mergekv
\ No newline at end of file
@@ -1,8 +1,11 @@
 #include "encoding_util.h"
 #include "exception.h"
+#include "metrics.h"
 #include "types.h"
 #include <cstddef>
 #include <cstdint>
+#include <algorithm>
+#include <chrono>
 #include <cstring>
 #include <memory>
 #include <sys/types.h>
@@ -26,8 +29,11 @@ void EncodingUtil::MarshalVarUint64(bytes &dst, uint64_t u) {
     return;
   }
   // Slow path for big intergers
-  auto tmp = u64s(1, u);
-  MarshalVarUint64s(dst, tmp);
+  while (u >= 0x80) {
+    dst.push_back(uint8_t(u | 0x80));
+    u >>= 7;
+  }
+  dst.push_back(uint8_t(u));
 }
 
 void EncodingUtil::MarshalVarUint64s(bytes &dst, u64s &ls) {
@@ -225,7 +231,7 @@ bytes_const_span EncodingUtil::UnmarshalVarUint64sSlow(u64s &dst,
     idx++;
     if (e < 0x80) {
       dst[i] =
-          uint64_t(c & 0x7f) | uint64_t(d & 0x7f) << 7 | uint64_t(e) << 2 * 14;
+          uint64_t(c & 0x7f) | uint64_t(d & 0x7f) << 7 | uint64_t(e) << 2 * 7;
       continue;
     }
 
@@ -318,74 +324,99 @@ std::tuple<bytes_const_span, int> EncodingUtil::UnmarshalBytes(bytes_const_span
     return {bytes_const_span(), n_size};
   }
   if (uint64_t(n_size) + n > src.size()) {
-    return {bytes_const_span(), n_size};
+    return {bytes_const_span(), 0};
   }
   auto start = n_size;
   n_size += n;
   return {src.subspan(start, n), n_size};
 }
 
+// ZSTD_compress and ZSTD_decompress allocate a new context on every call,
+// so the contexts are reused per thread instead.
+static ZSTD_CCtx *getCCtx() {
+  thread_local std::unique_ptr<ZSTD_CCtx, decltype(&ZSTD_freeCCtx)> ctx(
+      ZSTD_createCCtx(), ZSTD_freeCCtx);
+  return ctx.get();
+}
+
+static ZSTD_DCtx *getDCtx() {
+  thread_local std::unique_ptr<ZSTD_DCtx, decltype(&ZSTD_freeDCtx)> ctx(
+      ZSTD_createDCtx(), ZSTD_freeDCtx);
+  return ctx.get();
+}
+
+// zstdMetrics are the metrics of the compress or decompress calls.
+struct zstdMetrics {
+  Histogram &duration;
+  Counter &src_bytes;
+  Counter &dst_bytes;
+
+  static zstdMetrics &Get(bool compress) {
+    auto &r = MetricsRegistry::Global();
+    static zstdMetrics c{
+        r.GetHistogram("mergekv_zstd_duration_seconds{op=\"compress\"}",
+                       "ZSTD compress and decompress call durations"),
+        r.GetCounter("mergekv_zstd_src_bytes_total{op=\"compress\"}",
+                     "ZSTD input bytes"),
+        r.GetCounter("mergekv_zstd_dst_bytes_total{op=\"compress\"}",
+                     "ZSTD output bytes")};
+    static zstdMetrics d{
+        r.GetHistogram("mergekv_zstd_duration_seconds{op=\"decompress\"}"),
+        r.GetCounter("mergekv_zstd_src_bytes_total{op=\"decompress\"}"),
+        r.GetCounter("mergekv_zstd_dst_bytes_total{op=\"decompress\"}")};
+    return compress ? c : d;
+  }
+
+  void Update(std::chrono::steady_clock::time_point start, size_t src_len,
+              size_t dst_len) {
+    duration.UpdateDuration(std::chrono::steady_clock::now() - start);
+    src_bytes.Add(src_len);
+    dst_bytes.Add(dst_len);
+  }
+};
+
 void EncodingUtil::CompressZSTDLevel(bytes &dst, bytes_const_span src,
                                      int level) {
   if (src.empty()) {
     return;
   }
+  auto start = std::chrono::steady_clock::now();
   auto dst_len = dst.size();
-  if (dst.capacity() > dst_len) {
-    // Fast path
-    // make sure dst has enough size
-    dst.resize(dst.capacity());
-    auto result = ZSTD_compress(dst.data() + dst_len, dst.size() - dst_len,
-                                src.data(), src.size(), level);
-    auto compress_size = result;
-    if (compress_size >= 0) {
-      dst.resize(dst_len + compress_size);
-      return;
-    }
-
-    if (ZSTD_getErrorCode(result) != ZSTD_error_dstSize_tooSmall) {
-      throw FatalException("ZSTD_compress: %s", ZSTD_getErrorName(result));
-    }
-  }
+  compressZSTDLevel(dst, src, level);
+  zstdMetrics::Get(true).Update(start, src.size(), dst.size() - dst_len);
+}
 
-  // Slow path, reallocate dst
-  auto compress_bound = ZSTD_compressBound(src.size()) + 1;
-  auto n = dst_len + compress_bound - dst.capacity() + dst_len;
-  if (n > 0) {
-    dst.resize(dst.size() + n);
+void EncodingUtil::compressZSTDLevel(bytes &dst, bytes_const_span src,
+                                     int level) {
+  // dst grows by the compress bound only, so the spare capacity of reused
+  // buffers isn't zero-filled on every call.
+  auto dst_len = dst.size();
+  auto compress_bound = ZSTD_compressBound(src.size());
+  dst.resize(dst_len + compress_bound);
+  auto result = ZSTD_compressCCtx(getCCtx(), dst.data() + dst_len,
+                                  compress_bound, src.data(), src.size(), level);
+  if (ZSTD_isError(result)) {
+    dst.resize(dst_len);
+    throw FatalException("ZSTD_compress: %s", ZSTD_getErrorName(result));
   }
-  auto result = ZSTD_compress(dst.data() + dst_len, compress_bound, src.data(),
-                              src.size(), level);
-  auto compress_size = result;
-  dst.resize(dst_len + compress_size);
+  dst.resize(dst_len + result);
 }
 
 void EncodingUtil::DecompressZSTD(bytes &dst, bytes_const_span src) {
   if (src.empty()) {
     return;
   }
+  auto start = std::chrono::steady_clock::now();
   auto dst_len = dst.size();
-  if (dst.capacity() > dst_len) {
-    // Fast path
-    // make sure dst has enough size
-    // dst.resize(dst.capacity());
-    auto result = ZSTD_decompress(dst.data() + dst_len, dst.size() - dst_len,
-                                  src.data(), src.size());
-    auto decompress_size = int(result);
-    if (decompress_size >= 0) {
-      dst.resize(dst_len + decompress_size);
-      return;
-    }
-
-    if (ZSTD_getErrorCode(result) != ZSTD_error_dstSize_tooSmall) {
-      throw InternalException("ZSTD_decompress: %s", ZSTD_getErrorName(result));
-    }
-  }
+  decompressZSTD(dst, src);
+  zstdMetrics::Get(false).Update(start, src.size(), dst.size() - dst_len);
+}
 
-  // Slow path, reallocate dst
+void EncodingUtil::decompressZSTD(bytes &dst, bytes_const_span src) {
+  auto dst_len = dst.size();
+  // dst grows by the frame content size only, so the spare capacity of
+  // reused buffers isn't zero-filled on every call.
   auto r = ZSTD_getFrameContentSize(src.data(), src.size());
-
-  auto decompress_bound = int(r);
   switch (r) {
   case ZSTD_CONTENTSIZE_ERROR:
     throw InvalidInputException("cannot decompress invalid src");
@@ -394,20 +425,14 @@ void EncodingUtil::DecompressZSTD(bytes &dst, bytes_const_span src) {
     return;
   }
 
-  decompress_bound++;
-
-  auto n = int(dst_len + decompress_bound - dst.capacity());
-  if (n > 0) {
-    dst.resize(dst.size() + n);
-  }
-  dst.resize(dst_len + decompress_bound);
-  auto result = ZSTD_decompress(dst.data() + dst_len, decompress_bound,
-                                src.data(), src.size());
-  auto decompress_size = int(result);
-  if (decompress_size >= 0) {
-    dst.resize(dst_len + decompress_size);
+  dst.resize(dst_len + size_t(r));
+  auto result = ZSTD_decompressDCtx(getDCtx(), dst.data() + dst_len, size_t(r),
+                                    src.data(), src.size());
+  if (!ZSTD_isError(result)) {
+    dst.resize(dst_len + result);
     return;
   }
+  dst.resize(dst_len);
 
   throw InvalidInputException("ZSTD_decompress fail: %s",
                               ZSTD_getErrorName(result));
@@ -418,25 +443,30 @@ void EncodingUtil::streamDecompressZSTD(bytes &dst, bytes_const_span src) {
   reader.WriteTo(dst);
 }
 
-ZstdReader::ZstdReader(bytes_const_span src) {
-  reader_ = std::make_unique<BytesReader>(src);
+ZstdReader::ZstdReader(Reader &src) : reader_(&src) { Init(); }
+
+ZstdReader::ZstdReader(bytes_const_span src)
+    : bytes_reader_(std::make_unique<BytesReader>(src)),
+      reader_(bytes_reader_.get()) {
+  Init();
+}
+
+void ZstdReader::Init() {
   auto deleter = [](ZSTD_DStream *dStream) { ZSTD_freeDStream(dStream); };
   d_stream_ = std::unique_ptr<ZSTD_DStream, decltype(deleter)>(
       ZSTD_createDStream(), deleter);
+  ZSTD_initDStream(d_stream_.get());
 
   in_buf_ = std::make_unique<InBuffWrapper>(kDstreamInBufferSize);
   out_buf_ = std::make_unique<OutBufWrapper>(kDstreamOutBufferSize);
 }
 
 bool ZstdReader::FillOutBuf() {
-  if (in_buf_->pos() == in_buf_->size() &&
-      out_buf_->size() < kDstreamOutBufferSize) {
-    if (FillInBuf()) {
-      return true;
+  while (true) {
+    if (in_buf_->pos() == in_buf_->size() && !src_eof_) {
+      FillInBuf();
     }
-  }
 
-  while (true) {
     out_buf_->set_size(kDstreamOutBufferSize);
     out_buf_->set_pos(0);
     auto pre_in_buf_pos = in_buf_->pos();
@@ -444,90 +474,91 @@ bool ZstdReader::FillOutBuf() {
                                         &(in_buf_->in_buf_));
     out_buf_->set_size(out_buf_->pos());
     out_buf_->set_pos(0);
-    if (ZSTD_getErrorCode(result) != 0) {
+    if (ZSTD_isError(result)) {
       throw InvalidInputException("ZSTD_decompressStream: %s",
                                   ZSTD_getErrorName(result));
     }
+    auto progress = in_buf_->pos() != pre_in_buf_pos || out_buf_->size() > 0;
+    if (progress) {
+      // 0 means the last frame is complete.
+      frame_pending_ = result != 0;
+    }
 
     if (out_buf_->size() > 0) {
       return false;
     }
-
-    // nothing in out_buf_, data is consumed from in_buf_, but decompressed into
-    // nothing. And there is more data in in_buf_, continue to decompress
-    if (in_buf_->pos() != pre_in_buf_pos /*has consumed*/ &&
-        in_buf_->pos() < in_buf_->size() /*has more data*/) {
+    if (progress) {
+      // the input was consumed without output, e.g. a frame header.
       continue;
     }
-
-    auto eof = FillInBuf();
-    if (eof) {
-      return true;
+    if (!src_eof_) {
+      FillInBuf();
+      continue;
+    }
+    if (frame_pending_) {
+      throw InvalidInputException("ZSTD_decompressStream: truncated input");
     }
+    return true;
   }
 }
+
 bool ZstdReader::FillInBuf() {
-  auto base = const_cast<void *>(in_buf_->in_buf_.src);
-  std::memmove(base, static_cast<uint8_t *>(base) + in_buf_->pos(),
-               in_buf_->size() - in_buf_->pos());
+  auto base = static_cast<uint8_t *>(const_cast<void *>(in_buf_->in_buf_.src));
+  std::memmove(base, base + in_buf_->pos(), in_buf_->size() - in_buf_->pos());
   in_buf_->set_size(in_buf_->size() - in_buf_->pos());
   in_buf_->set_pos(0);
-  while (true) {
-    auto [n, eof] = reader_->Read(
-        static_cast<uint8_t *>(base) + in_buf_->size(), kDstreamInBufferSize);
+  while (in_buf_->size() < kDstreamInBufferSize) {
+    auto [n, eof] = reader_->Read(base + in_buf_->size(),
+                                  kDstreamInBufferSize - in_buf_->size());
     in_buf_->set_size(in_buf_->size() + n);
-    if (!eof) {
-      if (n == 0) {
-        continue;
-      }
+    if (eof) {
+      src_eof_ = true;
+      break;
     }
-
     if (n > 0) {
-      return false;
-    }
-
-    if (eof) {
-      return true;
+      break;
     }
-
-    throw InvalidInputException("FillInBuf: can not read data from reader");
   }
+  return src_eof_;
 }
 
-std::tuple<size_t, bool> ZstdReader::Read(bytes &p) {
-  if (p.empty()) {
+std::tuple<size_t, bool> ZstdReader::Read(void *data, size_t n) {
+  if (n == 0) {
     return {0, false};
   }
-
-  if (out_buf_->size() == 0) {
+  if (buffered() == 0) {
     if (FillOutBuf()) {
       return {0, true};
     }
   }
 
-  std::memcpy(p.data(), out_buf_->out_buf_.dst,
-              out_buf_->size() - out_buf_->pos());
-  out_buf_->set_pos(out_buf_->size());
-  return {out_buf_->size() - out_buf_->pos(), false};
+  n = std::min(n, buffered());
+  std::memcpy(data,
+              static_cast<uint8_t *>(out_buf_->out_buf_.dst) + out_buf_->pos(),
+              n);
+  out_buf_->set_pos(out_buf_->pos() + n);
+  return {n, false};
+}
+
+std::tuple<size_t, bool> ZstdReader::Read(bytes &buf) {
+  auto [n, eof] = Read(buf.data(), buf.size());
+  buf.resize(n);
+  return {n, eof};
 }
 
 size_t ZstdReader::WriteTo(bytes &p) {
   size_t n = 0;
   while (true) {
-    if (out_buf_->pos() == out_buf_->size()) {
+    if (buffered() == 0) {
       if (FillOutBuf()) {
         return n;
       }
     }
 
-    p.reserve(p.size() + out_buf_->size() - out_buf_->pos());
     auto start =
         static_cast<uint8_t *>(out_buf_->out_buf_.dst) + out_buf_->pos();
-    auto end = start + (out_buf_->size() - out_buf_->pos());
-
-    p.insert(p.end(), start, end);
-
-    n += out_buf_->size() - out_buf_->pos();
+    p.insert(p.end(), start, start + buffered());
+    n += buffered();
     out_buf_->set_pos(out_buf_->size());
   }
 }
@@ -36,6 +36,10 @@ public:
   static void CompressZSTDLevel(bytes &dst, bytes_const_span src, int level);
   static void DecompressZSTD(bytes &dst, bytes_const_span src);
   static void streamDecompressZSTD(bytes &dst, bytes_const_span src);
+
+private:
+  static void compressZSTDLevel(bytes &dst, bytes_const_span src, int level);
+  static void decompressZSTD(bytes &dst, bytes_const_span src);
 };
 
 struct InBuffWrapper {
@@ -82,24 +86,40 @@ public:
   ZSTD_outBuffer out_buf_;
 };
 
-class ZstdReader {
+// ZstdReader decompresses the zstd stream read from a Reader.
+//
+// It keeps only the zstd stream buffers, so the memory it uses doesn't
+// depend on the stream size.
+class ZstdReader : public Reader {
 public:
-  ZstdReader(bytes_const_span src);
+  // ZstdReader reads the compressed stream from src, which must outlive it.
+  explicit ZstdReader(Reader &src);
+  explicit ZstdReader(bytes_const_span src);
 
   // copy is forbidden
   ZstdReader(const ZstdReader &) = delete;
   ZstdReader &operator=(const ZstdReader &) = delete;
 
-  std::tuple<size_t, bool> Read(bytes &p);
+  // Read reads up to n decompressed bytes into data.
+  std::tuple<size_t, bool> Read(void *data, size_t n) override;
+  // Read reads up to buf.size() decompressed bytes into buf and shrinks buf
+  // to the number of read bytes.
+  std::tuple<size_t, bool> Read(bytes &buf) override;
+  // WriteTo appends the rest of the decompressed stream to p.
   size_t WriteTo(bytes &p);
 
 private:
+  void Init();
   // if false, has more data to read, true, no more data to read(eof)
   bool FillOutBuf();
   bool FillInBuf();
+  size_t buffered() { return out_buf_->size() - out_buf_->pos(); }
 
 private:
-  std::unique_ptr<BytesReader> reader_;
+  std::unique_ptr<BytesReader> bytes_reader_;
+  Reader *reader_;
+  bool src_eof_ = false;
+  bool frame_pending_ = false;
   std::unique_ptr<ZSTD_DStream, std::function<void(ZSTD_DStream *)>> d_stream_;
   std::unique_ptr<InBuffWrapper> in_buf_;
   std::unique_ptr<OutBufWrapper> out_buf_;
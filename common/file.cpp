@@ -2,6 +2,8 @@
 #include "exception.h"
 #include "io.h"
 #include "memory.h"
+#include "metrics.h"
+#include <algorithm>
 #include <cstddef>
 #include <exception>
 #include <filesystem>
@@ -9,11 +11,39 @@
 #include <mutex>
 // #include <sys/_types/_mode_t.h>
 #include <sys/fcntl.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 namespace mergekv {
 
+size_t FileDescWriter::Write(bytes_const_span p) {
+  static auto &written = MetricsRegistry::Global().GetCounter(
+      "mergekv_file_written_bytes_total", "bytes written to files");
+  size_t n = 0;
+  while (n < p.size()) {
+    auto res = ::write(fd_, p.data() + n, p.size() - n);
+    if (res == -1 && errno == EINTR) {
+      continue;
+    }
+    if (res <= 0) {
+      throw IOException("can not write to file, fd: %d, errno: %d", fd_,
+                        errno);
+    }
+    n += res;
+  }
+  written.Add(n);
+  return n;
+}
+
+// timedFsync is fsync(2) recording its duration.
+static int timedFsync(int fd) {
+  static auto &duration = MetricsRegistry::Global().GetHistogram(
+      "mergekv_file_fsync_duration_seconds", "fsync durations");
+  HistogramTimer timer(duration);
+  return fsync(fd);
+}
+
 std::once_flag BufferFileWriter::once_flag;
 
 size_t BufferFileWriter::GetBufferSize() {
@@ -67,7 +97,7 @@ void BufferFileWriter::MustFlush(bool sync) {
   try {
     bw_->Flush();
     if (sync) {
-      if (fsync(fd_) == -1) {
+      if (timedFsync(fd_) == -1) {
         throw IOException("can not sync file: %s, errno: %d", filename_.c_str(),
                           errno);
       }
@@ -84,7 +114,7 @@ void BufferFileWriter::MustClose() {
   }
   try {
     bw_->Flush();
-    if (fsync(fd_) == -1) {
+    if (timedFsync(fd_) == -1) {
       throw IOException("can not sync file: %s, errno: %d", filename_.c_str(),
                         errno);
     }
@@ -102,7 +132,7 @@ void BufferFileWriter::MustClose() {
 
 void BufferFileWriter::MustSync(bool sync) {
   if (sync) {
-    if (fsync(fd_) == -1) {
+    if (timedFsync(fd_) == -1) {
       throw IOException("can not sync file: %s, errno: %d", filename_.c_str(),
                         errno);
     }
@@ -111,6 +141,70 @@ void BufferFileWriter::MustSync(bool sync) {
 
 BufferFileWriter::~BufferFileWriter() { MustClose(); }
 
+FileRangeReader::FileRangeReader(const string &filename)
+    : filename_(filename), offset_(0) {
+  Open();
+  struct stat st;
+  if (::fstat(fd_, &st) == -1) {
+    ::close(fd_);
+    throw IOException("can not stat file: %s, errno: %d", filename.c_str(),
+                      errno);
+  }
+  end_ = st.st_size;
+}
+
+FileRangeReader::FileRangeReader(const string &filename, uint64_t offset,
+                                 uint64_t size)
+    : filename_(filename), offset_(offset), end_(offset + size) {
+  Open();
+}
+
+void FileRangeReader::Open() {
+  fd_ = ::open(filename_.c_str(), O_RDONLY | O_CLOEXEC);
+  if (-1 == fd_) {
+    throw IOException("can not open file: %s, errno: %d", filename_.c_str(),
+                      errno);
+  }
+}
+
+FileRangeReader::~FileRangeReader() {
+  if (fd_ != -1) {
+    ::close(fd_);
+  }
+}
+
+std::tuple<size_t, bool> FileRangeReader::Read(void *data, size_t n) {
+  if (offset_ >= end_) {
+    return {0, true};
+  }
+  n = std::min<uint64_t>(n, end_ - offset_);
+  if (n == 0) {
+    return {0, false};
+  }
+  while (true) {
+    auto res = ::pread(fd_, data, n, off_t(offset_));
+    if (res == -1 && errno == EINTR) {
+      continue;
+    }
+    if (res == -1) {
+      throw IOException("can not read file: %s, errno: %d", filename_.c_str(),
+                        errno);
+    }
+    if (res == 0) {
+      throw IOException("unexpected end of file: %s at offset %d",
+                        filename_.c_str(), offset_);
+    }
+    offset_ += res;
+    return {size_t(res), false};
+  }
+}
+
+std::tuple<size_t, bool> FileRangeReader::Read(bytes &buf) {
+  auto [n, eof] = Read(buf.data(), buf.size());
+  buf.resize(n);
+  return {n, eof};
+}
+
 std::atomic<uint64_t> FileUtils::tmp_file_num(0);
 
 void FileUtils::MustSyncPath(const string &path) {
@@ -131,6 +225,9 @@ void FileUtils::MustSyncPath(const string &path) {
 }
 
 void FileUtils::MustWriteSync(const string &filename, bytes_const_span p) {
+  static auto &files = MetricsRegistry::Global().GetCounter(
+      "mergekv_files_written_total", "files written and synced");
+  files.Add();
   try {
     BufferFileWriter bw(filename);
     bw.Write(p);
@@ -140,6 +237,74 @@ void FileUtils::MustWriteSync(const string &filename, bytes_const_span p) {
   }
 }
 
+// MustReadFile appends the contents of filename to dst.
+void FileUtils::MustReadFile(const string &filename, bytes &dst) {
+  auto dst_len = dst.size();
+  try {
+    MustReadFileTo(filename, [&dst, dst_len](size_t size) {
+      dst.resize(dst_len + size);
+      return reinterpret_cast<char *>(dst.data() + dst_len);
+    });
+  } catch (...) {
+    dst.resize(dst_len);
+    throw;
+  }
+}
+
+// MustReadFileTo reads filename into the buffer returned by alloc for the
+// file size and returns the size.
+//
+// The size is taken from the open descriptor, so small files are read with
+// a single read(2) without stat-ing the path first.
+size_t FileUtils::MustReadFileTo(const string &filename,
+                                 const std::function<char *(size_t)> &alloc) {
+  auto fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+  if (-1 == fd) {
+    throw FatalException("can not open file: %s, errno: %d", filename.c_str(),
+                         errno);
+  }
+  size_t size = 0;
+  try {
+    struct stat st;
+    if (::fstat(fd, &st) == -1) {
+      throw IOException("can not stat file: %s, errno: %d", filename.c_str(),
+                        errno);
+    }
+    size = st.st_size;
+    auto dst = alloc(size);
+    size_t offset = 0;
+    while (offset < size) {
+      auto n = ::read(fd, dst + offset, size - offset);
+      if (n == -1 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        throw IOException("can not read file: %s, errno: %d", filename.c_str(),
+                          errno);
+      }
+      offset += n;
+    }
+  } catch (const std::exception &e) {
+    ::close(fd);
+    throw FatalException("can not read file: %s, %s", filename.c_str(),
+                         e.what());
+  }
+  ::close(fd);
+  return size;
+}
+
+bool FileUtils::IsPathExist(const string &path) { return fs::exists(path); }
+
+size_t FileUtils::MustFileSize(const string &filename) {
+  std::error_code ec;
+  auto size = fs::file_size(filename, ec);
+  if (ec) {
+    throw FatalException("can not get file size: %s, %s", filename.c_str(),
+                         ec.message());
+  }
+  return size;
+}
+
 void FileUtils::MustWriteAtomic(const string &filename, bytes_const_span p,
                                 bool overwrite) {
   if (IsPathExist(filename) && !overwrite) {
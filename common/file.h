@@ -4,9 +4,11 @@
 #include "exception.h"
 #include "io.h"
 #include "types.h"
+#include <atomic>
 #include <cerrno>
 #include <cstddef>
 #include <fcntl.h>
+#include <functional>
 #include <memory>
 #include <mutex>
 #include <unistd.h>
@@ -17,22 +19,37 @@ class FileDescWriter : public Writer {
 public:
   FileDescWriter(int fd) : fd_(fd) {}
 
-  size_t Write(bytes_const_span p) override {
-    auto res = ::write(fd_, p.data(), p.size());
-    if ((-1 == res || 0 == res) && errno != EINTR) {
-      throw IOException("can not write to file: %s, fd: %d", &filename_, fd_);
-    }
+  // Write writes all of p, since BufferWriter treats short writes as errors.
+  size_t Write(bytes_const_span p) override;
+
+private:
+  int fd_;
+  string filename_;
+};
+
+// FileRangeReader reads the size bytes of a file starting at offset with
+// pread(2), so the range can be streamed without loading it into memory.
+class FileRangeReader : public Reader {
+public:
+  // forbid copy
+  FileRangeReader(const FileRangeReader &) = delete;
+  FileRangeReader &operator=(const FileRangeReader &) = delete;
 
-    if (res > 0) {
-      return res;
-    }
+  // FileRangeReader reads the whole file.
+  explicit FileRangeReader(const string &filename);
+  FileRangeReader(const string &filename, uint64_t offset, uint64_t size);
+  ~FileRangeReader() override;
 
-    return 0;
-  }
+  std::tuple<size_t, bool> Read(void *data, size_t n) override;
+  std::tuple<size_t, bool> Read(bytes &buf) override;
 
 private:
-  int fd_;
+  void Open();
+
   string filename_;
+  int fd_ = -1;
+  uint64_t offset_;
+  uint64_t end_;
 };
 
 class BufferFileWriter : public FileWriter {
@@ -64,6 +81,9 @@ public:
   static void MustWriteSync(const string &filename, bytes_const_span p);
   static void MustWriteAtomic(const string &filename, bytes_const_span p,
                               bool overwrite);
+  static void MustReadFile(const string &filename, bytes &dst);
+  static size_t MustReadFileTo(const string &filename,
+                               const std::function<char *(size_t)> &alloc);
   static bool IsPathExist(const string &path);
   static size_t MustFileSize(const string &filename);
 
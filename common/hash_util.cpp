@@ -0,0 +1,55 @@
+#include "hash_util.h"
+#include <cstdint>
+#include <cstring>
+
+namespace mergekv {
+
+uint64_t HashUtil::Hash64(bytes_const_span b, uint64_t seed) {
+  const uint64_t m = 0xc6a4a7935bd1e995ULL;
+  const int r = 47;
+  auto n = b.size();
+  uint64_t h = seed ^ (n * m);
+
+  auto p = b.data();
+  auto end = p + (n / 8) * 8;
+  for (; p != end; p += 8) {
+    uint64_t k;
+    std::memcpy(&k, p, 8);
+    k *= m;
+    k ^= k >> r;
+    k *= m;
+    h ^= k;
+    h *= m;
+  }
+
+  switch (n & 7) {
+  case 7:
+    h ^= uint64_t(p[6]) << 48;
+    [[fallthrough]];
+  case 6:
+    h ^= uint64_t(p[5]) << 40;
+    [[fallthrough]];
+  case 5:
+    h ^= uint64_t(p[4]) << 32;
+    [[fallthrough]];
+  case 4:
+    h ^= uint64_t(p[3]) << 24;
+    [[fallthrough]];
+  case 3:
+    h ^= uint64_t(p[2]) << 16;
+    [[fallthrough]];
+  case 2:
+    h ^= uint64_t(p[1]) << 8;
+    [[fallthrough]];
+  case 1:
+    h ^= uint64_t(p[0]);
+    h *= m;
+  }
+
+  h ^= h >> r;
+  h *= m;
+  h ^= h >> r;
+  return h;
+}
+
+} // namespace mergekv
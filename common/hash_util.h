@@ -0,0 +1,12 @@
+#pragma once
+
+#include "types.h"
+#include <cstdint>
+
+namespace mergekv {
+class HashUtil {
+public:
+  // Hash64 returns 64-bit MurmurHash64A of b.
+  static uint64_t Hash64(bytes_const_span b, uint64_t seed = 0);
+};
+} // namespace mergekv
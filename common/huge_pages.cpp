@@ -0,0 +1,102 @@
+#include "huge_pages.h"
+#include "metrics.h"
+#include "string_util.h"
+#include <fstream>
+#include <mutex>
+
+#ifdef OS_LINUX
+#include <sys/mman.h>
+#endif
+
+namespace mergekv {
+
+// hugePageMetrics are shared by all the buffers.
+struct hugePageMetrics {
+  Counter &advised_bytes;
+  Counter &advise_errors;
+  Counter &reserved_bytes;
+
+  static hugePageMetrics &Get() {
+    auto &r = MetricsRegistry::Global();
+    static hugePageMetrics m{
+        r.GetCounter("mergekv_hugepage_advised_bytes_total",
+                     "buffer bytes marked with MADV_HUGEPAGE"),
+        r.GetCounter("mergekv_hugepage_advise_errors_total",
+                     "failed MADV_HUGEPAGE calls"),
+        r.GetCounter("mergekv_hugepage_reserved_bytes_total",
+                     "buffer bytes reserved in whole huge pages")};
+    return m;
+  }
+};
+
+bool HugePageUtil::Enabled() {
+  static bool enabled = [] {
+#ifdef OS_LINUX
+    std::ifstream file("/sys/kernel/mm/transparent_hugepage/enabled");
+    string mode;
+    std::getline(file, mode);
+    // e.g. "always [madvise] never"
+    return StringUtil::Contains(mode, "[always]") ||
+           StringUtil::Contains(mode, "[madvise]");
+#else
+    return false;
+#endif
+  }();
+  return enabled;
+}
+
+size_t HugePageUtil::Advise(void *p, size_t n) {
+  auto start = (uintptr_t(p) + kHugePageSize - 1) & ~(kHugePageSize - 1);
+  auto end = (uintptr_t(p) + n) & ~(kHugePageSize - 1);
+  if (end <= start || !Enabled()) {
+    return 0;
+  }
+  auto &m = hugePageMetrics::Get();
+#ifdef OS_LINUX
+  if (madvise(reinterpret_cast<void *>(start), end - start, MADV_HUGEPAGE) !=
+      0) {
+    m.advise_errors.Add();
+    return 0;
+  }
+#endif
+  m.advised_bytes.Add(end - start);
+  return end - start;
+}
+
+void HugePageUtil::Reserve(bytes &b, size_t n) {
+  if (n <= b.capacity()) {
+    return;
+  }
+  if (n < kHugePageSize || !Enabled()) {
+    b.reserve(n);
+    return;
+  }
+  // the extra page leaves room for aligning the unaligned malloc result.
+  auto cap = (n + 2 * kHugePageSize - 1) & ~(kHugePageSize - 1);
+  // the new buffer is advised before the old contents are copied into it,
+  // so all its pages are first touched after the advice.
+  bytes nb;
+  nb.reserve(cap);
+  hugePageMetrics::Get().reserved_bytes.Add(cap);
+  Advise(nb.data(), nb.capacity());
+  nb.insert(nb.end(), b.begin(), b.end());
+  b.swap(nb);
+}
+
+int64_t HugePageUtil::ProcessHugePageBytes() {
+  std::ifstream file("/proc/self/smaps_rollup");
+  string line;
+  while (std::getline(file, line)) {
+    // AnonHugePages:      4096 kB
+    if (line.starts_with("AnonHugePages:")) {
+      try {
+        return std::stoll(line.substr(14)) * 1024;
+      } catch (...) {
+        return 0;
+      }
+    }
+  }
+  return 0;
+}
+
+} // namespace mergekv
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "types.h"
+#include <cstddef>
+#include <cstdint>
+
+namespace mergekv {
+
+const size_t kHugePageSize = 2 * 1024 * 1024;
+
+// HugePageUtil asks the kernel to back large buffers with transparent huge
+// pages, so scans and binary searches over them take fewer TLB misses.
+class HugePageUtil {
+public:
+  // Enabled returns true if transparent huge pages may be used, i.e. the
+  // kernel THP mode is "always" or "madvise".
+  static bool Enabled();
+
+  // Advise marks the 2MiB-aligned pages inside [p, p+n) with
+  // MADV_HUGEPAGE and returns the advised bytes. It is a no-op for ranges
+  // without a whole huge page and where THP is disabled.
+  static size_t Advise(void *p, size_t n);
+
+  // Reserve grows the capacity of b to at least n bytes in whole huge pages.
+  // The new buffer is advised before the contents of b are copied into it,
+  // so the page faults map huge pages right away. Small buffers are
+  // reserved as usual.
+  static void Reserve(bytes &b, size_t n);
+
+  // ProcessHugePageBytes returns AnonHugePages of the process, or 0 where
+  // /proc/self/smaps_rollup is missing.
+  static int64_t ProcessHugePageBytes();
+};
+
+} // namespace mergekv
@@ -1,4 +1,5 @@
 #include "io.h"
+#include "exception.h"
 #include <cstddef>
 #include <cstring>
 #include <tuple>
@@ -7,22 +8,52 @@ namespace mergekv {
 
 // ReadAll reads from r until eof and returns the data it read.
 void Reader::ReadAll(bytes &dst, Reader &r) {
-  if (dst.size() == 0) {
+  if (dst.capacity() == 0) {
     dst.reserve(512);
   }
   while (true) {
+    // read into the initialized part of dst, since growing it with resize
+    // after the read would overwrite the data with zeros.
     auto start = dst.size();
-    auto [n, eof] = r.Read(dst.data() + start, dst.capacity() - start);
+    if (start == dst.capacity()) {
+      dst.reserve(2 * dst.capacity());
+    }
+    dst.resize(dst.capacity());
+    auto [n, eof] = r.Read(dst.data() + start, dst.size() - start);
     dst.resize(start + n);
     if (eof) {
       break;
     }
-    if (dst.size() == dst.capacity()) {
-      auto pre_size = dst.size();
-      dst.push_back(0);
-      dst.resize(pre_size);
+  }
+}
+
+void Reader::ReadRecords(
+    Reader &r, size_t chunk_size, size_t max_pending,
+    const std::function<size_t(bytes_const_span)> &parse) {
+  bytes buf;
+  buf.reserve(chunk_size + max_pending);
+  while (true) {
+    auto start = buf.size();
+    buf.resize(start + chunk_size);
+    auto [n, eof] = r.Read(buf.data() + start, chunk_size);
+    buf.resize(start + n);
+    if (!buf.empty()) {
+      auto consumed = parse(buf);
+      buf.erase(buf.begin(), buf.begin() + consumed);
+    }
+    if (eof) {
+      break;
+    }
+    if (buf.size() > max_pending) {
+      throw InvalidInputException("too big record; more than %d bytes",
+                                  max_pending);
     }
   }
+  if (!buf.empty()) {
+    throw InvalidInputException("unexpected tail of %d bytes after the last "
+                                "record",
+                                buf.size());
+  }
 }
 
 // read n bytes from src_ to data, if eof, return true
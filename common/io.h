@@ -2,6 +2,7 @@
 
 #include "types.h"
 #include <cstddef>
+#include <functional>
 #include <tuple>
 
 namespace mergekv {
@@ -16,6 +17,15 @@ public:
   virtual std::tuple<size_t, bool> Read(void *data, size_t n) = 0;
   virtual std::tuple<size_t, bool> Read(bytes &buf) = 0;
   static void ReadAll(bytes &dst, Reader &r);
+  // ReadRecords reads r in chunks of chunk_size bytes and passes the data
+  // which isn't consumed yet to parse. parse returns the size of the
+  // complete records it consumed from the start of the data.
+  //
+  // It throws if more than max_pending bytes are left unconsumed, so the
+  // memory doesn't depend on the stream size, or if a partial record is
+  // left at the end of the stream.
+  static void ReadRecords(Reader &r, size_t chunk_size, size_t max_pending,
+                          const std::function<size_t(bytes_const_span)> &parse);
 };
 
 class BytesReader : public Reader {
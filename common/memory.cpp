@@ -1,10 +1,10 @@
 #include "memory.h"
 #include "exception.h"
+#include "file.h"
 #include "string_util.h"
 #include <fstream>
 #include <mutex>
-
-#define OS_DARWIN 1
+#include <sstream>
 
 #ifdef OS_LINUX
 #include <sys/sysinfo.h>
@@ -16,38 +16,38 @@
 
 namespace mergekv {
 
-const int kMaxInt = static_cast<int>(~0U >> 1);
 const double kAllowedPercent = 60;
 
 std::once_flag CgroupUtil::flag = std::once_flag();
+std::atomic<int64_t> CgroupUtil::allowed_memory{0};
+std::atomic<int64_t> CgroupUtil::remaining_memory{0};
+std::atomic<int64_t> CgroupUtil::memory_limit{0};
 
-int CgroupUtil::GetSystemMemory() {
+int64_t CgroupUtil::GetSystemMemory() {
 #ifdef OS_LINUX
   struct sysinfo info;
   if (sysinfo(&info) != 0) {
     throw IOException("cannot get system memory");
   }
-  auto total = kMaxInt;
-  if (uint64_t(total) / uint64_t(info.totalram) > uint64_t(info.unit)) {
-    total = int(uint64_t(info.totalram) * uint64_t(info.unit));
-  }
+  // the sizes are kept in int64_t, since hosts have more than 2GiB.
+  auto total = int64_t(uint64_t(info.totalram) * uint64_t(info.mem_unit));
 
   auto mem = GetMemoryLimit();
-  if (mem <= 0 || int64_t(int(mem)) != mem || int(mem) > total) {
+  if (mem <= 0 || mem > total) {
     mem = GetHierarchicalMemoryLimit();
-    if (mem <= 0 || int64_t(int(mem)) != mem || int(mem) > total) {
+    if (mem <= 0 || mem > total) {
       return total;
     }
   }
 
-  return int(mem);
+  return mem;
 #endif
 
 #ifdef OS_DARWIN
   int mib[2];
   mib[0] = CTL_HW;
   mib[1] = HW_MEMSIZE;
-  int size = 0;
+  int64_t size = 0;
   size_t len = sizeof(size);
   if (sysctl(mib, 2, &size, &len, nullptr, 0) != 0) {
     throw FatalException("cannot get system memory");
@@ -61,23 +61,20 @@ int CgroupUtil::GetSystemMemory() {
 }
 
 int64_t CgroupUtil::GetMemoryLimit() {
-  int64_t limit = 0;
   try {
-    limit = GetMemStat("memory.limit_in_bytes");
-  } catch (...) {
-    try {
-      limit = GetMemStatV2("memory.max");
-    } catch (...) {
-      return 0;
+    auto dir = CgroupV2Dir();
+    if (!dir.empty()) {
+      return ReadMemoryLimitV2(dir);
     }
+    return std::stoll(ReadFile("/sys/fs/cgroup/memory/memory.limit_in_bytes"));
+  } catch (...) {
+    return 0;
   }
-  return limit;
 }
 
 int64_t CgroupUtil::GetHierarchicalMemoryLimit() {
   try {
-    auto data = GetFileContent("memory.stat", "/sys/fs/cgroup/memory",
-                               "/proc/self/cgroup", "memory");
+    auto data = ReadFile("/sys/fs/cgroup/memory/memory.stat");
     auto mem_stat = GrepFirstMatch(data, "hierarchical_memory_limit", 1, " ");
     return std::stoll(mem_stat);
   } catch (...) {
@@ -85,75 +82,87 @@ int64_t CgroupUtil::GetHierarchicalMemoryLimit() {
   }
 }
 
-int64_t CgroupUtil::GetStatGeneric(const string &stat_name,
-                                   const string &sysfs_prefix,
-                                   const string &cgroup_path,
-                                   const string &cgroup_grep_line) {
-  auto data =
-      GetFileContent(stat_name, sysfs_prefix, cgroup_path, cgroup_grep_line);
-  data = StringUtil::trim_space(data);
-  return std::stoll(data);
+string CgroupUtil::CgroupV2Dir() {
+  try {
+    // the v2 hierarchy is the single "0::/path" line.
+    auto data = ReadFile("/proc/self/cgroup");
+    for (auto &line : StringUtil::Split(data, "\n")) {
+      if (line.starts_with("0::")) {
+        auto dir = "/sys/fs/cgroup" + StringUtil::trim_space(line.substr(3));
+        if (FileUtils::IsPathExist(dir + "/memory.max") ||
+            FileUtils::IsPathExist(dir + "/memory.pressure")) {
+          return dir;
+        }
+      }
+    }
+  } catch (...) {
+  }
+  return "";
 }
 
-string CgroupUtil::GetFileContent(const string &stat_name,
-                                  const string &sysfs_prefix,
-                                  const string &cgroup_path,
-                                  const string &cgroup_grep_line) {
-  string path = sysfs_prefix + "/" + stat_name;
+int64_t CgroupUtil::ReadMemoryLimitV2(const string &dir) {
+  int64_t limit = 0;
+  for (auto name : {"memory.max", "memory.high"}) {
+    auto path = dir + "/" + name;
+    if (!FileUtils::IsPathExist(path)) {
+      continue;
+    }
+    auto data = StringUtil::trim_space(ReadFile(path));
+    // "max" means no limit.
+    if (data.empty() || data == "max") {
+      continue;
+    }
+    auto v = std::stoll(data);
+    if (v > 0 && (limit == 0 || v < limit)) {
+      limit = v;
+    }
+  }
+  return limit;
+}
+
+string CgroupUtil::ReadFile(const string &path) {
   std::ifstream file(path);
   if (!file.is_open()) {
     throw IOException("cannot open file: %s", path);
   }
-  string cgroup_data;
-  file >> cgroup_data;
-  auto sub_path = GrepFirstMatch(cgroup_data, stat_name, 0, cgroup_grep_line);
-  string file_path = sysfs_prefix + "/" + sub_path + "/" + stat_name;
-  std::ifstream sub_file(file_path);
-  if (!sub_file.is_open()) {
-    throw IOException("cannot open file: %s", file_path);
-  }
-  string data;
-  sub_file >> data;
-  return data;
+  std::stringstream ss;
+  ss << file.rdbuf();
+  return ss.str();
 }
 
 string CgroupUtil::GrepFirstMatch(const string &data, const string &match,
                                   const int index, const string &delimiter) {
   auto lines = StringUtil::Split(data, "\n");
   for (auto &line : lines) {
-    if (!StringUtil::Contains(line, delimiter)) {
+    if (!StringUtil::Contains(line, match) ||
+        !StringUtil::Contains(line, delimiter)) {
       continue;
     }
     auto parts = StringUtil::Split(line, delimiter);
     if (index < parts.size()) {
-      StringUtil::trim_space(parts[index]);
+      return StringUtil::trim_space(parts[index]);
     }
   }
   throw InvalidInputException("cannot find %s in %s", match, data);
 }
 
-int64_t CgroupUtil::GetMemStat(const string &stat_name) {
-  return GetStatGeneric(stat_name, "/sys/fs/cgroup", "/proc/self/cgroup", "");
-}
-
-int64_t CgroupUtil::GetMemStatV2(const string &stat_name) {
-  return GetStatGeneric(stat_name, "/sys/fs/cgroup/memory", "/proc/self/cgroup",
-                        "memory");
-}
+void CgroupUtil::InitOnce() { Refresh(); }
 
-void CgroupUtil::InitOnce() {
-  memory_limit = GetSystemMemory();
-  auto percent = kAllowedPercent / 100.0;
-  allowed_memory = int(memory_limit * percent);
-  remaining_memory = memory_limit - allowed_memory;
+int64_t CgroupUtil::Refresh() {
+  auto limit = GetSystemMemory();
+  auto allowed = int64_t(double(limit) * kAllowedPercent / 100.0);
+  memory_limit = limit;
+  allowed_memory = allowed;
+  remaining_memory = limit - allowed;
+  return allowed;
 }
 
-int CgroupUtil::AllowedMemory() {
+int64_t CgroupUtil::AllowedMemory() {
   std::call_once(flag, InitOnce);
   return allowed_memory;
 }
 
-int CgroupUtil::RemainingMemory() {
+int64_t CgroupUtil::RemainingMemory() {
   std::call_once(flag, InitOnce);
   return remaining_memory;
 }
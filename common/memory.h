@@ -1,36 +1,39 @@
 #pragma once
 #include "types.h"
+#include <atomic>
 #include <cstdint>
 #include <mutex>
 
 namespace mergekv {
 class CgroupUtil {
 public:
-  static int AllowedMemory();
-  static int RemainingMemory();
-  static int GetSystemMemory();
+  static int64_t AllowedMemory();
+  static int64_t RemainingMemory();
+  static int64_t GetSystemMemory();
   static int64_t GetMemoryLimit();
   static int64_t GetHierarchicalMemoryLimit();
 
+  // Refresh re-reads the memory limit, so containers resized at runtime
+  // are noticed, and returns the new AllowedMemory.
+  static int64_t Refresh();
+
+  // CgroupV2Dir returns the cgroup v2 directory of the process, or an empty
+  // string on cgroup v1 hosts.
+  static string CgroupV2Dir();
+  // ReadMemoryLimitV2 returns the smaller of memory.max and memory.high in
+  // the cgroup v2 directory dir, or 0 if neither is set.
+  static int64_t ReadMemoryLimitV2(const string &dir);
+
 private:
   static string GrepFirstMatch(const string &data, const string &match,
                                const int index, const string &delimiter);
-  static string GetFileContent(const string &stat_name,
-                               const string &sysfs_prefix,
-                               const string &cgroup_path,
-                               const string &cgroup_grep_line);
-  static int64_t GetStatGeneric(const string &stat_name,
-                                const string &sysfs_prefix,
-                                const string &cgroup_path,
-                                const string &cgroup_grep_line);
-  static int64_t GetMemStat(const string &stat_name);
-  static int64_t GetMemStatV2(const string &stat_name);
+  static string ReadFile(const string &path);
   static void InitOnce();
 
-  static int allowed_memory;
-  static int remaining_memory;
-  static int memory_limit;
+  static std::atomic<int64_t> allowed_memory;
+  static std::atomic<int64_t> remaining_memory;
+  static std::atomic<int64_t> memory_limit;
   static std::once_flag flag;
 };
 
-} // namespace mergekv
\ No newline at end of file
+} // namespace mergekv
@@ -0,0 +1,135 @@
+#include "memory_budget.h"
+#include "exception.h"
+#include "memory.h"
+#include "metrics.h"
+#include <algorithm>
+#include <cstdio>
+#include <fmt/core.h>
+
+namespace mergekv {
+
+const char *MemoryConsumerName(MemoryConsumer c) {
+  switch (c) {
+  case MemoryConsumer::kRawItems:
+    return "raw_items";
+  case MemoryConsumer::kInMemoryParts:
+    return "inmemory_parts";
+  case MemoryConsumer::kCaches:
+    return "caches";
+  case MemoryConsumer::kMergeBuffers:
+    return "merge_buffers";
+  }
+  return "unknown";
+}
+
+MemoryBudget::MemoryBudget(int64_t total, const Shares &shares)
+    : shares_{shares.raw_items, shares.inmemory_parts, shares.caches,
+              shares.merge_buffers} {
+  double sum = 0;
+  for (auto share : shares_) {
+    if (share < 0) {
+      throw InvalidInputException("memory shares must not be negative");
+    }
+    sum += share;
+  }
+  if (sum > 1 + 1e-9) {
+    throw InvalidInputException("memory shares sum to %s; cannot exceed 1",
+                                fmt::format("{:.3f}", sum));
+  }
+  total_ = total;
+  UpdateLimits();
+}
+
+MemoryBudget &MemoryBudget::Global() {
+  static MemoryBudget budget(CgroupUtil::AllowedMemory());
+  static bool exported = (budget.ExportMetrics(), true);
+  (void)exported;
+  return budget;
+}
+
+void MemoryBudget::ExportMetrics() {
+  auto &r = MetricsRegistry::Global();
+  for (size_t i = 0; i < kMemoryConsumers; i++) {
+    auto name = MemoryConsumerName(MemoryConsumer(i));
+    usage_gauges_[i] = &r.GetGauge(
+        fmt::format("mergekv_memory_budget_usage_bytes{{consumer=\"{}\"}}",
+                    name),
+        "memory reserved from the budget by consumer");
+    limit_gauges_[i] = &r.GetGauge(
+        fmt::format("mergekv_memory_budget_limit_bytes{{consumer=\"{}\"}}",
+                    name),
+        "memory budget share by consumer");
+    usage_gauges_[i]->Set(usage_[i].load());
+    limit_gauges_[i]->Set(limits_[i].load());
+  }
+}
+
+void MemoryBudget::SetTotal(int64_t total) {
+  total_ = total;
+  UpdateLimits();
+  // a bigger allowance may unblock the waiters.
+  std::lock_guard<std::mutex> lock(lock_);
+  released_.notify_all();
+}
+
+void MemoryBudget::SetPressureFactor(double f) {
+  if (f <= 0 || f > 1) {
+    throw InvalidInputException("pressure factor must be in (0, 1]; got %s",
+                                fmt::format("{}", f));
+  }
+  pressure_factor_ = f;
+  UpdateLimits();
+  std::lock_guard<std::mutex> lock(lock_);
+  released_.notify_all();
+}
+
+void MemoryBudget::UpdateLimits() {
+  auto total = double(Total()) * PressureFactor();
+  for (size_t i = 0; i < kMemoryConsumers; i++) {
+    limits_[i] = int64_t(total * shares_[i]);
+    if (limit_gauges_[i] != nullptr) {
+      limit_gauges_[i]->Set(limits_[i].load());
+    }
+  }
+}
+
+void MemoryBudget::Reserve(MemoryConsumer c, int64_t n) {
+  auto i = size_t(c);
+  auto usage = usage_[i].fetch_add(n, std::memory_order_relaxed) + n;
+  if (usage_gauges_[i] != nullptr) {
+    usage_gauges_[i]->Set(usage);
+  }
+}
+
+void MemoryBudget::Release(MemoryConsumer c, int64_t n) {
+  auto i = size_t(c);
+  // releases run in destructors, so an accounting bug is logged and the
+  // usage clamped at zero instead of throwing.
+  auto usage = usage_[i].load(std::memory_order_relaxed);
+  int64_t next;
+  do {
+    next = std::max<int64_t>(usage - n, 0);
+  } while (!usage_[i].compare_exchange_weak(usage, next,
+                                            std::memory_order_relaxed));
+  if (usage < n) {
+    // fprintf, unlike fmt::print, doesn't throw on write errors.
+    std::fprintf(stderr,
+                 "BUG: %s released %lld bytes of memory while only %lld "
+                 "bytes are reserved\n",
+                 MemoryConsumerName(c), (long long)n, (long long)usage);
+  }
+  if (usage_gauges_[i] != nullptr) {
+    usage_gauges_[i]->Set(next);
+  }
+  // the lock orders the notification after the waiter checks the usage.
+  std::lock_guard<std::mutex> lock(lock_);
+  released_.notify_all();
+}
+
+bool MemoryBudget::WaitForRelease(MemoryConsumer c,
+                                  std::chrono::milliseconds timeout) {
+  std::unique_lock<std::mutex> lock(lock_);
+  return released_.wait_for(lock, timeout, [this, c] { return !OverLimit(c); });
+}
+
+} // namespace mergekv
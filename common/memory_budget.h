@@ -0,0 +1,124 @@
+#pragma once
+
+#include "types.h"
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+namespace mergekv {
+
+class Gauge;
+
+// MemoryConsumer is a kind of memory accounted by MemoryBudget.
+enum class MemoryConsumer {
+  // items added to tables and not flushed yet.
+  kRawItems = 0,
+  // parts built in memory by flushes and merges.
+  kInMemoryParts = 1,
+  // index and block caches.
+  kCaches = 2,
+  // the items of parts being merged.
+  kMergeBuffers = 3,
+};
+const size_t kMemoryConsumers = 4;
+
+const char *MemoryConsumerName(MemoryConsumer c);
+
+// MemoryBudget divides a memory allowance between the consumers and
+// accounts their usage.
+//
+// Consumers Reserve memory before using it and Release it afterwards.
+// Reservations never fail, so the budget doesn't break the callers which
+// can't wait; callers which can wait check OverLimit and slow down with
+// WaitForRelease, e.g. Table::AddItems flushes early or stalls.
+class MemoryBudget {
+public:
+  // Shares are the fractions of the allowance per consumer. Their sum must
+  // not exceed 1.
+  struct Shares {
+    double raw_items = 0.25;
+    double inmemory_parts = 0.25;
+    double caches = 0.35;
+    double merge_buffers = 0.15;
+  };
+
+  explicit MemoryBudget(int64_t total) : MemoryBudget(total, Shares()) {}
+  MemoryBudget(int64_t total, const Shares &shares);
+
+  // forbid copy
+  MemoryBudget(const MemoryBudget &) = delete;
+  MemoryBudget &operator=(const MemoryBudget &) = delete;
+
+  // Global returns the budget of CgroupUtil::AllowedMemory() shared by all
+  // the tables. Its usage and limits are exported as metrics.
+  static MemoryBudget &Global();
+
+  // SetTotal changes the allowance, e.g. after the container is resized.
+  void SetTotal(int64_t total);
+  int64_t Total() const { return total_.load(std::memory_order_relaxed); }
+  // SetPressureFactor scales all the limits by f in (0, 1] while the host is
+  // under memory pressure, so the consumers shed memory early.
+  void SetPressureFactor(double f);
+  double PressureFactor() const {
+    return pressure_factor_.load(std::memory_order_relaxed);
+  }
+
+  void Reserve(MemoryConsumer c, int64_t n);
+  // Release never throws, since destructors call it. Releasing more than
+  // reserved is logged and leaves the usage at zero.
+  void Release(MemoryConsumer c, int64_t n);
+
+  int64_t Usage(MemoryConsumer c) const {
+    return usage_[size_t(c)].load(std::memory_order_relaxed);
+  }
+  int64_t Limit(MemoryConsumer c) const {
+    return limits_[size_t(c)].load(std::memory_order_relaxed);
+  }
+  bool OverLimit(MemoryConsumer c) const { return Usage(c) > Limit(c); }
+
+  // WaitForRelease waits until c gets under its limit or timeout passes.
+  // It returns true if c is under its limit.
+  bool WaitForRelease(MemoryConsumer c, std::chrono::milliseconds timeout);
+
+private:
+  void UpdateLimits();
+  void ExportMetrics();
+
+  std::atomic<int64_t> total_{0};
+  std::atomic<double> pressure_factor_{1};
+  std::array<double, kMemoryConsumers> shares_{};
+  std::array<std::atomic<int64_t>, kMemoryConsumers> limits_{};
+  std::array<std::atomic<int64_t>, kMemoryConsumers> usage_{};
+
+  // the gauges of the global budget; null for the other budgets.
+  std::array<Gauge *, kMemoryConsumers> usage_gauges_{};
+  std::array<Gauge *, kMemoryConsumers> limit_gauges_{};
+
+  std::mutex lock_;
+  std::condition_variable released_;
+};
+
+// MemoryReservation releases its reservation on destruction.
+class MemoryReservation {
+public:
+  MemoryReservation(MemoryBudget &budget, MemoryConsumer c, int64_t n)
+      : budget_(budget), c_(c), n_(n) {
+    budget_.Reserve(c_, n_);
+  }
+  ~MemoryReservation() { budget_.Release(c_, n_); }
+
+  // forbid copy
+  MemoryReservation(const MemoryReservation &) = delete;
+  MemoryReservation &operator=(const MemoryReservation &) = delete;
+
+private:
+  MemoryBudget &budget_;
+  MemoryConsumer c_;
+  int64_t n_;
+};
+
+} // namespace mergekv
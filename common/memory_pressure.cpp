@@ -0,0 +1,228 @@
+#include "memory_pressure.h"
+#include "file.h"
+#include "memory.h"
+#include "memory_budget.h"
+#include "metrics.h"
+#include "string_util.h"
+#include <fmt/core.h>
+#include <fstream>
+#include <sstream>
+
+#ifdef OS_LINUX
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+namespace mergekv {
+
+// pressureMetrics are shared by all the monitors.
+struct pressureMetrics {
+  Counter &events;
+  Counter &limit_changes;
+  Gauge &under_pressure;
+
+  static pressureMetrics &Get() {
+    auto &r = MetricsRegistry::Global();
+    static pressureMetrics m{
+        r.GetCounter("mergekv_memory_pressure_events_total",
+                     "memory pressure events from PSI"),
+        r.GetCounter("mergekv_memory_limit_changes_total",
+                     "memory budget resizes after cgroup limit changes"),
+        r.GetGauge("mergekv_memory_pressure",
+                   "1 while the memory budget is shrunk by pressure")};
+    return m;
+  }
+};
+
+MemoryPressureMonitor::MemoryPressureMonitor(MemoryBudget &budget,
+                                             const string &cgroup_dir,
+                                             const Options &opts)
+    : budget_(budget), cgroup_dir_(cgroup_dir), opts_(opts) {}
+
+MemoryPressureMonitor::~MemoryPressureMonitor() {
+  Stop();
+#ifdef OS_LINUX
+  if (trigger_fd_ >= 0) {
+    close(trigger_fd_);
+  }
+#endif
+}
+
+MemoryPressureMonitor &MemoryPressureMonitor::Global() {
+  static MemoryPressureMonitor monitor(MemoryBudget::Global(),
+                                       CgroupUtil::CgroupV2Dir());
+  static bool started = (monitor.Start(), true);
+  (void)started;
+  return monitor;
+}
+
+void MemoryPressureMonitor::Start() {
+  std::lock_guard<std::mutex> lock(lock_);
+  if (!stopped_) {
+    return;
+  }
+  stopped_ = false;
+  // the metrics outlive the global monitor if they are created before it.
+  pressureMetrics::Get();
+  OpenTrigger();
+  thread_ = std::thread([this]() { Run(); });
+}
+
+void MemoryPressureMonitor::Stop() {
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    if (stopped_) {
+      return;
+    }
+    stopped_ = true;
+  }
+  stop_cv_.notify_all();
+  thread_.join();
+}
+
+uint64_t MemoryPressureMonitor::Subscribe(std::function<void(bool)> f) {
+  std::lock_guard<std::mutex> lock(listeners_lock_);
+  auto id = next_listener_id_++;
+  listeners_.emplace(id, std::move(f));
+  return id;
+}
+
+void MemoryPressureMonitor::Unsubscribe(uint64_t id) {
+  std::lock_guard<std::mutex> lock(listeners_lock_);
+  listeners_.erase(id);
+}
+
+void MemoryPressureMonitor::Run() {
+  while (true) {
+    {
+      std::lock_guard<std::mutex> lock(lock_);
+      if (stopped_) {
+        return;
+      }
+    }
+    auto triggered = WaitEvent(opts_.refresh_interval);
+    try {
+      Check(triggered);
+    } catch (const std::exception &e) {
+      fmt::print(stderr, "memory pressure monitor: {}\n", e.what());
+    }
+  }
+}
+
+void MemoryPressureMonitor::OpenTrigger() {
+#ifdef OS_LINUX
+  if (cgroup_dir_.empty() || trigger_fd_ >= 0) {
+    return;
+  }
+  auto path = cgroup_dir_ + "/memory.pressure";
+  int fd = open(path.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+  if (fd < 0) {
+    return;
+  }
+  auto trigger = fmt::format("some {} {}", opts_.stall_threshold.count(),
+                             opts_.window.count());
+  // the write fails without the permissions to create triggers; the avg10
+  // polling covers it then.
+  if (write(fd, trigger.c_str(), trigger.size() + 1) < 0) {
+    close(fd);
+    return;
+  }
+  trigger_fd_ = fd;
+#endif
+}
+
+bool MemoryPressureMonitor::WaitEvent(std::chrono::milliseconds timeout) {
+#ifdef OS_LINUX
+  if (trigger_fd_ >= 0) {
+    // poll in short slices, so Stop doesn't wait for the whole timeout.
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    while (std::chrono::steady_clock::now() < deadline) {
+      {
+        std::lock_guard<std::mutex> lock(lock_);
+        if (stopped_) {
+          return false;
+        }
+      }
+      struct pollfd pfd = {trigger_fd_, POLLPRI, 0};
+      int n = poll(&pfd, 1, 100);
+      if (n > 0 && (pfd.revents & POLLERR) != 0) {
+        // the cgroup is gone.
+        close(trigger_fd_);
+        trigger_fd_ = -1;
+        break;
+      }
+      if (n > 0 && (pfd.revents & POLLPRI) != 0) {
+        return true;
+      }
+    }
+    return false;
+  }
+#endif
+  std::unique_lock<std::mutex> lock(lock_);
+  stop_cv_.wait_for(lock, timeout, [this]() { return stopped_; });
+  return false;
+}
+
+double MemoryPressureMonitor::ParseAvg10(const string &data) {
+  // some avg10=0.00 avg60=0.00 avg300=0.00 total=0
+  for (auto &line : StringUtil::Split(data, "\n")) {
+    if (!line.starts_with("some ")) {
+      continue;
+    }
+    for (auto &field : StringUtil::Split(line, " ")) {
+      if (field.starts_with("avg10=")) {
+        try {
+          return std::stod(field.substr(6));
+        } catch (...) {
+          return -1;
+        }
+      }
+    }
+  }
+  return -1;
+}
+
+void MemoryPressureMonitor::Check(bool triggered) {
+  auto &m = pressureMetrics::Get();
+  auto total = CgroupUtil::Refresh();
+  if (total != budget_.Total()) {
+    m.limit_changes.Add();
+    budget_.SetTotal(total);
+  }
+
+  auto pressure = triggered;
+  if (!pressure && !cgroup_dir_.empty()) {
+    std::ifstream file(cgroup_dir_ + "/memory.pressure");
+    if (file.is_open()) {
+      std::stringstream ss;
+      ss << file.rdbuf();
+      pressure = ParseAvg10(ss.str()) >= opts_.avg10_threshold;
+    }
+  }
+  auto now = std::chrono::steady_clock::now();
+  if (pressure) {
+    m.events.Add();
+    last_pressure_ = now;
+    OnPressure();
+  } else if (UnderPressure() && now - last_pressure_ >= opts_.hold) {
+    under_pressure_ = false;
+    m.under_pressure.Set(0);
+    budget_.SetPressureFactor(1);
+  }
+
+  std::lock_guard<std::mutex> lock(listeners_lock_);
+  for (auto &[id, f] : listeners_) {
+    f(pressure);
+  }
+}
+
+void MemoryPressureMonitor::OnPressure() {
+  if (!UnderPressure()) {
+    under_pressure_ = true;
+    pressureMetrics::Get().under_pressure.Set(1);
+    budget_.SetPressureFactor(opts_.pressure_factor);
+  }
+}
+
+} // namespace mergekv
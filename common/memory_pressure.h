@@ -0,0 +1,106 @@
+#pragma once
+
+#include "types.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+
+namespace mergekv {
+
+class MemoryBudget;
+
+// MemoryPressureMonitor keeps a MemoryBudget in line with the cgroup.
+//
+// Every refresh_interval it re-reads the memory limit and resizes the
+// budget. It also watches the cgroup v2 memory.pressure file: a PSI trigger
+// wakes it as soon as the tasks stall on memory, and the avg10 share is
+// checked on every refresh where triggers are not permitted. Under pressure
+// the budget limits shrink by pressure_factor, so the caches shrink and the
+// tables flush early, and the listeners are called, e.g. to flush idle
+// tables. The limits recover after `hold` without pressure.
+class MemoryPressureMonitor {
+public:
+  struct Options {
+    std::chrono::milliseconds refresh_interval{5000};
+    // the trigger fires after stall_threshold of stalls within a window.
+    // Unprivileged triggers need the window to be a multiple of 2s.
+    std::chrono::microseconds stall_threshold{150000};
+    std::chrono::microseconds window{2000000};
+    // the "some avg10" percentage counted as pressure without triggers.
+    double avg10_threshold = 10;
+    double pressure_factor = 0.5;
+    std::chrono::milliseconds hold{10000};
+  };
+
+  // cgroup_dir is the cgroup v2 directory with memory.pressure; an empty
+  // dir only refreshes the limits.
+  MemoryPressureMonitor(MemoryBudget &budget, const string &cgroup_dir,
+                        const Options &opts);
+  MemoryPressureMonitor(MemoryBudget &budget, const string &cgroup_dir)
+      : MemoryPressureMonitor(budget, cgroup_dir, Options()) {}
+  ~MemoryPressureMonitor();
+
+  // forbid copy
+  MemoryPressureMonitor(const MemoryPressureMonitor &) = delete;
+  MemoryPressureMonitor &operator=(const MemoryPressureMonitor &) = delete;
+
+  // Global returns the started monitor of MemoryBudget::Global().
+  static MemoryPressureMonitor &Global();
+
+  void Start();
+  void Stop();
+
+  // Subscribe registers f to be called on the monitor thread after every
+  // refresh; pressure tells that the refresh found memory pressure. The
+  // calls without pressure serve as a periodic tick, e.g. to store aged
+  // in-memory parts. Unsubscribe waits for the running call of f.
+  uint64_t Subscribe(std::function<void(bool pressure)> f);
+  void Unsubscribe(uint64_t id);
+
+  // Check runs a single refresh and calls the listeners; triggered tells
+  // that the PSI trigger has fired. The monitor thread calls it, while tests
+  // may call it directly.
+  void Check(bool triggered);
+
+  bool UnderPressure() const {
+    return under_pressure_.load(std::memory_order_relaxed);
+  }
+  // HasTrigger returns true if the PSI trigger has been registered.
+  bool HasTrigger() const { return trigger_fd_ >= 0; }
+
+  // ParseAvg10 returns the "some avg10" percentage of the memory.pressure
+  // contents data, or -1 if data has none.
+  static double ParseAvg10(const string &data);
+
+private:
+  void Run();
+  void OpenTrigger();
+  // WaitEvent waits up to timeout for the trigger and returns true if it
+  // has fired.
+  bool WaitEvent(std::chrono::milliseconds timeout);
+  void OnPressure();
+
+  MemoryBudget &budget_;
+  string cgroup_dir_;
+  Options opts_;
+
+  int trigger_fd_ = -1;
+  std::atomic<bool> under_pressure_{false};
+  std::chrono::steady_clock::time_point last_pressure_;
+
+  std::mutex listeners_lock_;
+  std::map<uint64_t, std::function<void(bool)>> listeners_;
+  uint64_t next_listener_id_ = 0;
+
+  std::mutex lock_;
+  std::condition_variable stop_cv_;
+  bool stopped_ = true;
+  std::thread thread_;
+};
+
+} // namespace mergekv
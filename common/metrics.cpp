@@ -0,0 +1,247 @@
+#include "metrics.h"
+#include "exception.h"
+#include "file.h"
+#include "string_util.h"
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <fmt/core.h>
+
+namespace mergekv {
+
+size_t MetricShard() {
+  static std::atomic<size_t> next_shard{0};
+  thread_local size_t shard =
+      next_shard.fetch_add(1, std::memory_order_relaxed) % kMetricShards;
+  return shard;
+}
+
+uint64_t Counter::Value() const {
+  uint64_t n = 0;
+  for (auto &s : shards_) {
+    n += s.v.load(std::memory_order_relaxed);
+  }
+  return n;
+}
+
+size_t Histogram::BucketIndex(uint64_t v) {
+  if (v < kSubBuckets) {
+    return v;
+  }
+  size_t e = 63 - std::countl_zero(v);
+  if (e >= kMaxBits) {
+    return kBuckets - 1;
+  }
+  auto sub = (v >> (e - kSubBucketsBits)) & (kSubBuckets - 1);
+  return kSubBuckets + (e - kSubBucketsBits) * kSubBuckets + sub;
+}
+
+uint64_t Histogram::BucketUpperBound(size_t i) {
+  if (i < kSubBuckets) {
+    return i + 1;
+  }
+  auto e = kSubBucketsBits + (i - kSubBuckets) / kSubBuckets;
+  auto sub = (i - kSubBuckets) % kSubBuckets;
+  return (kSubBuckets + sub + 1) << (e - kSubBucketsBits);
+}
+
+void Histogram::Update(uint64_t v) {
+  auto &slot = shards_[MetricShard()];
+  auto s = slot.load(std::memory_order_acquire);
+  if (s == nullptr) {
+    std::lock_guard<std::mutex> lock(alloc_lock_);
+    s = slot.load(std::memory_order_acquire);
+    if (s == nullptr) {
+      owned_.push_back(std::make_unique<Shard>());
+      s = owned_.back().get();
+      slot.store(s, std::memory_order_release);
+    }
+  }
+  s->buckets[BucketIndex(v)].fetch_add(1, std::memory_order_relaxed);
+  s->count.fetch_add(1, std::memory_order_relaxed);
+  s->sum.fetch_add(v, std::memory_order_relaxed);
+}
+
+HistogramSnapshot Histogram::Snapshot() const {
+  HistogramSnapshot snap;
+  snap.buckets.resize(kBuckets);
+  for (auto &slot : shards_) {
+    auto s = slot.load(std::memory_order_acquire);
+    if (s == nullptr) {
+      continue;
+    }
+    for (size_t i = 0; i < kBuckets; i++) {
+      snap.buckets[i] += s->buckets[i].load(std::memory_order_relaxed);
+    }
+    snap.count += s->count.load(std::memory_order_relaxed);
+    snap.sum += s->sum.load(std::memory_order_relaxed);
+  }
+  return snap;
+}
+
+uint64_t HistogramSnapshot::Quantile(double q) const {
+  if (count == 0) {
+    return 0;
+  }
+  auto rank = uint64_t(std::ceil(std::clamp(q, 0.0, 1.0) * count));
+  rank = std::max<uint64_t>(rank, 1);
+  uint64_t n = 0;
+  for (size_t i = 0; i < buckets.size(); i++) {
+    n += buckets[i];
+    if (n >= rank) {
+      return Histogram::BucketUpperBound(i);
+    }
+  }
+  return Histogram::BucketUpperBound(buckets.size() - 1);
+}
+
+MetricsRegistry &MetricsRegistry::Global() {
+  static MetricsRegistry registry;
+  return registry;
+}
+
+MetricsRegistry::Metric &MetricsRegistry::GetMetric(const string &name,
+                                                    const string &help,
+                                                    MetricType type,
+                                                    double scale) {
+  std::lock_guard<std::mutex> lock(lock_);
+  auto [it, inserted] = metrics_.try_emplace(name);
+  auto &m = it->second;
+  if (inserted) {
+    m.type = type;
+    m.help = help;
+    m.scale = scale;
+    switch (type) {
+    case MetricType::kCounter:
+      m.counter = std::make_unique<Counter>();
+      break;
+    case MetricType::kGauge:
+      m.gauge = std::make_unique<Gauge>();
+      break;
+    case MetricType::kHistogram:
+      m.histogram = std::make_unique<Histogram>();
+      break;
+    }
+  } else if (m.type != type) {
+    throw FatalException("metric %s is registered with another type",
+                         name.c_str());
+  }
+  return m;
+}
+
+Counter &MetricsRegistry::GetCounter(const string &name, const string &help) {
+  return *GetMetric(name, help, MetricType::kCounter).counter;
+}
+
+Gauge &MetricsRegistry::GetGauge(const string &name, const string &help) {
+  return *GetMetric(name, help, MetricType::kGauge).gauge;
+}
+
+Histogram &MetricsRegistry::GetHistogram(const string &name,
+                                         const string &help, double scale) {
+  auto &m = GetMetric(name, help, MetricType::kHistogram, scale);
+  // the scale is fixed on registration, so lookups can't rescale the
+  // exposition.
+  if (m.scale != scale) {
+    throw FatalException("histogram %s is registered with scale %s",
+                         name.c_str(), fmt::format("{}", m.scale));
+  }
+  return *m.histogram;
+}
+
+// splitName splits `family{labels}` into the family and the labels.
+static std::pair<string_view, string_view> splitName(string_view name) {
+  auto n = name.find('{');
+  if (n == string_view::npos || name.back() != '}') {
+    return {name, string_view()};
+  }
+  return {name.substr(0, n), name.substr(n + 1, name.size() - n - 2)};
+}
+
+// withLabel returns the labels with the extra label appended.
+static string withLabel(string_view labels, string_view extra) {
+  if (labels.empty()) {
+    return fmt::format("{{{}}}", extra);
+  }
+  return fmt::format("{{{},{}}}", labels, extra);
+}
+
+void MetricsRegistry::WritePrometheus(string &dst) {
+  std::lock_guard<std::mutex> lock(lock_);
+  // the metrics of a family must be adjacent, while the map order puts
+  // `foo_bar` between `foo` and `foo{x="y"}`.
+  std::map<string_view, std::vector<const std::pair<const string, Metric> *>>
+      families;
+  for (auto &kv : metrics_) {
+    families[splitName(kv.first).first].push_back(&kv);
+  }
+
+  for (auto &[family, ms] : families) {
+    auto &first = ms.front()->second;
+    // the help is usually passed only for one metric of the family.
+    for (auto kv : ms) {
+      if (!kv->second.help.empty()) {
+        dst += fmt::format("# HELP {} {}\n", family, kv->second.help);
+        break;
+      }
+    }
+    static const char *type_names[] = {"counter", "gauge", "histogram"};
+    dst += fmt::format("# TYPE {} {}\n", family,
+                       type_names[int(first.type)]);
+    for (auto kv : ms) {
+      auto &m = kv->second;
+      auto labels = splitName(kv->first).second;
+      auto label_set =
+          labels.empty() ? string() : fmt::format("{{{}}}", labels);
+      switch (m.type) {
+      case MetricType::kCounter:
+        dst += fmt::format("{}{} {}\n", family, label_set, m.counter->Value());
+        break;
+      case MetricType::kGauge:
+        dst += fmt::format("{}{} {}\n", family, label_set, m.gauge->Value());
+        break;
+      case MetricType::kHistogram: {
+        auto snap = m.histogram->Snapshot();
+        // the exposition bounds are the powers of two, where the bucket
+        // bounds line up, so every scrape has the same le series. The last
+        // bucket also holds the values over its bound, so only +Inf
+        // counts it.
+        uint64_t n = 0;
+        size_t i = 0;
+        for (size_t e = 0; e < Histogram::kMaxBits; e++) {
+          auto bound = uint64_t(1) << e;
+          for (; i + 1 < snap.buckets.size() &&
+                 Histogram::BucketUpperBound(i) <= bound;
+               i++) {
+            n += snap.buckets[i];
+          }
+          auto le = fmt::format("le=\"{:.9g}\"", double(bound) * m.scale);
+          dst += fmt::format("{}_bucket{} {}\n", family, withLabel(labels, le),
+                             n);
+        }
+        dst += fmt::format("{}_bucket{} {}\n", family,
+                           withLabel(labels, "le=\"+Inf\""), snap.count);
+        dst += fmt::format("{}_sum{} {:.9g}\n", family, label_set,
+                           double(snap.sum) * m.scale);
+        dst += fmt::format("{}_count{} {}\n", family, label_set, snap.count);
+        break;
+      }
+      }
+    }
+  }
+}
+
+void MetricsRegistry::WritePrometheus(
+    const std::function<void(string_view)> &f) {
+  string dst;
+  WritePrometheus(dst);
+  f(dst);
+}
+
+void MetricsRegistry::MustWritePrometheusFile(const string &path) {
+  string dst;
+  WritePrometheus(dst);
+  FileUtils::MustWriteAtomic(path, StringUtil::BytesConstSpan(dst), true);
+}
+
+} // namespace mergekv
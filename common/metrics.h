@@ -0,0 +1,157 @@
+#pragma once
+
+#include "types.h"
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace mergekv {
+
+// the number of per-thread slots in counters and histograms. Threads are
+// spread over the slots, so concurrent updates rarely share a cache line.
+const size_t kMetricShards = 16;
+
+// MetricShard returns the slot of the calling thread.
+size_t MetricShard();
+
+// Counter is a monotonically increasing counter. Updates are lock-free and
+// go to the slot of the calling thread; Value sums the slots.
+class Counter {
+public:
+  void Add(uint64_t n = 1) {
+    shards_[MetricShard()].v.fetch_add(n, std::memory_order_relaxed);
+  }
+  uint64_t Value() const;
+
+private:
+  struct alignas(64) Shard {
+    std::atomic<uint64_t> v{0};
+  };
+  std::array<Shard, kMetricShards> shards_;
+};
+
+// Gauge is a value which may go up and down.
+class Gauge {
+public:
+  void Set(int64_t v) { v_.store(v, std::memory_order_relaxed); }
+  void Add(int64_t n) { v_.fetch_add(n, std::memory_order_relaxed); }
+  int64_t Value() const { return v_.load(std::memory_order_relaxed); }
+
+private:
+  std::atomic<int64_t> v_{0};
+};
+
+// HistogramSnapshot is the sum of the histogram slots at some point.
+struct HistogramSnapshot {
+  std::vector<uint64_t> buckets;
+  uint64_t count = 0;
+  uint64_t sum = 0;
+
+  // Quantile returns the upper bound of the bucket holding the q-th
+  // quantile, e.g. q=0.99 for p99.
+  uint64_t Quantile(double q) const;
+};
+
+// Histogram is a log-linear histogram in the HDR style: every power of two
+// is split into kSubBuckets linear buckets, so the relative error stays
+// under 1/kSubBuckets over the whole range.
+class Histogram {
+public:
+  static constexpr size_t kSubBucketsBits = 3;
+  static constexpr size_t kSubBuckets = size_t(1) << kSubBucketsBits;
+  // values up to 2^kMaxBits; larger values go to the last bucket.
+  static constexpr size_t kMaxBits = 44;
+  static constexpr size_t kBuckets =
+      kSubBuckets + (kMaxBits - kSubBucketsBits) * kSubBuckets;
+
+  void Update(uint64_t v);
+  // UpdateDuration records d in nanoseconds.
+  void UpdateDuration(std::chrono::steady_clock::duration d) {
+    Update(std::chrono::duration_cast<std::chrono::nanoseconds>(d).count());
+  }
+  HistogramSnapshot Snapshot() const;
+
+  static size_t BucketIndex(uint64_t v);
+  // BucketUpperBound returns the smallest value above the bucket i.
+  static uint64_t BucketUpperBound(size_t i);
+
+private:
+  struct alignas(64) Shard {
+    std::array<std::atomic<uint64_t>, kBuckets> buckets{};
+    std::atomic<uint64_t> count{0};
+    std::atomic<uint64_t> sum{0};
+  };
+  // the slots are allocated on the first update from them.
+  std::array<std::atomic<Shard *>, kMetricShards> shards_{};
+  std::mutex alloc_lock_;
+  std::vector<std::unique_ptr<Shard>> owned_;
+};
+
+// HistogramTimer records the time between its creation and destruction.
+class HistogramTimer {
+public:
+  explicit HistogramTimer(Histogram &h)
+      : h_(h), start_(std::chrono::steady_clock::now()) {}
+  ~HistogramTimer() {
+    h_.UpdateDuration(std::chrono::steady_clock::now() - start_);
+  }
+
+private:
+  Histogram &h_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+// MetricsRegistry holds the named metrics and renders them in the
+// Prometheus text exposition format.
+//
+// Metric names may carry labels, e.g. `mergekv_zstd_bytes_total{op="x"}`;
+// metrics with the same name before the labels form a family. Metrics are
+// never removed, so the returned references stay valid, and callers keep
+// them in function-local statics to skip the lookup.
+class MetricsRegistry {
+public:
+  static MetricsRegistry &Global();
+
+  Counter &GetCounter(const string &name, const string &help = "");
+  Gauge &GetGauge(const string &name, const string &help = "");
+  // GetHistogram returns the histogram for name. The recorded values are
+  // multiplied by scale in the exposition, e.g. 1e-9 for nanoseconds
+  // exposed as seconds. It throws if name is registered with another scale.
+  Histogram &GetHistogram(const string &name, const string &help = "",
+                          double scale = 1e-9);
+
+  // WritePrometheus appends all the metrics to dst in the Prometheus text
+  // format.
+  void WritePrometheus(string &dst);
+  // WritePrometheus passes the exposition to f, e.g. for an HTTP handler.
+  void WritePrometheus(const std::function<void(string_view)> &f);
+  // MustWritePrometheusFile atomically replaces path with the exposition,
+  // so the scrapers never see a partial file.
+  void MustWritePrometheusFile(const string &path);
+
+private:
+  enum class MetricType { kCounter, kGauge, kHistogram };
+  struct Metric {
+    MetricType type;
+    string help;
+    double scale = 1;
+    std::unique_ptr<Counter> counter;
+    std::unique_ptr<Gauge> gauge;
+    std::unique_ptr<Histogram> histogram;
+  };
+
+  Metric &GetMetric(const string &name, const string &help, MetricType type,
+                    double scale = 1);
+
+  std::mutex lock_;
+  std::map<string, Metric> metrics_;
+};
+
+} // namespace mergekv
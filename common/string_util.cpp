@@ -7,7 +7,8 @@
 namespace mergekv {
 
 const string hextable = "0123456789abcdef";
-const string reverseHexTable =
+// a char array keeps the embedded NULs, unlike a string built from a literal.
+const char reverseHexTable[] =
     "\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff"
     "\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff"
     "\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff"
@@ -116,7 +117,8 @@ string StringUtil::Format(const std::vector<uint8_t> &value) {
 }
 
 bytes StringUtil::EncodeHex(bytes_const_span value) {
-  bytes dst(value.size() * 2);
+  bytes dst;
+  dst.reserve(value.size() * 2);
   for (auto byte : value) {
     dst.insert(dst.end(), {uint8_t(hextable[(byte >> 4)]),
                            uint8_t(hextable[(byte & 0x0f)])});
@@ -128,16 +130,17 @@ bytes StringUtil::DecodeHex(bytes_const_span value) {
   if (value.size() % 2 != 0) {
     throw InvalidInputException("Invalid hex string length");
   }
-  bytes dst(value.size() / 2);
+  bytes dst;
+  dst.reserve(value.size() / 2);
   for (size_t i = 0; i < value.size(); i += 2) {
     uint8_t high = reverseHexTable[value[i]];
     uint8_t low = reverseHexTable[value[i + 1]];
     if (high > 0x0f) {
-      throw InvalidInputException("Invalid hex character: %c", high);
+      throw InvalidInputException("Invalid hex character: %c", value[i]);
     }
 
     if (low > 0x0f) {
-      throw InvalidInputException("Invalid hex character: %c", low);
+      throw InvalidInputException("Invalid hex character: %c", value[i + 1]);
     }
 
     dst.push_back((high << 4) | low);
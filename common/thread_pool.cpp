@@ -0,0 +1,79 @@
+#include "thread_pool.h"
+#include <cstddef>
+#include <exception>
+#include <future>
+#include <mutex>
+#include <thread>
+
+namespace mergekv {
+
+ThreadPool::ThreadPool(size_t threads) {
+  if (threads == 0) {
+    threads = 1;
+  }
+  workers_.reserve(threads);
+  for (size_t i = 0; i < threads; i++) {
+    workers_.emplace_back([this]() { Worker(); });
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    stopped_ = true;
+  }
+  cv_.notify_all();
+  for (auto &w : workers_) {
+    w.join();
+  }
+}
+
+void ThreadPool::Worker() {
+  while (true) {
+    std::function<void()> task;
+    {
+      std::unique_lock<std::mutex> lock(mu_);
+      cv_.wait(lock, [this]() { return stopped_ || !tasks_.empty(); });
+      if (tasks_.empty()) {
+        // stopped and drained
+        return;
+      }
+      task = std::move(tasks_.front());
+      tasks_.pop_front();
+    }
+    task();
+  }
+}
+
+void ThreadPool::ParallelFor(size_t n, const std::function<void(size_t)> &f) {
+  if (n == 1) {
+    f(0);
+    return;
+  }
+  std::vector<std::future<void>> results;
+  results.reserve(n);
+  for (size_t i = 0; i < n; i++) {
+    results.push_back(Submit([&f, i]() { f(i); }));
+  }
+
+  std::exception_ptr err;
+  for (auto &r : results) {
+    try {
+      r.get();
+    } catch (...) {
+      if (!err) {
+        err = std::current_exception();
+      }
+    }
+  }
+  if (err) {
+    std::rethrow_exception(err);
+  }
+}
+
+size_t ThreadPool::DefaultConcurrency() {
+  auto n = std::thread::hardware_concurrency();
+  return n == 0 ? 1 : n;
+}
+
+} // namespace mergekv
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace mergekv {
+
+class ThreadPool {
+public:
+  // forbid copy
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  explicit ThreadPool(size_t threads = DefaultConcurrency());
+  ~ThreadPool();
+
+  // Submit schedules f on the pool. Exceptions thrown by f are rethrown
+  // from the returned future.
+  template <class F> std::future<void> Submit(F &&f) {
+    auto task =
+        std::make_shared<std::packaged_task<void()>>(std::forward<F>(f));
+    auto result = task->get_future();
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      tasks_.emplace_back([task]() { (*task)(); });
+    }
+    cv_.notify_one();
+    return result;
+  }
+
+  // ParallelFor calls f(i) for every i in [0, n) on the pool and waits for
+  // all the calls to finish. The first exception is rethrown after that.
+  //
+  // It must not be called from the pool workers, since it blocks them.
+  void ParallelFor(size_t n, const std::function<void(size_t)> &f);
+
+  size_t size() const { return workers_.size(); }
+
+  static size_t DefaultConcurrency();
+
+private:
+  void Worker();
+
+  std::vector<std::thread> workers_;
+  std::deque<std::function<void()>> tasks_;
+  std::mutex mu_;
+  std::condition_variable cv_;
+  bool stopped_ = false;
+};
+
+} // namespace mergekv
@@ -0,0 +1,180 @@
+#include "block_decoder.h"
+#include "encoding.h"
+#include "encoding_util.h"
+#include "exception.h"
+#include "metrics.h"
+#include "types.h"
+#include <cstddef>
+#include <cstdint>
+
+namespace mergekv {
+
+void BlockDecoder::Init(const StorageBlock &block, bytes_const_span first_item,
+                        bytes_const_span common_prefix, uint32_t items_count,
+                        MarshalType mt) {
+  Init(*block.items_data, *block.lens_data, first_item, common_prefix,
+       items_count, mt);
+  block_ = block;
+}
+
+void BlockDecoder::Init(bytes_const_span items_data,
+                        bytes_const_span lens_data,
+                        bytes_const_span first_item,
+                        bytes_const_span common_prefix, uint32_t items_count,
+                        MarshalType mt) {
+  if (items_count == 0) {
+    throw FatalException("BlockDecoder: items_count is 0");
+  }
+  if (!HasPrefix(common_prefix, first_item)) {
+    throw InvalidInputException(
+        "BlockDecoder: first_item must start with common_prefix; "
+        "first_item=%X; common_prefix=%X",
+        first_item, common_prefix);
+  }
+  // the items are decoded lazily, so only the decompression is timed.
+  static auto &init_duration = MetricsRegistry::Global().GetHistogram(
+      "mergekv_block_unmarshal_duration_seconds{decoder=\"lazy\"}");
+  HistogramTimer timer(init_duration);
+
+  block_ = StorageBlock(nullptr, nullptr);
+  block_items_ = items_data;
+  block_lens_ = lens_data;
+  mt_ = mt;
+  items_count_ = items_count;
+  cp_len_ = common_prefix.size();
+  first_item_.assign(first_item.begin(), first_item.end());
+
+  switch (mt) {
+  case marshalTypePlain:
+    InitPlain();
+    break;
+  case marshalTypeSZTD:
+    InitZSTD();
+    break;
+  default:
+    throw InvalidInputException("BlockDecoder: unknown marshal type %d", mt);
+  }
+  Rewind();
+}
+
+void BlockDecoder::InitPlain() {
+  // plain blocks keep the suffixes and the fixed 8 bytes lens as is,
+  // so they can be read directly from the block buffers.
+  items_data_ = block_items_;
+  prefix_lens_data_ = bytes_const_span();
+  item_lens_data_ = block_lens_;
+  if (item_lens_data_.size() != 8 * size_t(items_count_ - 1)) {
+    throw InvalidInputException(
+        "unexpected lensData size for %d plain items; got %d bytes; want %d "
+        "bytes",
+        items_count_, item_lens_data_.size(), 8 * size_t(items_count_ - 1));
+  }
+}
+
+void BlockDecoder::InitZSTD() {
+  lens_buf_.clear();
+  EncodingUtil::DecompressZSTD(lens_buf_, block_lens_);
+
+  // lens_buf_ contains items_count-1 varint prefix lens followed by
+  // items_count-1 varint item lens. Every varint ends with a byte < 0x80,
+  // so the boundary is found without decoding the values.
+  size_t want = items_count_ - 1;
+  size_t ends = 0, split = 0;
+  for (size_t i = 0; i < lens_buf_.size(); i++) {
+    if (lens_buf_[i] >= 0x80) {
+      continue;
+    }
+    ends++;
+    if (ends == want) {
+      split = i + 1;
+    }
+  }
+  if (ends != 2 * want ||
+      (!lens_buf_.empty() && lens_buf_.back() >= 0x80)) {
+    throw InvalidInputException(
+        "unexpected number of encoded lens for %d items; got %d; want %d",
+        items_count_, ends, 2 * want);
+  }
+  auto lens = bytes_const_span(lens_buf_);
+  prefix_lens_data_ = lens.subspan(0, split);
+  item_lens_data_ = lens.subspan(split);
+
+  items_buf_.clear();
+  EncodingUtil::DecompressZSTD(items_buf_, block_items_);
+  items_data_ = items_buf_;
+}
+
+void BlockDecoder::Rewind() {
+  items_tail_ = items_data_;
+  prefix_lens_tail_ = prefix_lens_data_;
+  item_lens_tail_ = item_lens_data_;
+  pre_prefix_len_ = 0;
+  pre_item_len_ = 0;
+  idx_ = 0;
+  item_.clear();
+}
+
+bool BlockDecoder::Next() {
+  if (idx_ >= items_count_) {
+    return false;
+  }
+  if (idx_ == 0) {
+    item_.assign(first_item_.begin(), first_item_.end());
+    pre_item_len_ = first_item_.size() - cp_len_;
+    idx_++;
+    return true;
+  }
+
+  uint64_t prefix_len = 0, item_len = 0;
+  if (mt_ == marshalTypePlain) {
+    item_len = EncodingUtil::UnmarshalUint64(item_lens_tail_);
+    item_lens_tail_ = item_lens_tail_.subspan(8);
+  } else {
+    auto [x_prefix_len, n_prefix] =
+        EncodingUtil::UnmarshalVarUint64(prefix_lens_tail_);
+    auto [x_item_len, n_item] =
+        EncodingUtil::UnmarshalVarUint64(item_lens_tail_);
+    if (n_prefix <= 0 || n_item <= 0) {
+      throw InvalidInputException("cannot unmarshal lens for item %d", idx_);
+    }
+    prefix_lens_tail_ = prefix_lens_tail_.subspan(n_prefix);
+    item_lens_tail_ = item_lens_tail_.subspan(n_item);
+    prefix_len = x_prefix_len ^ pre_prefix_len_;
+    item_len = x_item_len ^ pre_item_len_;
+  }
+
+  if (prefix_len > item_len) {
+    throw InvalidInputException("prefix_len %d is larger than item_len %d",
+                                prefix_len, item_len);
+  }
+  if (prefix_len > pre_item_len_) {
+    throw InvalidInputException(
+        "prefix_len %d is larger than the previous item_len %d", prefix_len,
+        pre_item_len_);
+  }
+  auto suffix_len = item_len - prefix_len;
+  if (items_tail_.size() < suffix_len) {
+    throw InvalidInputException(
+        "not enought data decoding %d item; suffix_len=%d; bs.size=%d", idx_,
+        suffix_len, items_tail_.size());
+  }
+
+  // the current item shares common_prefix and prefix_len bytes with the
+  // previous one, which is still in item_.
+  item_.resize(cp_len_ + prefix_len);
+  item_.insert(item_.end(), items_tail_.begin(),
+               items_tail_.begin() + suffix_len);
+  items_tail_ = items_tail_.subspan(suffix_len);
+  pre_prefix_len_ = prefix_len;
+  pre_item_len_ = item_len;
+  idx_++;
+
+  if (idx_ == items_count_ && !items_tail_.empty()) {
+    throw InvalidInputException(
+        "unexpected tail left after itemsData with len %d: %s",
+        items_tail_.size(), items_tail_);
+  }
+  return true;
+}
+
+} // namespace mergekv
@@ -0,0 +1,134 @@
+#pragma once
+
+#include "encoding.h"
+#include "inmemory_block.h"
+#include "types.h"
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <memory>
+
+namespace mergekv {
+
+// BlockDecoder lazily decodes items from a marshaled block.
+//
+// Unlike InMemoryBlock::UnmarshalData it doesn't materialize all the items.
+// Every item is reconstructed on demand into a reusable scratch buffer, so
+// scans which stop early don't pay for the rest of the block.
+//
+// The returned items are valid until the next call to Next or Rewind.
+class BlockDecoder {
+public:
+  class Iterator {
+  public:
+    using iterator_category = std::input_iterator_tag;
+    using value_type = bytes_const_span;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const bytes_const_span *;
+    using reference = bytes_const_span;
+
+    Iterator() : decoder_(nullptr) {}
+    explicit Iterator(BlockDecoder *decoder) : decoder_(decoder) {
+      if (!decoder_->Next()) {
+        decoder_ = nullptr;
+      }
+    }
+
+    bytes_const_span operator*() const { return decoder_->Item(); }
+    Iterator &operator++() {
+      if (!decoder_->Next()) {
+        decoder_ = nullptr;
+      }
+      return *this;
+    }
+    void operator++(int) { ++*this; }
+    bool operator==(const Iterator &other) const {
+      return decoder_ == other.decoder_;
+    }
+    bool operator!=(const Iterator &other) const { return !(*this == other); }
+
+  private:
+    BlockDecoder *decoder_;
+  };
+
+  BlockDecoder() = default;
+  ~BlockDecoder() = default;
+
+  // forbid copy, since Item() points into the decoder scratch buffers
+  BlockDecoder(const BlockDecoder &) = delete;
+  BlockDecoder &operator=(const BlockDecoder &) = delete;
+
+  // Init prepares the decoder for reading items from block.
+  //
+  // The block buffers are shared with the decoder, so they remain valid
+  // while the decoder is in use.
+  void Init(const StorageBlock &block, bytes_const_span first_item,
+            bytes_const_span common_prefix, uint32_t items_count,
+            MarshalType mt);
+  // Init prepares the decoder for reading items from the encoded items_data
+  // and lens_data without copying them, e.g. from the buffers of an
+  // in-memory part. They must remain valid while the decoder is in use.
+  void Init(bytes_const_span items_data, bytes_const_span lens_data,
+            bytes_const_span first_item, bytes_const_span common_prefix,
+            uint32_t items_count, MarshalType mt);
+
+  // Next advances to the next item. It returns false if there are no more
+  // items in the block.
+  bool Next();
+
+  // Rewind moves the decoder back before the first item without decoding
+  // the block again.
+  void Rewind();
+
+  bytes_const_span Item() const { return item_; }
+  string_view ItemString() const {
+    return string_view(reinterpret_cast<const char *>(item_.data()),
+                       item_.size());
+  }
+  uint32_t items_count() const { return items_count_; }
+
+  // begin rewinds the decoder, so every iteration starts from the first item.
+  Iterator begin() {
+    Rewind();
+    return Iterator(this);
+  }
+  Iterator end() { return Iterator(); }
+
+private:
+  void InitPlain();
+  void InitZSTD();
+
+private:
+  // block_ keeps the buffers of a StorageBlock alive; it is empty for the
+  // blocks decoded from spans.
+  StorageBlock block_{nullptr, nullptr};
+  // the encoded suffixes and lens of the block.
+  bytes_const_span block_items_;
+  bytes_const_span block_lens_;
+  MarshalType mt_ = marshalTypePlain;
+  uint32_t items_count_ = 0;
+  size_t cp_len_ = 0;
+  bytes first_item_;
+
+  // decompressed lens and suffixes for marshalTypeSZTD blocks.
+  bytes lens_buf_;
+  bytes items_buf_;
+
+  // the encoded suffixes and lens of the items following the first one.
+  bytes_const_span items_data_;
+  bytes_const_span prefix_lens_data_;
+  bytes_const_span item_lens_data_;
+
+  // the remaining encoded data for the items after the current one.
+  bytes_const_span items_tail_;
+  bytes_const_span prefix_lens_tail_;
+  bytes_const_span item_lens_tail_;
+
+  uint64_t pre_prefix_len_ = 0;
+  uint64_t pre_item_len_ = 0;
+  uint32_t idx_ = 0;
+
+  bytes item_;
+};
+
+} // namespace mergekv
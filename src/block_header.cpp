@@ -3,20 +3,17 @@
 #include "encoding_util.h"
 #include "exception.h"
 #include "inmemory_block.h"
+#include "metaindex_row.h"
 #include "string_util.h"
 #include "types.h"
+#include <algorithm>
 #include <cstdint>
 
 namespace mergekv {
 
 void BlockHeader::Reset() {
-  if (no_copy) {
-    common_prefix = bytes_span();
-    first_item = bytes_span();
-  } else {
-    common_prefix.subspan(0, 0);
-    first_item.subspan(0, 0);
-  }
+  common_prefix.clear();
+  first_item.clear();
   items_count = 0;
   items_block_offset = 0;
   lens_block_offset = 0;
@@ -32,31 +29,47 @@ void BlockHeader::Marshal(bytes &dst) {
   EncodingUtil::MarshalUint32(dst, items_count);
   EncodingUtil::MarshalUint64(dst, items_block_offset);
   EncodingUtil::MarshalUint64(dst, lens_block_offset);
-  EncodingUtil::MarshalUint64(dst, items_block_size);
-  EncodingUtil::MarshalUint64(dst, lens_block_size);
+  EncodingUtil::MarshalUint32(dst, items_block_size);
+  EncodingUtil::MarshalUint32(dst, lens_block_size);
 }
 
-// UnmarshalNoCopy unmarshals bh from src without copying the data from src.
+// Unmarshal unmarshals bh from src.
 //
-// The src must remain unchanged while bh is in use.
-bytes_const_span BlockHeader::UnmarshalNoCopy(bytes_const_span src) {
-  no_copy = true;
+// The items are copied into bh, so use BlockHeaderView for decoding the
+// headers in place.
+bytes_const_span BlockHeader::Unmarshal(bytes_const_span src) {
+  BlockHeaderView v;
+  auto n = v.Unmarshal(src, 0);
+  auto cp = v.CommonPrefix(src);
+  auto fi = v.FirstItem(src);
+  common_prefix.assign(cp.begin(), cp.end());
+  first_item.assign(fi.begin(), fi.end());
+  mt = v.mt;
+  items_count = v.items_count;
+  items_block_offset = v.items_block_offset;
+  lens_block_offset = v.lens_block_offset;
+  items_block_size = v.items_block_size;
+  lens_block_size = v.lens_block_size;
+  return src.subspan(n);
+}
 
+size_t BlockHeaderView::Unmarshal(bytes_const_span block, size_t offset) {
+  auto src = block.subspan(offset);
   auto [cp, n_size] = EncodingUtil::UnmarshalBytes(src);
   if (n_size <= 0) {
     throw InvalidInputException("cannot unmarshal commonPrefix");
   }
-
+  common_prefix_offset = uint32_t(cp.data() - block.data());
+  common_prefix_len = uint32_t(cp.size());
   src = src.subspan(n_size);
-  common_prefix = cp;
 
   auto [fi, _n_size] = EncodingUtil::UnmarshalBytes(src);
-  if (n_size <= 0) {
+  if (_n_size <= 0) {
     throw InvalidInputException("cannot unmarshal firstItem");
   }
-
+  first_item_offset = uint32_t(fi.data() - block.data());
+  first_item_len = uint32_t(fi.size());
   src = src.subspan(_n_size);
-  first_item = fi;
 
   if (src.size() < 1) {
     throw InvalidInputException("cannot unmarshal marshalType");
@@ -112,18 +125,26 @@ bytes_const_span BlockHeader::UnmarshalNoCopy(bytes_const_span src) {
         2 * 8 * kMaxInmemoryBlockSize);
   }
 
-  return src;
+  return block.size() - src.size();
 }
 
-// unmarshalBlockHeadersNoCopy unmarshals all the block headers from src,
-// appends them to dst and returns the appended result.
-//
-// Block headers must be sorted by bh.firstItem.
+static void checkSorted(std::span<BlockHeader> bhs) {
+  if (!std::is_sorted(bhs.begin(), bhs.end(),
+                      [](const BlockHeader &a, const BlockHeader &b) {
+                        return StringUtil::ToStringView(a.first_item) <
+                               StringUtil::ToStringView(b.first_item);
+                      })) {
+    throw InvalidInputException("block headers are not sorted");
+  }
+}
+
+// UnmarshalBHs unmarshals bh_count block headers from src and appends them
+// to dst.
 //
-// It is expected that src remains unchanged while rhe returned blocks are in
-// use.
-void UnmarshalBHNoCopy(std::vector<BlockHeader> &dst, bytes_const_span src,
-                       int bh_count) {
+// Block headers must be sorted by bh.firstItem. The headers own their items,
+// so src may change once this returns.
+void BlockHeader::UnmarshalBHs(std::vector<BlockHeader> &dst,
+                               bytes_const_span src, int bh_count) {
   if (bh_count <= 0) {
     throw InvalidInputException("invalid bh_count");
   }
@@ -132,7 +153,7 @@ void UnmarshalBHNoCopy(std::vector<BlockHeader> &dst, bytes_const_span src,
   dst.resize(dst_len + bh_count);
   for (int i = 0; i < bh_count; i++) {
     auto &bh = dst[dst_len + i];
-    src = bh.UnmarshalNoCopy(src);
+    src = bh.Unmarshal(src);
   }
 
   if (src.size() != 0) {
@@ -141,14 +162,59 @@ void UnmarshalBHNoCopy(std::vector<BlockHeader> &dst, bytes_const_span src,
                                 bh_count, src.size());
   }
 
-  auto new_bhs = std::span<BlockHeader>(dst.data() + dst_len, bh_count);
-  if (!std::is_sorted(new_bhs.begin(), new_bhs.end(),
-                      [](const BlockHeader &a, const BlockHeader &b) {
-                        return StringUtil::ToStringView(a.first_item) <
-                               StringUtil::ToStringView(b.first_item);
-                      })) {
-    throw InvalidInputException("block headers are not sorted");
+  checkSorted(std::span<BlockHeader>(dst.data() + dst_len, bh_count));
+}
+
+size_t BlockHeader::MarshaledSize(bytes_const_span src) {
+  size_t size = 0;
+  // common_prefix and first_item
+  for (int i = 0; i < 2; i++) {
+    auto [len, n] = EncodingUtil::UnmarshalVarUint64(src.subspan(size));
+    if (n < 0) {
+      throw InvalidInputException("cannot unmarshal block header field length");
+    }
+    if (n == 0) {
+      return 0;
+    }
+    size += n + len;
+    if (src.size() < size) {
+      return 0;
+    }
+  }
+  size += 1 + sizeof(uint32_t) + 2 * sizeof(uint64_t) + 2 * sizeof(uint32_t);
+  return src.size() < size ? 0 : size;
+}
+
+void BlockHeader::UnmarshalBHs(std::vector<BlockHeader> &dst, Reader &r,
+                               int bh_count) {
+  if (bh_count <= 0) {
+    throw InvalidInputException("invalid bh_count");
   }
+  auto dst_len = dst.size();
+  dst.reserve(dst_len + bh_count);
+
+  auto parse = [&](bytes_const_span src) {
+    size_t consumed = 0;
+    while (auto size = MarshaledSize(src.subspan(consumed))) {
+      if (dst.size() - dst_len == size_t(bh_count)) {
+        throw InvalidInputException(
+            "more than %d block headers in the index block", bh_count);
+      }
+      // the window moves on, so the header keeps its own copy.
+      dst.emplace_back();
+      dst.back().Unmarshal(src.subspan(consumed, size));
+      consumed += size;
+    }
+    return consumed;
+  };
+  ZstdReader zr(r);
+  Reader::ReadRecords(zr, kStreamChunkSize, kMaxMarshaledHeaderSize, parse);
+  if (dst.size() - dst_len != size_t(bh_count)) {
+    throw InvalidInputException("unexpected number of block headers; got %d; "
+                                "want %d",
+                                dst.size() - dst_len, bh_count);
+  }
+  checkSorted(std::span<BlockHeader>(dst.data() + dst_len, bh_count));
 }
 
 } // namespace mergekv
\ No newline at end of file
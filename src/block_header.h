@@ -1,15 +1,43 @@
 #pragma once
 
 #include "encoding.h"
+#include "io.h"
 #include "types.h"
 #include <cstdint>
 #include <tuple>
+#include <vector>
 
 namespace mergekv {
+// BlockHeaderView is a block header decoded in place: common_prefix and
+// first_item are offsets into the decompressed index block, so decoding
+// doesn't allocate.
+struct BlockHeaderView {
+  uint32_t common_prefix_offset = 0;
+  uint32_t common_prefix_len = 0;
+  uint32_t first_item_offset = 0;
+  uint32_t first_item_len = 0;
+  MarshalType mt = marshalTypePlain;
+  uint32_t items_count = 0;
+  uint64_t items_block_offset = 0;
+  uint64_t lens_block_offset = 0;
+  uint32_t items_block_size = 0;
+  uint32_t lens_block_size = 0;
+
+  bytes_const_span CommonPrefix(bytes_const_span block) const {
+    return block.subspan(common_prefix_offset, common_prefix_len);
+  }
+  bytes_const_span FirstItem(bytes_const_span block) const {
+    return block.subspan(first_item_offset, first_item_len);
+  }
+
+  // Unmarshal decodes the header marshaled at block[offset:] and returns
+  // the offset following it.
+  size_t Unmarshal(bytes_const_span block, size_t offset);
+};
+
 struct BlockHeader {
   bytes common_prefix;
   bytes first_item;
-  bool no_copy;
   MarshalType mt;
   uint32_t items_count;
   uint64_t items_block_offset;
@@ -18,9 +46,8 @@ struct BlockHeader {
   uint32_t lens_block_size;
 
   BlockHeader()
-      : no_copy(false), mt(marshalTypePlain), items_count(0),
-        items_block_offset(0), lens_block_offset(0), items_block_size(0),
-        lens_block_size(0) {}
+      : mt(marshalTypePlain), items_count(0), items_block_offset(0),
+        lens_block_offset(0), items_block_size(0), lens_block_size(0) {}
   BlockHeader(BlockHeader &&) = default;
 
   BlockHeader(const BlockHeader &) = delete;
@@ -29,8 +56,15 @@ struct BlockHeader {
   void Reset();
 
   void Marshal(bytes &dst);
-  bytes_const_span UnmarshalNoCopy(bytes_const_span src);
-  static void UnmarshalBHNoCopy(std::vector<BlockHeader> &dst,
-                                bytes_const_span src, int bh_count);
+  bytes_const_span Unmarshal(bytes_const_span src);
+  static void UnmarshalBHs(std::vector<BlockHeader> &dst, bytes_const_span src,
+                           int bh_count);
+  // MarshaledSize returns the size of the marshaled block header at the
+  // start of src or 0 if src doesn't contain the whole header.
+  static size_t MarshaledSize(bytes_const_span src);
+  // UnmarshalBHs decodes bh_count block headers from the zstd compressed
+  // index block read from r without decompressing it into one buffer.
+  static void UnmarshalBHs(std::vector<BlockHeader> &dst, Reader &r,
+                           int bh_count);
 };
 } // namespace mergekv
\ No newline at end of file
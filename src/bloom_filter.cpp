@@ -0,0 +1,97 @@
+#include "bloom_filter.h"
+#include "encoding_util.h"
+#include "exception.h"
+#include "hash_util.h"
+#include <cstddef>
+#include <cstdint>
+
+namespace mergekv {
+
+// the odd constants used for deriving the bit of each block word from a hash.
+alignas(32) static const uint32_t kBloomSalts[kBloomBlockWords] = {
+    0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+    0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U};
+
+// 1 GiB filter is more than enough for any part.
+const size_t kMaxBloomBlocks = (size_t(1) << 30) / (kBloomBlockWords * 4);
+
+void BloomFilter::Init(size_t items_count, size_t bits_per_item) {
+  words_.clear();
+  if (items_count == 0 || bits_per_item == 0) {
+    return;
+  }
+  auto bits = items_count * bits_per_item;
+  auto blocks = (bits + 32 * kBloomBlockWords - 1) / (32 * kBloomBlockWords);
+  if (blocks > kMaxBloomBlocks) {
+    blocks = kMaxBloomBlocks;
+  }
+  words_.resize(blocks * kBloomBlockWords);
+}
+
+void BloomFilter::Add(bytes_const_span item) {
+  AddHash(HashUtil::Hash64(item));
+}
+
+void BloomFilter::AddHash(uint64_t h) {
+  if (words_.empty()) {
+    return;
+  }
+  auto block = words_.data() + BlockIndex(h) * kBloomBlockWords;
+  auto key = uint32_t(h);
+  for (size_t i = 0; i < kBloomBlockWords; i++) {
+    block[i] |= uint32_t(1) << ((key * kBloomSalts[i]) >> 27);
+  }
+}
+
+bool BloomFilter::MayContain(bytes_const_span item) const {
+  return MayContainHash(HashUtil::Hash64(item));
+}
+
+bool BloomFilter::MayContainHash(uint64_t h) const {
+  if (words_.empty()) {
+    return true;
+  }
+  auto block = words_.data() + BlockIndex(h) * kBloomBlockWords;
+  auto key = uint32_t(h);
+  uint32_t missing = 0;
+  for (size_t i = 0; i < kBloomBlockWords; i++) {
+    missing |= ~block[i] & (uint32_t(1) << ((key * kBloomSalts[i]) >> 27));
+  }
+  return missing == 0;
+}
+
+void BloomFilter::Marshal(bytes &dst) const {
+  auto blocks = words_.size() / kBloomBlockWords;
+  EncodingUtil::MarshalUint32(dst, uint32_t(blocks));
+  dst.reserve(dst.size() + words_.size() * sizeof(uint32_t));
+  for (auto w : words_) {
+    EncodingUtil::MarshalUint32(dst, w);
+  }
+}
+
+void BloomFilter::Unmarshal(bytes_const_span src) {
+  words_.clear();
+  if (src.size() < sizeof(uint32_t)) {
+    throw InvalidInputException("cannot unmarshal bloom filter blocks count");
+  }
+  size_t blocks = EncodingUtil::UnmarshalUint32(src);
+  src = src.subspan(sizeof(uint32_t));
+  if (blocks > kMaxBloomBlocks) {
+    throw InvalidInputException(
+        "too many bloom filter blocks: %d; cannot exceed %d", blocks,
+        kMaxBloomBlocks);
+  }
+  auto words = blocks * kBloomBlockWords;
+  if (src.size() != words * sizeof(uint32_t)) {
+    throw InvalidInputException(
+        "unexpected bloom filter size for %d blocks; got %d bytes; want %d "
+        "bytes",
+        blocks, src.size(), words * sizeof(uint32_t));
+  }
+  words_.resize(words);
+  for (size_t i = 0; i < words; i++) {
+    words_[i] = EncodingUtil::UnmarshalUint32(src.subspan(i * 4));
+  }
+}
+
+} // namespace mergekv
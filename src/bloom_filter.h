@@ -0,0 +1,48 @@
+#pragma once
+
+#include "types.h"
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace mergekv {
+
+const size_t kBloomBlockWords = 8;
+
+// BloomFilter is a split block Bloom filter.
+//
+// Every item sets one bit in each of the 8 words of a single 256-bit block,
+// so a probe touches one cache line and the word loop is vectorized.
+class BloomFilter {
+public:
+  BloomFilter() = default;
+
+  // Init resets the filter and sizes it for items_count items with
+  // bits_per_item bits per item.
+  void Init(size_t items_count, size_t bits_per_item);
+  void Reset() { words_.clear(); }
+
+  void Add(bytes_const_span item);
+  void AddHash(uint64_t h);
+  // MayContain returns false if the item has never been added. Empty filter
+  // may contain any item.
+  bool MayContain(bytes_const_span item) const;
+  bool MayContainHash(uint64_t h) const;
+
+  void Marshal(bytes &dst) const;
+  void Unmarshal(bytes_const_span src);
+
+  bool empty() const { return words_.empty(); }
+  size_t size_bytes() const { return words_.size() * sizeof(uint32_t); }
+
+private:
+  size_t BlockIndex(uint64_t h) const {
+    // map the upper 32 bits of h to [0, blocks_count) without division.
+    return size_t(((h >> 32) * uint64_t(words_.size() / kBloomBlockWords)) >>
+                  32);
+  }
+
+  std::vector<uint32_t> words_;
+};
+
+} // namespace mergekv
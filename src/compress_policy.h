@@ -0,0 +1,52 @@
+#pragma once
+
+#include "types.h"
+#include <cstdint>
+#include <vector>
+
+namespace mergekv {
+
+// the ZSTD level for flushed parts; fast levels keep flushes cheap, since
+// their data is rewritten by merges soon.
+const int kDefaultCompressLevel = -5;
+
+// CompressLevelPolicy maps the parts written by a table to ZSTD levels.
+//
+// Flushed parts use flush_level. Merged parts use the level of the last step
+// whose min_raw_bytes doesn't exceed the raw size of the merged items, so
+// small merges stay fast while the big final merges, which hold most of the
+// data for the longest time, compress harder.
+class CompressLevelPolicy {
+public:
+  struct Step {
+    uint64_t min_raw_bytes;
+    int level;
+  };
+
+  CompressLevelPolicy() = default;
+  CompressLevelPolicy(int flush_level, std::vector<Step> merge_steps)
+      : flush_level_(flush_level), merge_steps_(std::move(merge_steps)) {}
+
+  int FlushLevel() const { return flush_level_; }
+  int MergeLevel(uint64_t raw_bytes) const {
+    int level = flush_level_;
+    for (auto &step : merge_steps_) {
+      if (raw_bytes >= step.min_raw_bytes) {
+        level = step.level;
+      }
+    }
+    return level;
+  }
+
+private:
+  int flush_level_ = kDefaultCompressLevel;
+  // sorted by min_raw_bytes.
+  std::vector<Step> merge_steps_ = {
+      {0, kDefaultCompressLevel},
+      {uint64_t(16) << 20, 1},
+      {uint64_t(256) << 20, 3},
+      {uint64_t(4) << 30, 7},
+  };
+};
+
+} // namespace mergekv
@@ -5,9 +5,13 @@
 namespace mergekv {
 // some constants
 const string kMetaindexFilename = "metaindex.bin";
+const string kFlatMetaindexFilename = "metaindex.flat.bin";
 const string kIndexFilename = "index.bin";
 const string kItemsFilename = "items.bin";
 const string kLensFilename = "lens.bin";
+const string kBloomFilterFilename = "bloom.bin";
+const string kPrefixBloomFilterFilename = "prefix_bloom.bin";
 const string kMetadataFilename = "metadata.json";
+const string kPartHeaderFilename = "header.bin";
 const string kPartsFilename = "parts.json";
 } // namespace mergekv
@@ -0,0 +1,68 @@
+#include "index_block.h"
+#include "encoding_util.h"
+#include "exception.h"
+#include "metaindex_row.h"
+#include "string_util.h"
+#include <cstddef>
+#include <cstdint>
+
+namespace mergekv {
+
+void IndexBlock::Init(bytes_const_span compressed, uint32_t bh_count) {
+  data_.clear();
+  EncodingUtil::DecompressZSTD(data_, compressed);
+  Decode(bh_count);
+}
+
+void IndexBlock::InitDecompressed(bytes_const_span src, uint32_t bh_count) {
+  data_.assign(src.begin(), src.end());
+  Decode(bh_count);
+}
+
+void IndexBlock::Decode(uint32_t bh_count) {
+  if (bh_count == 0) {
+    throw InvalidInputException("invalid bh_count");
+  }
+  // the views refer to data_ by offsets, which must fit uint32_t.
+  if (data_.size() > 4 * kMaxIndexBlockSize) {
+    throw InvalidInputException(
+        "too big index block; got %d bytes; cannot exceed %d bytes",
+        data_.size(), 4 * kMaxIndexBlockSize);
+  }
+
+  bhs_.resize(bh_count);
+  size_t offset = 0;
+  for (auto &bh : bhs_) {
+    offset = bh.Unmarshal(data_, offset);
+  }
+  if (offset != data_.size()) {
+    throw InvalidInputException("unexpected non-zero tail left after "
+                                "unmarshaling %d block headers; len(tail)=%d",
+                                bh_count, data_.size() - offset);
+  }
+
+  for (size_t i = 1; i < bhs_.size(); i++) {
+    if (StringUtil::ToStringView(FirstItem(i)) <
+        StringUtil::ToStringView(FirstItem(i - 1))) {
+      throw InvalidInputException("block headers are not sorted");
+    }
+  }
+}
+
+size_t IndexBlock::Search(bytes_const_span item) const {
+  // find the first block with first_item > item; the previous block may
+  // contain item.
+  auto s = StringUtil::ToStringView(item);
+  size_t lo = 0, hi = bhs_.size();
+  while (lo < hi) {
+    auto mid = lo + (hi - lo) / 2;
+    if (StringUtil::ToStringView(FirstItem(mid)) <= s) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo == 0 ? bhs_.size() : lo - 1;
+}
+
+} // namespace mergekv
@@ -0,0 +1,56 @@
+#pragma once
+
+#include "block_header.h"
+#include "types.h"
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace mergekv {
+
+// IndexBlock is a decompressed index block with its block headers decoded
+// in place into a contiguous BlockHeaderView array.
+//
+// The buffers are reused by the following Init calls, so decoding index
+// blocks with the same IndexBlock doesn't allocate once it has warmed up.
+class IndexBlock {
+public:
+  IndexBlock() = default;
+
+  // forbid copy, since the views point into data_
+  IndexBlock(const IndexBlock &) = delete;
+  IndexBlock &operator=(const IndexBlock &) = delete;
+
+  // Init decompresses the zstd compressed index block and decodes bh_count
+  // block headers from it.
+  void Init(bytes_const_span compressed, uint32_t bh_count);
+  // InitDecompressed decodes bh_count block headers from the decompressed
+  // index block src.
+  void InitDecompressed(bytes_const_span src, uint32_t bh_count);
+  void Reset() {
+    data_.clear();
+    bhs_.clear();
+  }
+
+  size_t size() const { return bhs_.size(); }
+  const BlockHeaderView &operator[](size_t i) const { return bhs_[i]; }
+  bytes_const_span FirstItem(size_t i) const {
+    return bhs_[i].FirstItem(data_);
+  }
+  bytes_const_span CommonPrefix(size_t i) const {
+    return bhs_[i].CommonPrefix(data_);
+  }
+
+  // Search returns the index of the block which may contain item, i.e. the
+  // last block with first_item <= item. It returns size() if item is
+  // smaller than all the blocks.
+  size_t Search(bytes_const_span item) const;
+
+private:
+  void Decode(uint32_t bh_count);
+
+  bytes data_;
+  std::vector<BlockHeaderView> bhs_;
+};
+
+} // namespace mergekv
@@ -2,20 +2,29 @@
 #include "encoding.h"
 #include "encoding_util.h"
 #include "exception.h"
+#include "memory.h"
+#include "metrics.h"
 #include "types.h"
 #include <algorithm>
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
 #include <fmt/core.h>
 #include <fmt/printf.h>
 #include <vector>
 
 namespace mergekv {
 
+void InMemoryBlock::Reset() {
+  common_prefix_.clear();
+  data_.clear();
+  items_.clear();
+}
+
 void InMemoryBlock::CopyFrom(InMemoryBlock &src) {
-  common_prefix_ = bytes(src.common_prefix_.begin(), src.common_prefix_.end());
-  data_ = bytes(src.data_.begin(), src.data_.end());
-  items_ = std::vector<Item>(src.items_.begin(), src.items_.end());
+  common_prefix_.assign(src.common_prefix_.begin(), src.common_prefix_.end());
+  data_.assign(src.data_.begin(), src.data_.end());
+  items_.assign(src.items_.begin(), src.items_.end());
 }
 
 auto printAscii = [](const string_view str) {
@@ -37,13 +46,72 @@ void InMemoryBlock::SortItems() {
   if (!IsSorted()) {
     UpdateCommonPrefixUnsorted();
     // sort items_
-    std::sort(items_.begin(), items_.end(),
-              [this](Item a, Item b) { return CompareItems(a, b); });
+    if (items_.size() < kMinRadixSortItems) {
+      std::sort(items_.begin(), items_.end(),
+                [this](Item a, Item b) { return CompareItems(a, b); });
+      return;
+    }
+    RadixSortItems();
     return;
   }
   UpdateCommonPrefixSorted();
 }
 
+// RadixSortItems sorts items_ by the 8 bytes following common_prefix_ with
+// LSD radix sort, then orders the runs sharing these 8 bytes with
+// PrefixedItem::Compare. Most of the items are distinguished by the key
+// prefix, so the data_ is touched once per item instead of on every
+// comparison.
+void InMemoryBlock::RadixSortItems() {
+  auto n = items_.size();
+  auto cp_len = common_prefix_.size();
+  std::vector<PrefixedItem> src(n), dst(n);
+  size_t counts[8][256] = {};
+  for (size_t i = 0; i < n; i++) {
+    src[i] = PrefixedItem(items_[i], data_, cp_len);
+    auto key = src[i].key_prefix;
+    for (size_t b = 0; b < 8; b++) {
+      counts[b][(key >> (8 * b)) & 0xff]++;
+    }
+  }
+
+  for (size_t b = 0; b < 8; b++) {
+    auto &count = counts[b];
+    // skip the byte if it is the same for all the items.
+    if (count[(src[0].key_prefix >> (8 * b)) & 0xff] == n) {
+      continue;
+    }
+    size_t offsets[256];
+    size_t offset = 0;
+    for (size_t c = 0; c < 256; c++) {
+      offsets[c] = offset;
+      offset += count[c];
+    }
+    for (auto &pi : src) {
+      dst[offsets[(pi.key_prefix >> (8 * b)) & 0xff]++] = pi;
+    }
+    src.swap(dst);
+  }
+
+  size_t run_start = 0;
+  for (size_t i = 1; i <= n; i++) {
+    if (i < n && src[i].key_prefix == src[run_start].key_prefix) {
+      continue;
+    }
+    if (i - run_start > 1) {
+      std::sort(src.begin() + run_start, src.begin() + i,
+                [this, cp_len](const PrefixedItem &a, const PrefixedItem &b) {
+                  return PrefixedItem::Compare(a, data_, b, data_, cp_len) < 0;
+                });
+    }
+    run_start = i;
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    items_[i] = src[i].item;
+  }
+}
+
 void InMemoryBlock::UpdateCommonPrefixSorted() {
   if (items_.size() <= 1) {
     common_prefix_.clear();
@@ -77,7 +145,7 @@ void InMemoryBlock::UpdateCommonPrefixUnsorted() {
   common_prefix_.insert(common_prefix_.begin(), cp.begin(), cp.end());
 }
 
-bool InMemoryBlock::Add(bytes &data) {
+bool InMemoryBlock::Add(bytes_const_span data) {
   if (data_.size() + data.size() > kMaxInmemoryBlockSize) {
     return false;
   }
@@ -93,31 +161,48 @@ bool InMemoryBlock::Add(bytes &data) {
 }
 
 bool InMemoryBlock::IsSorted() const {
-  return std::is_sorted(items_.begin(), items_.end(),
-                        [this](Item a, Item b) { return CompareItems(a, b); });
+  if (items_.size() <= 1) {
+    return true;
+  }
+  // every item is loaded once, and data_ is read again only for the
+  // neighbours sharing the key prefix.
+  auto cp_len = common_prefix_.size();
+  auto pre = PrefixedItem(items_[0], data_, cp_len);
+  for (size_t i = 1; i < items_.size(); i++) {
+    auto cur = PrefixedItem(items_[i], data_, cp_len);
+    if (PrefixedItem::Compare(cur, data_, pre, data_, cp_len) < 0) {
+      return false;
+    }
+    pre = cur;
+  }
+  return true;
 }
 
 InMemoryBlock::marshal_results
 InMemoryBlock::MarshalUnSortedData(StorageBlock &block, bytes &first_item_dst,
-                                   bytes &common_prefix_dst,
-                                   int compress_level) {
+                                   bytes &common_prefix_dst, int compress_level,
+                                   BlockCodecScratch *scratch) {
   SortItems();
-  return MarshalData(block, first_item_dst, common_prefix_dst, compress_level);
+  return MarshalData(block, first_item_dst, common_prefix_dst, compress_level,
+                     scratch ? *scratch : BlockCodecScratch::Local());
 }
 
 InMemoryBlock::marshal_results
 InMemoryBlock::MarshalSortedData(StorageBlock &block, bytes &first_item_dst,
-                                 bytes &common_prefix_dst, int compress_level) {
+                                 bytes &common_prefix_dst, int compress_level,
+                                 BlockCodecScratch *scratch) {
   if (!IsSorted()) {
     throw FatalException("MarshalSortedData: items are not sorted");
   }
   UpdateCommonPrefixSorted();
-  return MarshalData(block, first_item_dst, common_prefix_dst, compress_level);
+  return MarshalData(block, first_item_dst, common_prefix_dst, compress_level,
+                     scratch ? *scratch : BlockCodecScratch::Local());
 }
 
 InMemoryBlock::marshal_results
 InMemoryBlock::MarshalData(StorageBlock &block, bytes &first_item_dst,
-                           bytes &common_prefix_dst, int compress_level) {
+                           bytes &common_prefix_dst, int compress_level,
+                           BlockCodecScratch &scratch) {
   if (items_.empty()) {
     throw FatalException("MarshalData: items is empty");
   }
@@ -126,6 +211,14 @@ InMemoryBlock::MarshalData(StorageBlock &block, bytes &first_item_dst,
                          "smaller than %d; got %d items",
                          uint64_t(1) << 32, items_.size());
   }
+  static auto &marshal_duration = MetricsRegistry::Global().GetHistogram(
+      "mergekv_block_marshal_duration_seconds",
+      "InMemoryBlock marshal durations including the compression");
+  static auto &marshal_items = MetricsRegistry::Global().GetCounter(
+      "mergekv_block_items_total{op=\"marshal\"}",
+      "items marshaled or unmarshaled in blocks");
+  HistogramTimer timer(marshal_duration);
+  marshal_items.Add(items_.size());
 
   auto first_item = items_.front().GetBytes(data_);
   first_item_dst.insert(first_item_dst.end(), first_item.begin(),
@@ -144,48 +237,38 @@ InMemoryBlock::MarshalData(StorageBlock &block, bytes &first_item_dst,
   auto cp_len = common_prefix_.size();
   auto pre_item = first_item.subspan(cp_len);
   auto pre_prefix_len = uint64_t(0);
-  // todo: reserve items_bytes size
-  auto items_bytes = bytes();
-  auto x_lens = u64s();
-  x_lens.reserve(items_.size() - 1);
-  // calculate the prefix lens and save the suffixes
+  auto pre_item_len = uint64_t(pre_item.size());
+  auto &items_bytes = scratch.items_bytes;
+  auto &lens_bytes = scratch.lens_bytes;
+  auto &item_lens_bytes = scratch.item_lens_bytes;
+  items_bytes.clear();
+  lens_bytes.clear();
+  item_lens_bytes.clear();
+  // calculate the prefix lens, the item lens and the suffixes in a single
+  // pass. The lens are xor-ed with the previous ones to make them smaller
+  // and written as varints right away.
   for (size_t i = 1; i < items_.size(); i++) {
     auto it = items_[i]; // copy, since we will change it
     it.start += cp_len;
     auto item = it.GetBytes(data_);
-    auto prefix_len = CommonPrefixLen(pre_item, item);
+    auto prefix_len = uint64_t(CommonPrefixLen(pre_item, item));
+    auto item_len = uint64_t(item.size());
     // save suffix
     items_bytes.insert(items_bytes.end(), item.begin() + prefix_len,
                        item.end());
-    // make x_len smaller
-    auto x_len = prefix_len ^ pre_prefix_len;
+    EncodingUtil::MarshalVarUint64(lens_bytes, prefix_len ^ pre_prefix_len);
+    EncodingUtil::MarshalVarUint64(item_lens_bytes, item_len ^ pre_item_len);
     pre_item = item;
     pre_prefix_len = prefix_len;
-    // save prefix len
-    x_lens.push_back(x_len);
+    pre_item_len = item_len;
   }
-
-  // todo: reserve b_lens size
-  bytes lens_bytes;
-  EncodingUtil::MarshalVarUint64s(lens_bytes, x_lens);
+  // item lens follow prefix lens.
+  lens_bytes.insert(lens_bytes.end(), item_lens_bytes.begin(),
+                    item_lens_bytes.end());
 
   block.items_data->clear();
   EncodingUtil::CompressZSTDLevel(*block.items_data, items_bytes,
                                   compress_level);
-  // for reuse
-  x_lens.clear();
-  // save item lens
-  auto pre_item_len = uint64_t(first_item.size() - cp_len);
-  for (size_t i = 1; i < items_.size(); i++) {
-    auto it = items_[i];
-    auto item_len = uint64_t(it.end - it.start - cp_len);
-    auto x_len = item_len ^ pre_item_len;
-    pre_item_len = item_len;
-    x_lens.push_back(x_len);
-  }
-
-  EncodingUtil::MarshalVarUint64s(lens_bytes, x_lens);
-
   block.lens_data->clear();
   EncodingUtil::CompressZSTDLevel(*block.lens_data, lens_bytes, compress_level);
   if (double(block.items_data->size()) >
@@ -224,16 +307,24 @@ void InMemoryBlock::MarshalDataPlain(StorageBlock &block) {
 void InMemoryBlock::UnmarshalData(const StorageBlock &block,
                                   bytes_const_span first_item,
                                   bytes_const_span common_prefix,
-                                  uint32_t items_count, MarshalType mt) {
+                                  uint32_t items_count, MarshalType mt,
+                                  BlockCodecScratch *scratch) {
   if (items_count == 0) {
     throw FatalException("UnmarshalData: items_count is 0");
   }
+  static auto &unmarshal_duration = MetricsRegistry::Global().GetHistogram(
+      "mergekv_block_unmarshal_duration_seconds{decoder=\"full\"}",
+      "block unmarshal durations including the decompression");
+  static auto &unmarshal_items = MetricsRegistry::Global().GetCounter(
+      "mergekv_block_items_total{op=\"unmarshal\"}");
+  HistogramTimer timer(unmarshal_duration);
+  unmarshal_items.Add(items_count);
 
-  common_prefix_.insert(common_prefix_.begin(), common_prefix.begin(),
-                        common_prefix.end());
+  common_prefix_.assign(common_prefix.begin(), common_prefix.end());
+  auto &s = scratch ? *scratch : BlockCodecScratch::Local();
   switch (mt) {
   case marshalTypePlain: {
-    UnmarshalDataPlain(block, first_item, items_count);
+    UnmarshalDataPlain(block, first_item, items_count, s);
     if (!IsSorted()) {
       InvalidInputException(
           "plain data block contains unsorted items; items:\n%s",
@@ -249,18 +340,18 @@ void InMemoryBlock::UnmarshalData(const StorageBlock &block,
   }
 
   // unmarshal marshalTypeSZTD data
-  // todo, reserve buf_data size
-  bytes buf_data;
+  auto &buf_data = s.buf_data;
+  buf_data.clear();
   EncodingUtil::DecompressZSTD(buf_data, *block.lens_data);
 
-  u64s lens;
+  auto &lens = s.lens;
   lens.resize(items_count * 2);
 
   auto prefix_lens = u64s_span(lens.begin(), lens.begin() + items_count);
   auto item_lens = u64s_span(lens.begin() + items_count, lens.end());
 
   // unmarshal prefix lens
-  u64s dst;
+  auto &dst = s.dst;
   dst.resize(items_count - 1);
   auto lens_data_tail = EncodingUtil::UnmarshalVarUint64s(dst, buf_data);
 
@@ -344,8 +435,9 @@ void InMemoryBlock::UnmarshalData(const StorageBlock &block,
 
 void InMemoryBlock::UnmarshalDataPlain(const StorageBlock &block,
                                        bytes_const_span first_item,
-                                       uint32_t items_count) {
-  u64s lens_buf;
+                                       uint32_t items_count,
+                                       BlockCodecScratch &scratch) {
+  auto &lens_buf = scratch.lens;
   lens_buf.resize(items_count);
   lens_buf[0] = first_item.size() - common_prefix_.size();
   bytes_const_span b = *block.lens_data;
@@ -413,4 +505,59 @@ string InMemoryBlock::debugItemString() const {
   return s;
 }
 
-} // namespace mergekv
\ No newline at end of file
+// the pool may hold up to 1/32 of the allowed memory.
+const size_t kBlockPoolMemoryFraction = 32;
+const size_t kMinFreeBlocks = 16;
+
+size_t InMemoryBlockPool::max_free_blocks = 0;
+std::vector<std::unique_ptr<InMemoryBlock>> InMemoryBlockPool::free_blocks;
+std::mutex InMemoryBlockPool::lock;
+std::once_flag InMemoryBlockPool::flag;
+
+void InMemoryBlockPool::InitOnce() {
+  // a pooled block keeps kMaxInmemoryBlockSize bytes of data and the items
+  // reserved by InMemoryBlock::Add.
+  auto block_size = kMaxInmemoryBlockSize + 512 * sizeof(Item);
+  auto n = size_t(CgroupUtil::AllowedMemory()) / kBlockPoolMemoryFraction /
+           block_size;
+  max_free_blocks = std::max(n, kMinFreeBlocks);
+  free_blocks.reserve(max_free_blocks);
+}
+
+size_t InMemoryBlockPool::MaxFreeBlocks() {
+  std::call_once(flag, InitOnce);
+  return max_free_blocks;
+}
+
+size_t InMemoryBlockPool::FreeBlocks() {
+  std::lock_guard<std::mutex> guard(lock);
+  return free_blocks.size();
+}
+
+std::unique_ptr<InMemoryBlock> InMemoryBlockPool::Get() {
+  std::call_once(flag, InitOnce);
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    if (!free_blocks.empty()) {
+      auto ib = std::move(free_blocks.back());
+      free_blocks.pop_back();
+      return ib;
+    }
+  }
+  return std::make_unique<InMemoryBlock>();
+}
+
+void InMemoryBlockPool::Put(std::unique_ptr<InMemoryBlock> ib) {
+  if (!ib) {
+    return;
+  }
+  std::call_once(flag, InitOnce);
+  ib->Reset();
+  std::lock_guard<std::mutex> guard(lock);
+  if (free_blocks.size() < max_free_blocks) {
+    free_blocks.push_back(std::move(ib));
+  }
+  // the block is freed when the pool is full.
+}
+
+} // namespace mergekv
@@ -2,8 +2,11 @@
 
 #include "encoding.h"
 #include "types.h"
+#include <algorithm>
 #include <cstdint>
+#include <cstring>
 #include <memory>
+#include <mutex>
 #include <span>
 #include <string_view>
 #include <tuple>
@@ -11,6 +14,9 @@
 namespace mergekv {
 
 const int kMaxInmemoryBlockSize = 64 * 1024;
+// blocks with fewer items are sorted with std::sort, since radix sort
+// doesn't pay off for them.
+const size_t kMinRadixSortItems = 64;
 
 struct Item {
   Item() = default;
@@ -29,7 +35,7 @@ struct Item {
                             end - start);
   }
 
-  std::string_view GetString(const bytes_const_span &data) const {
+  std::string_view GetString(bytes_const_span data) const {
     return std::string_view(reinterpret_cast<const char *>(data.data() + start),
                             end - start);
   }
@@ -38,32 +44,109 @@ struct Item {
   uint32_t end;
 };
 
+// PrefixedItem is an Item with up to 8 bytes following the first skip bytes
+// of the item cached inline as a big-endian key_prefix, so most comparisons
+// are resolved without reading the item data.
+//
+// Only items created with the same skip are comparable. InMemoryBlock skips
+// its common prefix, while items from different blocks must skip nothing.
+struct PrefixedItem {
+  PrefixedItem() = default;
+  PrefixedItem(Item item, bytes_const_span data, size_t skip)
+      : key_prefix(KeyPrefix(data.subspan(item.start + skip,
+                                          item.end - item.start - skip))),
+        item(item) {}
+
+  // KeyPrefix returns up to the first 8 bytes of b as a big-endian number
+  // padded with zeros, so numbers compare like the bytes.
+  static uint64_t KeyPrefix(bytes_const_span b) {
+    uint64_t key = 0;
+    if (b.size() >= 8) {
+      std::memcpy(&key, b.data(), 8);
+      return __builtin_bswap64(key);
+    }
+    for (size_t i = 0; i < b.size(); i++) {
+      key |= uint64_t(b[i]) << (56 - 8 * i);
+    }
+    return key;
+  }
+
+  // Compare compares a and b like memcmp. a_data and b_data are the buffers
+  // the items point to.
+  static int Compare(const PrefixedItem &a, bytes_const_span a_data,
+                     const PrefixedItem &b, bytes_const_span b_data,
+                     size_t skip) {
+    if (a.key_prefix != b.key_prefix) {
+      return a.key_prefix < b.key_prefix ? -1 : 1;
+    }
+    // the key prefixes are equal, so the items are equal up to the end of
+    // the shortest key prefix.
+    size_t a_len = a.item.end - a.item.start - skip;
+    size_t b_len = b.item.end - b.item.start - skip;
+    size_t n = std::min({a_len, b_len, size_t(8)});
+    auto as = a.item.GetString(a_data).substr(skip + n);
+    auto bs = b.item.GetString(b_data).substr(skip + n);
+    return as.compare(bs);
+  }
+
+  uint64_t key_prefix;
+  Item item;
+};
+
 struct StorageBlock {
   std::shared_ptr<bytes> lens_data;
   std::shared_ptr<bytes> items_data;
+  StorageBlock()
+      : lens_data(std::make_shared<bytes>()),
+        items_data(std::make_shared<bytes>()) {}
   StorageBlock(std::shared_ptr<bytes> lens_data,
                std::shared_ptr<bytes> items_data)
       : lens_data(lens_data), items_data(items_data) {}
 };
 
+// BlockCodecScratch holds the temporary buffers used for marshaling and
+// unmarshaling blocks, so their capacity is kept between blocks.
+struct BlockCodecScratch {
+  // marshal buffers
+  bytes items_bytes;
+  bytes lens_bytes;
+  bytes item_lens_bytes;
+  // unmarshal buffers
+  bytes buf_data;
+  u64s lens;
+  u64s dst;
+
+  // Local returns the scratch of the calling thread.
+  static BlockCodecScratch &Local() {
+    thread_local BlockCodecScratch scratch;
+    return scratch;
+  }
+};
+
 class InMemoryBlock {
 public:
   using marshal_results = std::tuple<uint32_t, MarshalType>;
   InMemoryBlock() = default;
+  // Reset clears the block while keeping the capacity of its buffers.
+  void Reset();
   void CopyFrom(InMemoryBlock &src);
   void SortItems();
   int GetSizeBytes() const;
-  bool Add(bytes &data);
+  bool Add(bytes_const_span data);
+  // The Marshal* and UnmarshalData methods use the scratch of the calling
+  // thread unless scratch is passed.
   marshal_results MarshalUnSortedData(StorageBlock &block,
                                       bytes &first_item_dst,
                                       bytes &common_prefix_dst,
-                                      int compress_level);
+                                      int compress_level,
+                                      BlockCodecScratch *scratch = nullptr);
   marshal_results MarshalSortedData(StorageBlock &block, bytes &first_item_dst,
                                     bytes &common_prefix_dst,
-                                    int compress_level);
+                                    int compress_level,
+                                    BlockCodecScratch *scratch = nullptr);
   void UnmarshalData(const StorageBlock &block, bytes_const_span first_item,
                      bytes_const_span common_prefix, uint32_t items_count,
-                     MarshalType mt);
+                     MarshalType mt, BlockCodecScratch *scratch = nullptr);
 
   std::span<const Item> items() const { return items_; }
 
@@ -77,15 +160,18 @@ public:
 private:
   void UpdateCommonPrefixSorted();
   void UpdateCommonPrefixUnsorted();
+  void RadixSortItems();
   bool IsSorted() const;
   marshal_results MarshalData(StorageBlock &block, bytes &first_item_dst,
-                              bytes &common_prefix_dst, int compress_level);
+                              bytes &common_prefix_dst, int compress_level,
+                              BlockCodecScratch &scratch);
 
   string debugItemString() const;
   bool CompareItems(Item a, Item b) const;
   void MarshalDataPlain(StorageBlock &block);
   void UnmarshalDataPlain(const StorageBlock &block,
-                          bytes_const_span first_item, uint32_t items_count);
+                          bytes_const_span first_item, uint32_t items_count,
+                          BlockCodecScratch &scratch);
 
 private:
   bytes common_prefix_;
@@ -93,4 +179,25 @@ private:
   std::vector<Item> items_;
 };
 
+// InMemoryBlockPool recycles InMemoryBlocks together with their data and
+// items buffers, so steady-state ingestion doesn't allocate new blocks.
+//
+// The number of the pooled blocks is limited by MaxFreeBlocks, which is
+// derived from CgroupUtil::AllowedMemory().
+class InMemoryBlockPool {
+public:
+  static std::unique_ptr<InMemoryBlock> Get();
+  static void Put(std::unique_ptr<InMemoryBlock> ib);
+  static size_t MaxFreeBlocks();
+  static size_t FreeBlocks();
+
+private:
+  static void InitOnce();
+
+  static size_t max_free_blocks;
+  static std::vector<std::unique_ptr<InMemoryBlock>> free_blocks;
+  static std::mutex lock;
+  static std::once_flag flag;
+};
+
 } // namespace mergekv
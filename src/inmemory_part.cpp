@@ -4,69 +4,441 @@
 #include "exception.h"
 #include "file.h"
 #include "filenames.h"
+#include "hash_util.h"
 #include "inmemory_block.h"
+#include "metaindex.h"
 #include "metaindex_row.h"
+#include "metrics.h"
+#include "string_util.h"
+#include "thread_pool.h"
 #include "types.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cstddef>
+#include <ctime>
+#include <fmt/core.h>
+#include <memory>
+#include <queue>
+#include <vector>
 
 namespace mergekv {
 
+// threadCPUTime returns the CPU time consumed by the calling thread. It is
+// a syscall, so it is read once per part or batch, not per block.
+static std::chrono::nanoseconds threadCPUTime() {
+  timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return std::chrono::seconds(ts.tv_sec) + std::chrono::nanoseconds(ts.tv_nsec);
+}
+
 void InMemoryPart::MustStoreToDisk(const string &part_path) {
   fs::path base_path = part_path;
   fs::create_directories(base_path);
+  FileUtils::MustWriteSync(fs::path(base_path / kItemsFilename),
+                           *items_data_.data());
+  FileUtils::MustWriteSync(fs::path(base_path / kLensFilename),
+                           *lens_data_.data());
+  MustStoreMetadata(part_path);
+}
 
+void InMemoryPart::MustStoreMetadata(const string &part_path) {
+  fs::path base_path = part_path;
   ph_.MustWriteMetadata(part_path);
 
   auto metaindex_path = fs::path(base_path / kMetaindexFilename);
   auto index_path = fs::path(base_path / kIndexFilename);
-  auto items_path = fs::path(base_path / kItemsFilename);
-  auto lens_path = fs::path(base_path / kLensFilename);
 
   FileUtils::MustWriteSync(metaindex_path, *(metaindex_data_.data()));
   FileUtils::MustWriteSync(index_path, *index_data_.data());
-  FileUtils::MustWriteSync(items_path, *items_data_.data());
-  FileUtils::MustWriteSync(lens_path, *lens_data_.data());
+  if (opts_.flat_metaindex) {
+    auto mi = MetaIndex::FromCompressed(*metaindex_data_.data());
+    FileUtils::MustWriteSync(fs::path(base_path / kFlatMetaindexFilename),
+                             mi->data());
+  }
+
+  if (!bloom_.empty()) {
+    bytes buf;
+    bloom_.Marshal(buf);
+    FileUtils::MustWriteSync(fs::path(base_path / kBloomFilterFilename), buf);
+  }
+  if (!prefix_bloom_.empty()) {
+    // the prefix length goes first, so the filter stays usable after the
+    // table prefix extractor changes.
+    bytes buf;
+    EncodingUtil::MarshalUint32(buf, uint32_t(opts_.prefix_extractor.len()));
+    prefix_bloom_.Marshal(buf);
+    FileUtils::MustWriteSync(
+        fs::path(base_path / kPrefixBloomFilterFilename), buf);
+  }
+}
+
+std::shared_ptr<Part> InMemoryPart::NewPart() {
+  return Part::NewInMemory(*this);
 }
 
 void InMemoryPart::Init(InMemoryBlock &ib) {
   Reset();
-  auto sb = StorageBlock(lens_data_.data(), items_data_.data());
-  int compress_level = -5;
-  auto [item_count, mt] = ib.MarshalUnSortedData(
-      sb, bh_.first_item, bh_.common_prefix, compress_level);
-  bh_.items_count = item_count;
-  bh_.mt = mt;
-
-  ph_.items_count_ = ib.items().size();
-  ph_.blocks_count_ = 1;
-  auto first_item = ib.items().front().GetString(ib.data());
-  ph_.first_item_.insert(ph_.first_item_.begin(), first_item.begin(),
-                         first_item.end());
+  auto cpu_start = threadCPUTime();
+  int compress_level = opts_.compress_level;
+  MarshaledBlock mb;
+  auto [items_count, mt] = ib.MarshalUnSortedData(
+      mb.sb, mb.first_item, mb.common_prefix, compress_level);
+  mb.items_count = items_count;
+  mb.mt = mt;
+  mb.raw_bytes = ib.data().size();
   auto last_item = ib.items().back().GetString(ib.data());
-  ph_.last_item_.insert(ph_.last_item_.begin(), last_item.begin(),
-                        last_item.end());
-  bh_.items_block_offset = 0;
-  bh_.items_block_size = items_data_.size();
-  bh_.lens_block_offset = 0;
-  bh_.lens_block_size = lens_data_.size();
-
-  bytes buf;
-  bh_.Marshal(buf);
-  if (buf.size() != kMaxIndexBlockSize * 3) {
-    throw FatalException(
-        "Too big block header size: %d, can not exceed %d bytes", buf.size(),
-        kMaxIndexBlockSize * 3);
-  }
-  auto index_data = *index_data_.data();
-  EncodingUtil::CompressZSTDLevel(index_data, buf, compress_level);
-
-  mr_.first_item.insert(mr_.first_item.begin(), bh_.first_item.begin(),
-                        bh_.first_item.end());
-  mr_.bhs_count = 1;
-  mr_.index_block_offset = 0;
-  mr_.index_block_size = index_data.size();
-  buf.resize(0);
-  mr_.Marshal(buf);
-  EncodingUtil::CompressZSTDLevel(*metaindex_data_.data(), buf, compress_level);
-}
-} // namespace mergekv
\ No newline at end of file
+  ph_.last_item_.assign(last_item.begin(), last_item.end());
+  BuildFilters({&ib});
+
+  bytes index_buf, metaindex_buf;
+  AppendBlock(mb, index_buf, metaindex_buf, compress_level);
+  Finalize(index_buf, metaindex_buf, compress_level);
+  compress_cpu_ += threadCPUTime() - cpu_start;
+  RecordCompressCPUTime();
+}
+
+// mergeSortedBlocks merges the items of the sorted blocks src into full
+// blocks appended to dst.
+//
+// Equal items are ordered by the index of their source block, so the result
+// doesn't depend on the order the blocks were sorted in.
+static void
+mergeSortedBlocks(std::vector<std::unique_ptr<InMemoryBlock>> &src,
+                  std::vector<std::unique_ptr<InMemoryBlock>> &dst) {
+  struct Cursor {
+    PrefixedItem item;
+    size_t block_idx;
+    size_t item_idx;
+  };
+  // items from different blocks have different common prefixes, so the key
+  // prefixes start at the beginning of the items.
+  auto greater = [&src](const Cursor &a, const Cursor &b) {
+    auto n = PrefixedItem::Compare(a.item, src[a.block_idx]->data(), b.item,
+                                   src[b.block_idx]->data(), 0);
+    if (n != 0) {
+      return n > 0;
+    }
+    return a.block_idx > b.block_idx;
+  };
+  std::priority_queue<Cursor, std::vector<Cursor>, decltype(greater)> heap(
+      greater);
+  for (size_t i = 0; i < src.size(); i++) {
+    auto &b = *src[i];
+    if (!b.items().empty()) {
+      heap.push(Cursor{PrefixedItem(b.items().front(), b.data(), 0), i, 0});
+    }
+  }
+
+  dst.push_back(InMemoryBlockPool::Get());
+  while (!heap.empty()) {
+    auto c = heap.top();
+    heap.pop();
+    auto &b = *src[c.block_idx];
+    auto item = StringUtil::BytesConstSpan(c.item.item.GetString(b.data()));
+    if (!dst.back()->Add(item)) {
+      dst.push_back(InMemoryBlockPool::Get());
+      if (!dst.back()->Add(item)) {
+        throw FatalException("BUG: cannot add item with %d bytes to an empty "
+                             "block",
+                             item.size());
+      }
+    }
+    if (++c.item_idx < b.items().size()) {
+      c.item = PrefixedItem(b.items()[c.item_idx], b.data(), 0);
+      heap.push(c);
+    }
+  }
+}
+
+void InMemoryPart::InitFromBlocks(
+    std::vector<std::unique_ptr<InMemoryBlock>> &ibs, ThreadPool &pool) {
+  Reset();
+  std::erase_if(ibs, [](const std::unique_ptr<InMemoryBlock> &ib) {
+    return ib->items().empty();
+  });
+  if (ibs.empty()) {
+    throw FatalException("InitFromBlocks: blocks are empty");
+  }
+
+  // sorting and compression dominate the flush, so they run on the pool.
+  pool.ParallelFor(ibs.size(), [&ibs](size_t i) { ibs[i]->SortItems(); });
+  std::vector<std::unique_ptr<InMemoryBlock>> sorted;
+  if (ibs.size() == 1) {
+    sorted.swap(ibs);
+  } else {
+    mergeSortedBlocks(ibs, sorted);
+  }
+  for (auto &ib : ibs) {
+    InMemoryBlockPool::Put(std::move(ib));
+  }
+  ibs.clear();
+  InitFromSortedBlocks(sorted, pool);
+}
+
+void InMemoryPart::InitFromSortedBlocks(
+    std::vector<std::unique_ptr<InMemoryBlock>> &sorted, ThreadPool &pool) {
+  Reset();
+  std::erase_if(sorted, [](const std::unique_ptr<InMemoryBlock> &ib) {
+    return ib->items().empty();
+  });
+  if (sorted.empty()) {
+    throw FatalException("InitFromSortedBlocks: blocks are empty");
+  }
+  size_t items_count = 0;
+  for (auto &ib : sorted) {
+    items_count += ib->items().size();
+  }
+  InitFilters(items_count);
+
+  bytes index_buf, metaindex_buf;
+  MarshalSortedBlocks(sorted, pool, index_buf, metaindex_buf);
+  FinishFilters();
+  auto cpu_start = threadCPUTime();
+  Finalize(index_buf, metaindex_buf, opts_.compress_level);
+  compress_cpu_ += threadCPUTime() - cpu_start;
+  RecordCompressCPUTime();
+}
+
+void InMemoryPart::StartStream(const string &part_path, uint64_t max_items) {
+  Reset();
+  fs::create_directories(part_path);
+  stream_path_ = part_path;
+  items_w_ = std::make_unique<BufferFileWriter>(
+      fs::path(fs::path(part_path) / kItemsFilename).string());
+  lens_w_ = std::make_unique<BufferFileWriter>(
+      fs::path(fs::path(part_path) / kLensFilename).string());
+  stream_index_buf_.clear();
+  stream_metaindex_buf_.clear();
+  InitFilters(max_items);
+}
+
+void InMemoryPart::AppendSortedBlocks(
+    std::vector<std::unique_ptr<InMemoryBlock>> &sorted, ThreadPool &pool) {
+  if (items_w_ == nullptr) {
+    throw FatalException("BUG: AppendSortedBlocks called without "
+                         "StartStream");
+  }
+  std::erase_if(sorted, [](const std::unique_ptr<InMemoryBlock> &ib) {
+    return ib->items().empty();
+  });
+  if (sorted.empty()) {
+    return;
+  }
+  MarshalSortedBlocks(sorted, pool, stream_index_buf_, stream_metaindex_buf_);
+  // only the index stays in memory; the block data goes to the files.
+  items_w_->Write(*items_data_.data());
+  items_offset_ += items_data_.size();
+  items_data_.Reset();
+  lens_w_->Write(*lens_data_.data());
+  lens_offset_ += lens_data_.size();
+  lens_data_.Reset();
+}
+
+void InMemoryPart::FinishStream() {
+  if (items_w_ == nullptr) {
+    throw FatalException("BUG: FinishStream called without StartStream");
+  }
+  if (ph_.blocks_count_ == 0) {
+    throw FatalException("FinishStream: blocks are empty");
+  }
+  items_w_->MustClose();
+  items_w_.reset();
+  lens_w_->MustClose();
+  lens_w_.reset();
+  FinishFilters();
+  auto cpu_start = threadCPUTime();
+  Finalize(stream_index_buf_, stream_metaindex_buf_, opts_.compress_level);
+  compress_cpu_ += threadCPUTime() - cpu_start;
+  RecordCompressCPUTime();
+  MustStoreMetadata(stream_path_);
+  stream_path_.clear();
+}
+
+void InMemoryPart::MarshalSortedBlocks(
+    std::vector<std::unique_ptr<InMemoryBlock>> &sorted, ThreadPool &pool,
+    bytes &index_buf, bytes &metaindex_buf) {
+  int compress_level = opts_.compress_level;
+  std::vector<MarshaledBlock> mbs(sorted.size());
+  // a task per pool thread, so the CPU clock is read per task instead of
+  // per block; the blocks are strided over the tasks to balance them.
+  auto tasks = std::min(sorted.size(), pool.size());
+  std::atomic<int64_t> cpu_ns{0};
+  pool.ParallelFor(tasks, [&](size_t t) {
+    auto cpu_start = threadCPUTime();
+    for (size_t i = t; i < sorted.size(); i += tasks) {
+      auto &mb = mbs[i];
+      auto [items_count, mt] = sorted[i]->MarshalSortedData(
+          mb.sb, mb.first_item, mb.common_prefix, compress_level);
+      mb.items_count = items_count;
+      mb.mt = mt;
+      mb.raw_bytes = sorted[i]->data().size();
+    }
+    cpu_ns.fetch_add((threadCPUTime() - cpu_start).count(),
+                     std::memory_order_relaxed);
+  });
+  compress_cpu_ += std::chrono::nanoseconds(cpu_ns.load());
+  auto &last_ib = *sorted.back();
+  auto last_item = last_ib.items().back().GetString(last_ib.data());
+  ph_.last_item_.assign(last_item.begin(), last_item.end());
+  std::vector<const InMemoryBlock *> sorted_ptrs;
+  sorted_ptrs.reserve(sorted.size());
+  for (auto &ib : sorted) {
+    sorted_ptrs.push_back(ib.get());
+  }
+  AddToFilters(sorted_ptrs);
+  for (auto &ib : sorted) {
+    InMemoryBlockPool::Put(std::move(ib));
+  }
+  sorted.clear();
+
+  for (auto &mb : mbs) {
+    AppendBlock(mb, index_buf, metaindex_buf, compress_level);
+  }
+}
+
+// BuildFilters builds the part Bloom filters from the sorted items of ibs.
+void InMemoryPart::BuildFilters(const std::vector<const InMemoryBlock *> &ibs) {
+  size_t items_count = 0;
+  for (auto ib : ibs) {
+    items_count += ib->items().size();
+  }
+  InitFilters(items_count);
+  AddToFilters(ibs);
+  FinishFilters();
+}
+
+void InMemoryPart::InitFilters(uint64_t items_count) {
+  bloom_.Init(items_count, opts_.bloom_bits_per_item);
+  prefix_hashes_.clear();
+  has_last_prefix_ = false;
+}
+
+void InMemoryPart::AddToFilters(const std::vector<const InMemoryBlock *> &ibs) {
+  if (!bloom_.empty()) {
+    for (auto ib : ibs) {
+      for (auto &it : ib->items()) {
+        bloom_.Add(StringUtil::BytesConstSpan(it.GetString(ib->data())));
+      }
+    }
+  }
+
+  auto &pe = opts_.prefix_extractor;
+  if (!pe.enabled() || opts_.prefix_bloom_bits_per_item == 0) {
+    return;
+  }
+  // the items are sorted, so equal prefixes are adjacent. Hash every distinct
+  // prefix once and size the filter by their number.
+  for (auto ib : ibs) {
+    for (auto &it : ib->items()) {
+      auto item = StringUtil::BytesConstSpan(it.GetString(ib->data()));
+      if (!pe.InDomain(item)) {
+        continue;
+      }
+      auto prefix = pe.Extract(item);
+      if (has_last_prefix_ &&
+          std::equal(prefix.begin(), prefix.end(), last_prefix_.begin(),
+                     last_prefix_.end())) {
+        continue;
+      }
+      prefix_hashes_.push_back(HashUtil::Hash64(prefix));
+      last_prefix_.assign(prefix.begin(), prefix.end());
+      has_last_prefix_ = true;
+    }
+  }
+}
+
+void InMemoryPart::FinishFilters() {
+  auto &pe = opts_.prefix_extractor;
+  if (!pe.enabled() || opts_.prefix_bloom_bits_per_item == 0) {
+    return;
+  }
+  prefix_bloom_.Init(prefix_hashes_.size(), opts_.prefix_bloom_bits_per_item);
+  for (auto h : prefix_hashes_) {
+    prefix_bloom_.AddHash(h);
+  }
+  prefix_hashes_.clear();
+}
+
+void InMemoryPart::AppendBlock(MarshaledBlock &mb, bytes &index_buf,
+                               bytes &metaindex_buf, int compress_level) {
+  bh_.Reset();
+  bh_.common_prefix.assign(mb.common_prefix.begin(), mb.common_prefix.end());
+  bh_.first_item.assign(mb.first_item.begin(), mb.first_item.end());
+  bh_.items_count = mb.items_count;
+  bh_.mt = mb.mt;
+  bh_.items_block_offset = items_offset_ + items_data_.size();
+  bh_.items_block_size = mb.sb.items_data->size();
+  bh_.lens_block_offset = lens_offset_ + lens_data_.size();
+  bh_.lens_block_size = mb.sb.lens_data->size();
+  // take the buffers of the first block instead of copying them, unless
+  // the part buffers must grow through the huge page reserve.
+  if (items_data_.size() == 0 && !opts_.huge_pages) {
+    items_data_.data()->swap(*mb.sb.items_data);
+  } else {
+    items_data_.Write(*mb.sb.items_data);
+  }
+  if (lens_data_.size() == 0 && !opts_.huge_pages) {
+    lens_data_.data()->swap(*mb.sb.lens_data);
+  } else {
+    lens_data_.Write(*mb.sb.lens_data);
+  }
+
+  if (ph_.blocks_count_ == 0) {
+    ph_.first_item_.assign(bh_.first_item.begin(), bh_.first_item.end());
+  }
+  ph_.items_count_ += bh_.items_count;
+  ph_.blocks_count_++;
+  auto &stats = ph_.stats_;
+  stats.raw_bytes += mb.raw_bytes;
+  stats.items_bytes += bh_.items_block_size;
+  stats.lens_bytes += bh_.lens_block_size;
+  if (bh_.mt == marshalTypePlain) {
+    stats.plain_blocks++;
+  } else {
+    stats.zstd_blocks++;
+  }
+  stats.common_prefix_bytes += bh_.common_prefix.size();
+
+  if (mr_.bhs_count == 0) {
+    mr_.first_item.assign(bh_.first_item.begin(), bh_.first_item.end());
+  }
+  bh_.Marshal(index_buf);
+  mr_.bhs_count++;
+  if (index_buf.size() >= kMaxIndexBlockSize) {
+    FlushIndexBlock(index_buf, metaindex_buf, compress_level);
+  }
+}
+
+void InMemoryPart::RecordCompressCPUTime() {
+  MetricsRegistry::Global()
+      .GetHistogram(fmt::format("mergekv_zstd_compress_cpu_seconds{{level="
+                                "\"{}\"}}",
+                                opts_.compress_level),
+                    "CPU time of marshaling and compressing a part by ZSTD "
+                    "level")
+      .UpdateDuration(compress_cpu_);
+  compress_cpu_ = std::chrono::nanoseconds(0);
+}
+
+void InMemoryPart::FlushIndexBlock(bytes &index_buf, bytes &metaindex_buf,
+                                   int compress_level) {
+  if (index_buf.empty()) {
+    return;
+  }
+  auto &index_data = *index_data_.data();
+  mr_.index_block_offset = index_data.size();
+  EncodingUtil::CompressZSTDLevel(index_data, index_buf, compress_level);
+  mr_.index_block_size = index_data.size() - mr_.index_block_offset;
+  mr_.Marshal(metaindex_buf);
+  mr_.Reset();
+  index_buf.clear();
+}
+
+void InMemoryPart::Finalize(bytes &index_buf, bytes &metaindex_buf,
+                            int compress_level) {
+  FlushIndexBlock(index_buf, metaindex_buf, compress_level);
+  EncodingUtil::CompressZSTDLevel(*metaindex_data_.data(), metaindex_buf,
+                                  compress_level);
+}
+} // namespace mergekv
@@ -1,23 +1,71 @@
 #pragma once
 
 #include "block_header.h"
+#include "bloom_filter.h"
 #include "bytes_util.h"
+#include "compress_policy.h"
+#include "file.h"
 #include "inmemory_block.h"
 #include "metaindex_row.h"
 #include "part.h"
 #include "part_header.h"
+#include "prefix_extractor.h"
 #include "string_util.h"
 #include "types.h"
+#include <chrono>
 #include <cstddef>
 #include <fmt/core.h>
 #include <memory>
 #include <string_view>
+#include <vector>
 
 namespace mergekv {
 
+class ThreadPool;
+
+// the default number of bits per item for the part Bloom filters. It gives
+// about 1% false positive rate.
+const size_t kDefaultBloomBitsPerItem = 10;
+
+// PartOptions controls how parts are built.
+struct PartOptions {
+  // bits per item in the part Bloom filter; 0 disables the filter.
+  size_t bloom_bits_per_item = 0;
+  // the extractor for the prefix Bloom filter; it is disabled by default.
+  PrefixExtractor prefix_extractor;
+  // bits per distinct prefix in the prefix Bloom filter.
+  size_t prefix_bloom_bits_per_item = kDefaultBloomBitsPerItem;
+  // whether to store the metaindex in the flat format as well, so opening
+  // the part doesn't need to decompress and decode the rows.
+  bool flat_metaindex = false;
+  // the ZSTD level for the blocks, the index and the metaindex.
+  int compress_level = kDefaultCompressLevel;
+  // whether to grow the items and lens buffers of in-memory parts in
+  // transparent huge pages; it pays off for big flushed parts. Merged parts
+  // are streamed to disk, and the per-block read buffers are smaller than
+  // a huge page, so neither uses it.
+  bool huge_pages = false;
+};
+
+// MarshaledBlock is an InMemoryBlock marshaled into a StorageBlock, ready to
+// be appended to a part.
+struct MarshaledBlock {
+  StorageBlock sb;
+  bytes first_item;
+  bytes common_prefix;
+  uint32_t items_count = 0;
+  MarshalType mt = marshalTypePlain;
+  // the size of the block items before encoding.
+  size_t raw_bytes = 0;
+};
+
 class InMemoryPart {
 public:
   InMemoryPart() = default;
+  explicit InMemoryPart(const PartOptions &opts) : opts_(opts) {
+    items_data_.SetHugePages(opts.huge_pages);
+    lens_data_.SetHugePages(opts.huge_pages);
+  }
   ~InMemoryPart() = default;
 
   void Reset() {
@@ -28,10 +76,47 @@ public:
     index_data_.Reset();
     items_data_.Reset();
     lens_data_.Reset();
+    bloom_.Reset();
+    prefix_bloom_.Reset();
+    prefix_hashes_.clear();
+    has_last_prefix_ = false;
+    items_offset_ = 0;
+    lens_offset_ = 0;
+    compress_cpu_ = std::chrono::nanoseconds(0);
   }
 
   void MustStoreToDisk(const string &part_path);
   void Init(InMemoryBlock &ib);
+  // InitFromBlocks builds the part from the unsorted blocks ibs.
+  //
+  // The blocks are sorted and marshaled on pool, while the sorted runs are
+  // merged in the caller thread, so the part doesn't depend on the pool
+  // size. ibs are returned to InMemoryBlockPool.
+  void InitFromBlocks(std::vector<std::unique_ptr<InMemoryBlock>> &ibs,
+                      ThreadPool &pool);
+  // InitFromSortedBlocks builds the part from the blocks sorted, whose
+  // items are sorted across the blocks, e.g. the output of a merge. The
+  // blocks are returned to InMemoryBlockPool.
+  void
+  InitFromSortedBlocks(std::vector<std::unique_ptr<InMemoryBlock>> &sorted,
+                       ThreadPool &pool);
+
+  // StartStream starts building the part straight into part_path, so big
+  // parts, e.g. the outputs of merges, aren't held in memory. max_items
+  // bounds the items to be appended; it sizes the Bloom filter.
+  void StartStream(const string &part_path, uint64_t max_items);
+  // AppendSortedBlocks appends the blocks sorted, whose items follow the
+  // items appended before, and writes their data to the part files. The
+  // blocks are marshaled on pool and returned to InMemoryBlockPool.
+  void
+  AppendSortedBlocks(std::vector<std::unique_ptr<InMemoryBlock>> &sorted,
+                     ThreadPool &pool);
+  // FinishStream writes the index, the metaindex, the header and the filters
+  // of the streamed part and syncs its files.
+  void FinishStream();
+
+  // NewPart returns a searchable part sharing the buffers of ip, so the
+  // flushed items are visible without a round trip through the disk.
   std::shared_ptr<Part> NewPart();
 
   PartHeader &ph() { return ph_; }
@@ -42,13 +127,38 @@ public:
   ByteBuffer &index_data() { return index_data_; }
   ByteBuffer &items_data() { return items_data_; }
   ByteBuffer &lens_data() { return lens_data_; }
-
-private:
+  BloomFilter &bloom() { return bloom_; }
+  BloomFilter &prefix_bloom() { return prefix_bloom_; }
+  const PartOptions &opts() const { return opts_; }
+  // size returns the bytes of the part data without the filters.
   size_t size() const {
     return metaindex_data_.size() + index_data_.size() + items_data_.size() +
            lens_data_.size();
   }
 
+private:
+  void AppendBlock(MarshaledBlock &mb, bytes &index_buf,
+                   bytes &metaindex_buf, int compress_level);
+  void FlushIndexBlock(bytes &index_buf, bytes &metaindex_buf,
+                       int compress_level);
+  void Finalize(bytes &index_buf, bytes &metaindex_buf, int compress_level);
+  void BuildFilters(const std::vector<const InMemoryBlock *> &ibs);
+  // the filters are built incrementally while the part is streamed.
+  void InitFilters(uint64_t items_count);
+  void AddToFilters(const std::vector<const InMemoryBlock *> &ibs);
+  void FinishFilters();
+  // MarshalSortedBlocks appends sorted to the part and returns them to
+  // InMemoryBlockPool.
+  void MarshalSortedBlocks(std::vector<std::unique_ptr<InMemoryBlock>> &sorted,
+                           ThreadPool &pool, bytes &index_buf,
+                           bytes &metaindex_buf);
+  // RecordCompressCPUTime exports the CPU time of building the part, once
+  // per part.
+  void RecordCompressCPUTime();
+  // MustStoreMetadata writes everything but items.bin and lens.bin.
+  void MustStoreMetadata(const string &part_path);
+
+  PartOptions opts_;
   PartHeader ph_;
   BlockHeader bh_;
   MetaIndexRow mr_;
@@ -57,6 +167,24 @@ private:
   ByteBuffer index_data_;
   ByteBuffer items_data_;
   ByteBuffer lens_data_;
+  BloomFilter bloom_;
+  BloomFilter prefix_bloom_;
+  // the hashes of the distinct prefixes for prefix_bloom_ and the last one.
+  std::vector<uint64_t> prefix_hashes_;
+  bytes last_prefix_;
+  bool has_last_prefix_ = false;
+
+  // the state of a streamed part: the data files, the bytes already written
+  // to them and the index blocks being built.
+  string stream_path_;
+  std::unique_ptr<BufferFileWriter> items_w_;
+  std::unique_ptr<BufferFileWriter> lens_w_;
+  uint64_t items_offset_ = 0;
+  uint64_t lens_offset_ = 0;
+  bytes stream_index_buf_;
+  bytes stream_metaindex_buf_;
+  // the CPU time spent marshaling and compressing the part so far.
+  std::chrono::nanoseconds compress_cpu_{0};
 };
 
 } // namespace mergekv
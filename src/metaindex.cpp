@@ -0,0 +1,215 @@
+#include "metaindex.h"
+#include "encoding_util.h"
+#include "exception.h"
+#include "io.h"
+#include "string_util.h"
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+namespace mergekv {
+
+const size_t kFlatHeaderSize = 24;
+const size_t kFlatRowSize = 16;
+
+// flatBuilder collects the metaindex rows into the flat layout sections.
+// The sections are joined at the end, since the header needs the rows count
+// and the arena size.
+class flatBuilder {
+public:
+  // Add decodes the marshaled row from src and appends it.
+  void Add(bytes_const_span src) {
+    mr_.Reset();
+    auto tail = mr_.Unmarshal(src);
+    if (!tail.empty()) {
+      throw InvalidInputException("unexpected tail of %d bytes after the "
+                                  "metaindex row",
+                                  tail.size());
+    }
+    auto prev = bytes_const_span(arena_).subspan(prev_offset_);
+    if (rows_count_ > 0 && StringUtil::ToStringView(mr_.first_item) <
+                               StringUtil::ToStringView(prev)) {
+      throw InvalidInputException("metaindex rows aren't sorted by firstItem; "
+                                  "row %d is smaller than the previous one",
+                                  rows_count_);
+    }
+    EncodingUtil::MarshalUint64(rows_, mr_.index_block_offset);
+    EncodingUtil::MarshalUint32(rows_, mr_.index_block_size);
+    EncodingUtil::MarshalUint32(rows_, mr_.bhs_count);
+    prev_offset_ = arena_.size();
+    EncodingUtil::MarshalUint64(offsets_, prev_offset_);
+    arena_.insert(arena_.end(), mr_.first_item.begin(), mr_.first_item.end());
+    rows_count_++;
+  }
+
+  bytes Finish() {
+    if (rows_count_ == 0) {
+      throw InvalidInputException(
+          "expecting non-zero metaindex rows; got zero");
+    }
+    EncodingUtil::MarshalUint64(offsets_, arena_.size());
+
+    bytes data;
+    data.reserve(kFlatHeaderSize + rows_.size() + offsets_.size() +
+                 arena_.size());
+    data.insert(data.end(), kFlatMetaindexMagic.begin(),
+                kFlatMetaindexMagic.end());
+    EncodingUtil::MarshalUint32(data, uint32_t(rows_count_));
+    EncodingUtil::MarshalUint32(data, 0);
+    EncodingUtil::MarshalUint64(data, arena_.size());
+    data.insert(data.end(), rows_.begin(), rows_.end());
+    data.insert(data.end(), offsets_.begin(), offsets_.end());
+    data.insert(data.end(), arena_.begin(), arena_.end());
+    return data;
+  }
+
+private:
+  MetaIndexRow mr_;
+  bytes rows_, offsets_, arena_;
+  size_t rows_count_ = 0;
+  size_t prev_offset_ = 0;
+};
+
+std::shared_ptr<const MetaIndex>
+MetaIndex::FromCompressed(bytes_const_span compressed) {
+  BytesReader r(compressed);
+  return FromReader(r);
+}
+
+std::shared_ptr<const MetaIndex> MetaIndex::FromReader(Reader &r) {
+  flatBuilder fb;
+  ZstdReader zr(r);
+  Reader::ReadRecords(zr, kStreamChunkSize, kMaxMarshaledHeaderSize,
+                      [&fb](bytes_const_span src) {
+                        size_t consumed = 0;
+                        while (auto size = MetaIndexRow::MarshaledSize(
+                                   src.subspan(consumed))) {
+                          fb.Add(src.subspan(consumed, size));
+                          consumed += size;
+                        }
+                        return consumed;
+                      });
+  return FromFlat(fb.Finish());
+}
+
+std::shared_ptr<const MetaIndex> MetaIndex::FromRows(bytes_const_span src) {
+  flatBuilder fb;
+  while (!src.empty()) {
+    auto size = MetaIndexRow::MarshaledSize(src);
+    if (size == 0) {
+      throw InvalidInputException("cannot unmarshal metaindex row from %d "
+                                  "bytes",
+                                  src.size());
+    }
+    fb.Add(src.first(size));
+    src = src.subspan(size);
+  }
+  return FromFlat(fb.Finish());
+}
+
+std::shared_ptr<const MetaIndex> MetaIndex::FromFlat(bytes &&data) {
+  std::shared_ptr<MetaIndex> mi(new MetaIndex());
+  mi->data_ = std::move(data);
+  mi->InitSections();
+  return mi;
+}
+
+void MetaIndex::InitSections() {
+  auto src = bytes_const_span(data_);
+  if (src.size() < kFlatHeaderSize ||
+      StringUtil::ToStringView(src.first(kFlatMetaindexMagic.size())) !=
+          kFlatMetaindexMagic) {
+    throw InvalidInputException("invalid flat metaindex header");
+  }
+  rows_count_ = EncodingUtil::UnmarshalUint32(src.subspan(8));
+  auto arena_size = EncodingUtil::UnmarshalUint64(src.subspan(16));
+  if (rows_count_ == 0) {
+    throw InvalidInputException("expecting non-zero metaindex rows; got zero");
+  }
+  auto rows_size = rows_count_ * kFlatRowSize;
+  auto offsets_size = (rows_count_ + 1) * sizeof(uint64_t);
+  auto want = kFlatHeaderSize + rows_size + offsets_size + arena_size;
+  if (src.size() != want) {
+    throw InvalidInputException(
+        "unexpected flat metaindex size for %d rows; got %d bytes; want %d "
+        "bytes",
+        rows_count_, src.size(), want);
+  }
+  rows_ = src.subspan(kFlatHeaderSize, rows_size);
+  offsets_ = src.subspan(kFlatHeaderSize + rows_size, offsets_size);
+  arena_ = src.subspan(kFlatHeaderSize + rows_size + offsets_size);
+
+  // validate the offsets once, so the accessors don't need to.
+  size_t prev = 0;
+  for (size_t i = 0; i <= rows_count_; i++) {
+    auto off = KeyOffset(i);
+    if (off < prev || off > arena_size) {
+      throw InvalidInputException("invalid flat metaindex key offset %d for "
+                                  "row %d",
+                                  off, i);
+    }
+    prev = off;
+  }
+  if (KeyOffset(0) != 0 || KeyOffset(rows_count_) != arena_size) {
+    throw InvalidInputException("flat metaindex keys don't cover the arena");
+  }
+  for (size_t i = 0; i < rows_count_; i++) {
+    if (BhsCount(i) < 1) {
+      throw InvalidInputException("bhsCount must be greater than 0");
+    }
+    if (IndexBlockSize(i) > 4 * kMaxIndexBlockSize) {
+      throw InvalidInputException(
+          "indexBlockSize is too large: %d; cannot be greater than %d",
+          IndexBlockSize(i), 4 * kMaxIndexBlockSize);
+    }
+  }
+}
+
+size_t MetaIndex::KeyOffset(size_t i) const {
+  return EncodingUtil::UnmarshalUint64(offsets_.subspan(i * sizeof(uint64_t)));
+}
+
+bytes_const_span MetaIndex::FirstItem(size_t i) const {
+  auto start = KeyOffset(i);
+  return arena_.subspan(start, KeyOffset(i + 1) - start);
+}
+
+uint64_t MetaIndex::IndexBlockOffset(size_t i) const {
+  return EncodingUtil::UnmarshalUint64(rows_.subspan(i * kFlatRowSize));
+}
+
+uint32_t MetaIndex::IndexBlockSize(size_t i) const {
+  return EncodingUtil::UnmarshalUint32(rows_.subspan(i * kFlatRowSize + 8));
+}
+
+uint32_t MetaIndex::BhsCount(size_t i) const {
+  return EncodingUtil::UnmarshalUint32(rows_.subspan(i * kFlatRowSize + 12));
+}
+
+MetaIndexRow MetaIndex::Row(size_t i) const {
+  MetaIndexRow mr;
+  auto fi = FirstItem(i);
+  mr.first_item.assign(fi.begin(), fi.end());
+  mr.bhs_count = BhsCount(i);
+  mr.index_block_offset = IndexBlockOffset(i);
+  mr.index_block_size = IndexBlockSize(i);
+  return mr;
+}
+
+size_t MetaIndex::Search(bytes_const_span item) const {
+  // find the first row with first_item > item; the previous row may
+  // contain item.
+  auto s = StringUtil::ToStringView(item);
+  size_t lo = 0, hi = rows_count_;
+  while (lo < hi) {
+    auto mid = lo + (hi - lo) / 2;
+    if (StringUtil::ToStringView(FirstItem(mid)) <= s) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo == 0 ? rows_count_ : lo - 1;
+}
+
+} // namespace mergekv
@@ -0,0 +1,79 @@
+#pragma once
+
+#include "io.h"
+#include "metaindex_row.h"
+#include "types.h"
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+namespace mergekv {
+
+const string kFlatMetaindexMagic = "MKVMIDX1";
+
+// MetaIndex is the flat, read-only form of the part metaindex rows.
+//
+// The rows are kept in a single buffer with the following layout, so the
+// buffer is both the in-memory search structure and the on-disk format:
+//
+//   header:  magic (8 bytes), rows count (u32), reserved (u32),
+//            keys arena size (u64)
+//   rows:    rows count x {index_block_offset (u64), index_block_size (u32),
+//            bhs_count (u32)}
+//   offsets: rows count + 1 x u64 offsets of the first items in the arena
+//   arena:   the first items of all the rows, one after another
+//
+// All the integers are big endian and every section is 8 bytes aligned.
+// Loading it doesn't decode the rows one by one, and it is shared by all the
+// readers of the part.
+class MetaIndex {
+public:
+  // forbid copy
+  MetaIndex(const MetaIndex &) = delete;
+  MetaIndex &operator=(const MetaIndex &) = delete;
+
+  // FromCompressed builds the MetaIndex from the zstd compressed marshaled
+  // rows, i.e. from the metaindex.bin contents.
+  static std::shared_ptr<const MetaIndex>
+  FromCompressed(bytes_const_span compressed);
+  // FromReader builds the MetaIndex from the zstd compressed marshaled rows
+  // read from r. The rows are decompressed and decoded in bounded chunks.
+  static std::shared_ptr<const MetaIndex> FromReader(Reader &r);
+  // FromRows builds the MetaIndex from the decompressed marshaled rows.
+  static std::shared_ptr<const MetaIndex> FromRows(bytes_const_span src);
+  // FromFlat takes the buffer in the flat format, e.g. the contents of
+  // metaindex.flat.bin, and validates it.
+  static std::shared_ptr<const MetaIndex> FromFlat(bytes &&data);
+
+  size_t size() const { return rows_count_; }
+  bool empty() const { return rows_count_ == 0; }
+
+  bytes_const_span FirstItem(size_t i) const;
+  uint64_t IndexBlockOffset(size_t i) const;
+  uint32_t IndexBlockSize(size_t i) const;
+  uint32_t BhsCount(size_t i) const;
+  MetaIndexRow Row(size_t i) const;
+
+  // Search returns the index of the row whose index block may contain item,
+  // i.e. the last row with first_item <= item. It returns size() if item is
+  // smaller than all the rows.
+  size_t Search(bytes_const_span item) const;
+
+  // data returns the buffer in the flat format.
+  bytes_const_span data() const { return data_; }
+  size_t size_bytes() const { return data_.size(); }
+
+private:
+  MetaIndex() = default;
+
+  void InitSections();
+  size_t KeyOffset(size_t i) const;
+
+  bytes data_;
+  size_t rows_count_ = 0;
+  bytes_const_span rows_;
+  bytes_const_span offsets_;
+  bytes_const_span arena_;
+};
+
+} // namespace mergekv
@@ -52,23 +52,33 @@ bytes_const_span MetaIndexRow::Unmarshal(bytes_const_span src) {
   return src;
 }
 
-void MetaIndexRow::UnmarshalMIRows(std::vector<MetaIndexRow> &dst, Reader &r) {
-  bytes data, de_data;
-  Reader::ReadAll(data, r);
-  EncodingUtil::DecompressZSTD(de_data, data);
+size_t MetaIndexRow::MarshaledSize(bytes_const_span src) {
+  auto [len, n] = EncodingUtil::UnmarshalVarUint64(src);
+  if (n < 0) {
+    throw InvalidInputException("cannot unmarshal firstItem length");
+  }
+  if (n == 0) {
+    return 0;
+  }
+  auto size = n + len + sizeof(uint32_t) + sizeof(uint64_t) + sizeof(uint32_t);
+  return src.size() < size ? 0 : size;
+}
 
+void MetaIndexRow::UnmarshalMIRows(std::vector<MetaIndexRow> &dst, Reader &r) {
   auto dst_len = dst.size();
 
-  auto data_span = bytes_const_span(data);
-  while (data_span.size() > 0) {
-    if (dst.size() < dst.capacity()) {
-      dst.resize(dst.size() + 1);
-    } else {
-      dst.emplace_back();
-    }
-    auto &mr = dst[dst.size() - 1];
-    data_span = mr.Unmarshal(data_span);
-  }
+  ZstdReader zr(r);
+  Reader::ReadRecords(
+      zr, kStreamChunkSize, kMaxMarshaledHeaderSize,
+      [&dst](bytes_const_span src) {
+        size_t consumed = 0;
+        while (auto size = MarshaledSize(src.subspan(consumed))) {
+          dst.emplace_back();
+          dst.back().Unmarshal(src.subspan(consumed, size));
+          consumed += size;
+        }
+        return consumed;
+      });
 
   if (dst_len == dst.size()) {
     throw InvalidInputException("expecting non-zero metaindex rows; got zero");
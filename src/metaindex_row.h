@@ -10,6 +10,11 @@
 namespace mergekv {
 
 const uint32_t kMaxIndexBlockSize = 64 * 1024;
+// the upper bound for the marshaled metaindex row or block header, since the
+// items are shorter than kMaxInmemoryBlockSize.
+const size_t kMaxMarshaledHeaderSize = 2 * kMaxInmemoryBlockSize + 64;
+// the chunk size for streaming the metaindex and index blocks.
+const size_t kStreamChunkSize = 64 * 1024;
 
 struct MetaIndexRow {
   bytes first_item;
@@ -38,6 +43,13 @@ struct MetaIndexRow {
   }
 
   bytes_const_span Unmarshal(bytes_const_span src);
+  // MarshaledSize returns the size of the marshaled row at the start of src
+  // or 0 if src doesn't contain the whole row.
+  static size_t MarshaledSize(bytes_const_span src);
+  // UnmarshalMIRows decodes the rows from the zstd compressed stream r.
+  //
+  // The stream is decompressed and decoded incrementally, so only the rows
+  // are kept in memory.
   static void UnmarshalMIRows(std::vector<MetaIndexRow> &dst, Reader &r);
 };
 } // namespace mergekv
\ No newline at end of file
@@ -1,3 +1,345 @@
 #include "part.h"
+#include "block_decoder.h"
+#include "encoding_util.h"
+#include "exception.h"
+#include "file.h"
+#include "filenames.h"
+#include "inmemory_part.h"
+#include "io.h"
+#include "metrics.h"
+#include "string_util.h"
+#include "types.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <utility>
 
-namespace mergekv {}
\ No newline at end of file
+namespace mergekv {
+
+// phaseTimer adds the time since its creation to a PartOpenStats counter.
+class phaseTimer {
+public:
+  explicit phaseTimer(std::atomic<uint64_t> *dst)
+      : dst_(dst), start_(std::chrono::steady_clock::now()) {}
+  ~phaseTimer() {
+    if (dst_ != nullptr) {
+      auto d = std::chrono::steady_clock::now() - start_;
+      dst_->fetch_add(
+          std::chrono::duration_cast<std::chrono::microseconds>(d).count(),
+          std::memory_order_relaxed);
+    }
+  }
+
+private:
+  std::atomic<uint64_t> *dst_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+// ioGuard holds the io_limiter slot while the part files are read.
+class ioGuard {
+public:
+  explicit ioGuard(std::counting_semaphore<> *sem) : sem_(sem) {
+    if (sem_ != nullptr) {
+      sem_->acquire();
+    }
+  }
+  ~ioGuard() {
+    if (sem_ != nullptr) {
+      sem_->release();
+    }
+  }
+
+private:
+  std::counting_semaphore<> *sem_;
+};
+
+// readOptionalFile reads filename into dst if it exists.
+static bool readOptionalFile(const string &filename, bytes &dst) {
+  if (!FileUtils::IsPathExist(filename)) {
+    return false;
+  }
+  FileUtils::MustReadFile(filename, dst);
+  return true;
+}
+
+Part::~Part() {
+  if (must_remove_ && !part_path_.empty()) {
+    std::error_code ec;
+    fs::remove_all(part_path_, ec);
+  }
+}
+
+std::shared_ptr<Part> Part::MustOpen(const string &part_path,
+                                     PartOpenStats *stats,
+                                     std::counting_semaphore<> *io_limiter) {
+  auto counter = [stats](std::atomic<uint64_t> PartOpenStats::*field) {
+    return stats == nullptr ? nullptr : &(stats->*field);
+  };
+  auto p = std::make_shared<Part>();
+  p->part_path_ = part_path;
+  fs::path base_path = part_path;
+  auto flat_path = fs::path(base_path / kFlatMetaindexFilename).string();
+  auto metaindex_path = fs::path(base_path / kMetaindexFilename).string();
+  auto bloom_path = fs::path(base_path / kBloomFilterFilename).string();
+  auto prefix_bloom_path =
+      fs::path(base_path / kPrefixBloomFilterFilename).string();
+
+  bytes metaindex_data, bloom_data, prefix_bloom_data;
+  bool is_flat = false;
+  size_t files_size = 0, metaindex_size = 0;
+  {
+    ioGuard io(io_limiter);
+    {
+      phaseTimer t(counter(&PartOpenStats::metadata_us));
+      p->ph_.MustReadMetadata(part_path);
+    }
+
+    {
+      phaseTimer t(counter(&PartOpenStats::metaindex_read_us));
+      // prefer the flat metaindex, since it is used as is.
+      is_flat = readOptionalFile(flat_path, metaindex_data);
+      // the Bloom filters are optional.
+      readOptionalFile(bloom_path, bloom_data);
+      readOptionalFile(prefix_bloom_path, prefix_bloom_data);
+      metaindex_size = FileUtils::MustFileSize(metaindex_path);
+      files_size =
+          metaindex_size +
+          FileUtils::MustFileSize(fs::path(base_path / kIndexFilename)) +
+          FileUtils::MustFileSize(fs::path(base_path / kItemsFilename)) +
+          FileUtils::MustFileSize(fs::path(base_path / kLensFilename));
+    }
+
+    if (!is_flat) {
+      // the compressed metaindex is streamed, so neither the compressed nor
+      // the decompressed rows are kept in memory as a whole.
+      phaseTimer t(counter(&PartOpenStats::decompress_us));
+      FileRangeReader r(metaindex_path);
+      p->metaindex_ = MetaIndex::FromReader(r);
+    }
+  }
+  auto bytes_read = metaindex_data.size() + bloom_data.size() +
+                    prefix_bloom_data.size() +
+                    (is_flat ? 0 : metaindex_size);
+  p->size_ = files_size + bloom_data.size() + prefix_bloom_data.size() +
+             (is_flat ? metaindex_data.size() : 0);
+
+  {
+    phaseTimer t(counter(&PartOpenStats::validation_us));
+    if (is_flat) {
+      p->metaindex_ = MetaIndex::FromFlat(std::move(metaindex_data));
+    }
+    auto first_item = p->metaindex_->FirstItem(0);
+    if (StringUtil::ToStringView(first_item) !=
+        StringUtil::ToStringView(p->ph_.first_item_)) {
+      throw InvalidInputException(
+          "the first metaindex item %X doesn't match the part first item %X "
+          "in %s",
+          first_item, bytes_const_span(p->ph_.first_item_), part_path.c_str());
+    }
+
+    if (!bloom_data.empty()) {
+      p->bloom_.Unmarshal(bloom_data);
+    }
+    if (!prefix_bloom_data.empty()) {
+      if (prefix_bloom_data.size() < sizeof(uint32_t)) {
+        throw InvalidInputException("cannot unmarshal prefix length from %s",
+                                    prefix_bloom_path.c_str());
+      }
+      p->prefix_bloom_len_ = EncodingUtil::UnmarshalUint32(prefix_bloom_data);
+      if (p->prefix_bloom_len_ == 0) {
+        throw InvalidInputException("zero prefix length in %s",
+                                    prefix_bloom_path.c_str());
+      }
+      p->prefix_bloom_.Unmarshal(
+          bytes_const_span(prefix_bloom_data).subspan(sizeof(uint32_t)));
+    }
+  }
+
+  if (stats != nullptr) {
+    stats->parts.fetch_add(1, std::memory_order_relaxed);
+    stats->bytes_read.fetch_add(bytes_read, std::memory_order_relaxed);
+  }
+  return p;
+}
+
+std::shared_ptr<Part> Part::NewInMemory(InMemoryPart &ip) {
+  if (ip.ph().blocks_count_ == 0) {
+    throw InvalidInputException("cannot serve an empty in-memory part");
+  }
+  auto p = std::make_shared<Part>();
+  p->ph_ = ip.ph();
+  p->metaindex_ = MetaIndex::FromCompressed(*ip.metaindex_data().data());
+  p->index_data_ = ip.index_data().data();
+  p->items_data_ = ip.items_data().data();
+  p->lens_data_ = ip.lens_data().data();
+  p->bloom_ = ip.bloom();
+  if (!ip.prefix_bloom().empty()) {
+    p->prefix_bloom_ = ip.prefix_bloom();
+    p->prefix_bloom_len_ = ip.opts().prefix_extractor.len();
+  }
+  p->size_ = ip.size() + p->bloom_.size_bytes() +
+             p->prefix_bloom_.size_bytes();
+  return p;
+}
+
+// indexBlockData returns the i-th compressed index block of an in-memory
+// part.
+static bytes_const_span indexBlockData(const bytes &index_data,
+                                       const MetaIndex &mi, size_t i) {
+  uint64_t off = mi.IndexBlockOffset(i), size = mi.IndexBlockSize(i);
+  if (off + size > index_data.size()) {
+    throw FatalException("BUG: index block %d is out of the index data", i);
+  }
+  return bytes_const_span(index_data).subspan(off, size);
+}
+
+void Part::MustReadIndexBlock(size_t i, std::vector<BlockHeader> &dst) const {
+  if (InMemory()) {
+    BytesReader r(indexBlockData(*index_data_, *metaindex_, i));
+    BlockHeader::UnmarshalBHs(dst, r, int(metaindex_->BhsCount(i)));
+    return;
+  }
+  auto index_path = fs::path(fs::path(part_path_) / kIndexFilename).string();
+  FileRangeReader r(index_path, metaindex_->IndexBlockOffset(i),
+                    metaindex_->IndexBlockSize(i));
+  BlockHeader::UnmarshalBHs(dst, r, int(metaindex_->BhsCount(i)));
+}
+
+void Part::MustReadIndexBlock(size_t i, IndexBlock &ib) const {
+  if (InMemory()) {
+    ib.Init(indexBlockData(*index_data_, *metaindex_, i),
+            metaindex_->BhsCount(i));
+    return;
+  }
+  thread_local bytes compressed;
+  compressed.clear();
+  auto index_path = fs::path(fs::path(part_path_) / kIndexFilename).string();
+  FileRangeReader r(index_path, metaindex_->IndexBlockOffset(i),
+                    metaindex_->IndexBlockSize(i));
+  Reader::ReadAll(compressed, r);
+  ib.Init(compressed, metaindex_->BhsCount(i));
+}
+
+// blockData returns the compressed items and lens of the j-th block from ib
+// of an in-memory part.
+static std::pair<bytes_const_span, bytes_const_span>
+blockData(const bytes &items_data, const bytes &lens_data, const IndexBlock &ib,
+          size_t j) {
+  auto &bh = ib[j];
+  if (bh.items_block_offset + bh.items_block_size > items_data.size() ||
+      bh.lens_block_offset + bh.lens_block_size > lens_data.size()) {
+    throw FatalException("BUG: block %d is out of the in-memory part", j);
+  }
+  return {bytes_const_span(items_data)
+              .subspan(bh.items_block_offset, bh.items_block_size),
+          bytes_const_span(lens_data)
+              .subspan(bh.lens_block_offset, bh.lens_block_size)};
+}
+
+void Part::MustReadBlock(const IndexBlock &ib, size_t j,
+                         StorageBlock &sb) const {
+  auto &bh = ib[j];
+  if (InMemory()) {
+    auto [items, lens] = blockData(*items_data_, *lens_data_, ib, j);
+    sb.items_data->assign(items.begin(), items.end());
+    sb.lens_data->assign(lens.begin(), lens.end());
+    return;
+  }
+  fs::path base_path = part_path_;
+  sb.items_data->clear();
+  FileRangeReader items_r(fs::path(base_path / kItemsFilename).string(),
+                          bh.items_block_offset, bh.items_block_size);
+  Reader::ReadAll(*sb.items_data, items_r);
+  sb.lens_data->clear();
+  FileRangeReader lens_r(fs::path(base_path / kLensFilename).string(),
+                         bh.lens_block_offset, bh.lens_block_size);
+  Reader::ReadAll(*sb.lens_data, lens_r);
+  if (sb.items_data->size() != bh.items_block_size ||
+      sb.lens_data->size() != bh.lens_block_size) {
+    throw InvalidInputException("cannot read block %d from %s", j,
+                                part_path_.c_str());
+  }
+}
+
+void Part::MustInitBlockDecoder(const IndexBlock &ib, size_t j,
+                                StorageBlock &sb, BlockDecoder &bd) const {
+  auto &bh = ib[j];
+  if (InMemory()) {
+    auto [items, lens] = blockData(*items_data_, *lens_data_, ib, j);
+    bd.Init(items, lens, ib.FirstItem(j), ib.CommonPrefix(j), bh.items_count,
+            bh.mt);
+    return;
+  }
+  MustReadBlock(ib, j, sb);
+  bd.Init(sb, ib.FirstItem(j), ib.CommonPrefix(j), bh.items_count, bh.mt);
+}
+
+bool Part::Contains(bytes_const_span item) const {
+  if (!MayContain(item)) {
+    return false;
+  }
+  auto i = metaindex_->Search(item);
+  if (i == metaindex_->size()) {
+    return false;
+  }
+  thread_local IndexBlock ib;
+  MustReadIndexBlock(i, ib);
+  auto j = ib.Search(item);
+  if (j == ib.size()) {
+    return false;
+  }
+
+  thread_local StorageBlock sb;
+  thread_local BlockDecoder bd;
+  MustInitBlockDecoder(ib, j, sb, bd);
+  auto s = StringUtil::ToStringView(item);
+  while (bd.Next()) {
+    auto n = bd.ItemString().compare(s);
+    if (n >= 0) {
+      return n == 0;
+    }
+  }
+  return false;
+}
+
+bool Part::MayContain(bytes_const_span item) const {
+  auto s = StringUtil::ToStringView(item);
+  if (s < StringUtil::ToStringView(ph_.first_item_) ||
+      s > StringUtil::ToStringView(ph_.last_item_)) {
+    return false;
+  }
+  if (bloom_.empty()) {
+    return true;
+  }
+  // the filter lets lookups skip the index and block reads.
+  static auto &requests = MetricsRegistry::Global().GetCounter(
+      "mergekv_bloom_filter_requests_total",
+      "item lookups checked against part Bloom filters");
+  static auto &skips = MetricsRegistry::Global().GetCounter(
+      "mergekv_bloom_filter_skips_total",
+      "item lookups answered by part Bloom filters without reading blocks");
+  requests.Add();
+  if (!bloom_.MayContain(item)) {
+    skips.Add();
+    return false;
+  }
+  return true;
+}
+
+bool Part::MayContainPrefix(bytes_const_span prefix) const {
+  // items with the prefix are in [prefix, last item with the prefix], so
+  // the part may contain them only if this range intersects the part range.
+  auto s = StringUtil::ToStringView(prefix);
+  auto first = StringUtil::ToStringView(ph_.first_item_);
+  if (StringUtil::ToStringView(ph_.last_item_) < s ||
+      (first > s && !first.starts_with(s))) {
+    return false;
+  }
+  if (prefix_bloom_len_ == 0 || prefix.size() < prefix_bloom_len_) {
+    return true;
+  }
+  return prefix_bloom_.MayContain(prefix.first(prefix_bloom_len_));
+}
+
+} // namespace mergekv
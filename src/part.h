@@ -1,21 +1,136 @@
 #pragma once
 
+#include "block_header.h"
+#include "bloom_filter.h"
 #include "file.h"
-#include "metaindex_row.h"
+#include "index_block.h"
+#include "inmemory_block.h"
+#include "metaindex.h"
 #include "part_header.h"
 #include "types.h"
+#include <atomic>
 #include <cstddef>
+#include <cstdint>
+#include <fmt/core.h>
 #include <memory>
+#include <semaphore>
 #include <vector>
 
 namespace mergekv {
+
+class BlockDecoder;
+class InMemoryPart;
+
+// PartOpenStats accumulates the time spent in every phase of opening parts.
+// It may be shared by concurrent openers.
+struct PartOpenStats {
+  std::atomic<uint64_t> parts{0};
+  std::atomic<uint64_t> bytes_read{0};
+  // reading and parsing metadata.json.
+  std::atomic<uint64_t> metadata_us{0};
+  // reading the flat metaindex and the Bloom filters.
+  std::atomic<uint64_t> metaindex_read_us{0};
+  // streaming, decompressing and decoding the compressed metaindex.
+  std::atomic<uint64_t> decompress_us{0};
+  // checking the metaindex and decoding the Bloom filters.
+  std::atomic<uint64_t> validation_us{0};
+
+  string to_string() const {
+    return fmt::format("PartOpenStats: {{parts: {}, bytes_read: {}, "
+                       "metadata_us: {}, metaindex_read_us: {}, "
+                       "decompress_us: {}, validation_us: {}}}",
+                       parts.load(), bytes_read.load(), metadata_us.load(),
+                       metaindex_read_us.load(), decompress_us.load(),
+                       validation_us.load());
+  }
+};
+
 class Part {
+public:
+  Part() = default;
+  ~Part();
+
+  // forbid copy
+  Part(const Part &) = delete;
+  Part &operator=(const Part &) = delete;
+
+  // MustOpen opens the part stored at part_path.
+  //
+  // The phase timings are added to stats if it isn't null. File reads are
+  // done under io_limiter if it isn't null, so concurrent openers don't
+  // flood the disk.
+  static std::shared_ptr<Part>
+  MustOpen(const string &part_path, PartOpenStats *stats = nullptr,
+           std::counting_semaphore<> *io_limiter = nullptr);
+
+  // NewInMemory returns a part served from the buffers of ip without
+  // writing them anywhere. The buffers are shared, not copied; ip detaches
+  // from them on its next Reset.
+  static std::shared_ptr<Part> NewInMemory(InMemoryPart &ip);
+
+  // MustReadIndexBlock appends the block headers from the i-th index block
+  // to dst. The index block is streamed from index.bin.
+  void MustReadIndexBlock(size_t i, std::vector<BlockHeader> &dst) const;
+  // MustReadIndexBlock decodes the i-th index block into ib in place,
+  // reusing the ib buffers.
+  void MustReadIndexBlock(size_t i, IndexBlock &ib) const;
+  // MustReadBlock reads the items and lens of the j-th block from ib into
+  // sb.
+  void MustReadBlock(const IndexBlock &ib, size_t j, StorageBlock &sb) const;
+  // MustInitBlockDecoder prepares bd for reading the j-th block from ib. The
+  // blocks of in-memory parts are decoded straight from the part buffers, so
+  // the part must outlive the decoding; the stored blocks are read into sb.
+  void MustInitBlockDecoder(const IndexBlock &ib, size_t j, StorageBlock &sb,
+                            BlockDecoder &bd) const;
+
+  // Contains returns true if the part contains item. It goes through the
+  // metaindex, a single index block and a single data block.
+  bool Contains(bytes_const_span item) const;
+
+  // MayContain returns false if the part definitely doesn't contain item.
+  //
+  // It checks the item range from the part header and the Bloom filter if
+  // the part has one, without touching the index.
+  bool MayContain(bytes_const_span item) const;
+
+  // MayContainPrefix returns false if the part definitely doesn't contain
+  // items starting with prefix.
+  //
+  // The prefix Bloom filter is used only for prefixes at least as long as
+  // the prefix the filter was built with.
+  bool MayContainPrefix(bytes_const_span prefix) const;
+
+  const PartHeader &ph() const { return ph_; }
+  // metaindex is immutable, so it is shared with the part readers.
+  const std::shared_ptr<const MetaIndex> &metaindex() const {
+    return metaindex_;
+  }
+  const BloomFilter &bloom() const { return bloom_; }
+  const BloomFilter &prefix_bloom() const { return prefix_bloom_; }
+  size_t prefix_bloom_len() const { return prefix_bloom_len_; }
+  // path is empty for the in-memory parts.
+  const string &path() const { return part_path_; }
+  bool InMemory() const { return items_data_ != nullptr; }
+  size_t size() const { return size_; }
+
+  // MustRemoveOnClose makes the part remove its directory when the last
+  // reference to it is dropped, so readers of a merged part finish first.
+  void MustRemoveOnClose() { must_remove_ = true; }
 
 private:
   PartHeader ph_;
   string part_path_;
-  size_t size_;
-  std::vector<MetaIndexRow> mrs_;
+  size_t size_ = 0;
+  std::shared_ptr<const MetaIndex> metaindex_;
+  BloomFilter bloom_;
+  BloomFilter prefix_bloom_;
+  size_t prefix_bloom_len_ = 0;
+  std::atomic<bool> must_remove_{false};
+
+  // the data of the in-memory parts; null for the parts on disk.
+  std::shared_ptr<const bytes> index_data_;
+  std::shared_ptr<const bytes> items_data_;
+  std::shared_ptr<const bytes> lens_data_;
 
   std::unique_ptr<BufferFileWriter> metaindex_data_;
 };
@@ -1,42 +1,75 @@
 #include "part_header.h"
+#include "encoding_util.h"
+#include "file.h"
 #include "filenames.h"
+#include "hash_util.h"
 #include <fstream>
 #include <nlohmann/json.hpp>
 #include <nlohmann/json_fwd.hpp>
 #include <simdjson.h>
 
 namespace mergekv {
+// metadataParser reuses the simdjson parser and the padded input buffer
+// across the metadata files read by a thread.
+struct metadataParser {
+  simdjson::dom::parser parser;
+  simdjson::padded_string buf;
+
+  static metadataParser &Local() {
+    thread_local metadataParser p;
+    return p;
+  }
+};
+
 void PartHeader::MustReadMetadata(const string &part_path) {
   Reset();
   fs::path base_path = part_path;
-  auto metadata_path = fs::path(base_path / kMetadataFilename);
+  auto header_path = fs::path(base_path / kPartHeaderFilename).string();
+  if (FileUtils::IsPathExist(header_path)) {
+    MustReadBinary(header_path);
+  } else {
+    // parts written before the binary header have metadata.json only.
+    MustReadJSON(fs::path(base_path / kMetadataFilename).string());
+  }
+  Validate();
+}
 
-  std::ifstream file(metadata_path, std::ios::binary);
-  if (!file.is_open()) {
-    throw InvalidInputException("Failed to open file: " +
-                                metadata_path.string());
+void PartHeader::MustReadBinary(const string &header_path) {
+  thread_local bytes buf;
+  buf.clear();
+  FileUtils::MustReadFile(header_path, buf);
+  try {
+    Unmarshal(buf);
+  } catch (const std::exception &e) {
+    throw InvalidInputException("cannot read part header from %s: %s",
+                                header_path.c_str(), e.what());
   }
-  file.seekg(0, std::ios::end);
-  std::streamsize size = file.tellg();
-  file.seekg(0, std::ios::beg);
+}
 
-  bytes metadata(size);
-  file.read(reinterpret_cast<char *>(metadata.data()), size);
+void PartHeader::MustReadJSON(const string &metadata_path) {
+  auto &mp = metadataParser::Local();
+  auto size = FileUtils::MustReadFileTo(metadata_path, [&mp](size_t size) {
+    if (mp.buf.size() < size) {
+      mp.buf = simdjson::padded_string(size);
+    }
+    return mp.buf.data();
+  });
 
-  simdjson::dom::parser parser;
+  // buf is padded, so the parser doesn't need to copy it.
   simdjson::dom::element metadata_element;
-  auto error =
-      parser.parse(metadata.data(), metadata.size()).get(metadata_element);
+  auto error = mp.parser.parse(mp.buf.data(), size, false)
+                   .get(metadata_element);
   if (error) {
     throw InvalidInputException("Failed to parse metadata: error_code: %d",
                                 error);
   }
 
   PartHeaderJson phj;
-  if (metadata_element["items_count"].get(items_count_) != simdjson::SUCCESS) {
+  if (metadata_element["items_count"].get(phj.items_count) !=
+      simdjson::SUCCESS) {
     throw InvalidInputException("Failed to parse 'items_count'");
   }
-  if (metadata_element["blocks_count"].get(blocks_count_) !=
+  if (metadata_element["blocks_count"].get(phj.blocks_count) !=
       simdjson::SUCCESS) {
     throw InvalidInputException("Failed to parse 'blocks_count'");
   }
@@ -51,11 +84,33 @@ void PartHeader::MustReadMetadata(const string &part_path) {
     throw InvalidInputException("Failed to parse 'last_item'");
   }
 
+  // the stats are optional, since older parts don't have them.
+  simdjson::dom::object stats;
+  if (metadata_element["stats"].get(stats) == simdjson::SUCCESS) {
+    auto field = [&stats](const char *name, uint64_t &dst) {
+      if (stats[name].get(dst) != simdjson::SUCCESS) {
+        throw InvalidInputException("Failed to parse 'stats.%s'", name);
+      }
+    };
+    field("raw_bytes", stats_.raw_bytes);
+    field("items_bytes", stats_.items_bytes);
+    field("lens_bytes", stats_.lens_bytes);
+    field("plain_blocks", stats_.plain_blocks);
+    field("zstd_blocks", stats_.zstd_blocks);
+    field("common_prefix_bytes", stats_.common_prefix_bytes);
+  }
+
   items_count_ = phj.items_count;
+  blocks_count_ = phj.blocks_count;
+  first_item_ =
+      StringUtil::DecodeHex(StringUtil::BytesConstSpan(phj.first_item));
+  last_item_ = StringUtil::DecodeHex(StringUtil::BytesConstSpan(phj.last_item));
+}
+
+void PartHeader::Validate() const {
   if (items_count_ < 1) {
     throw InvalidInputException("items_count must be greater than 0");
   }
-  blocks_count_ = phj.blocks_count;
   if (blocks_count_ < 1) {
     throw InvalidInputException("blocks_count must be greater than 0");
   }
@@ -66,21 +121,124 @@ void PartHeader::MustReadMetadata(const string &part_path) {
         "items_count: blocks_count: %d, items_count: %d",
         blocks_count_, items_count_);
   }
+}
+
+// the binary header layout:
+//
+//   magic (4 bytes), version (u32), items_count (u64), blocks_count (u64),
+//   first_item and last_item marshaled with MarshalBytes,
+//   since version 2: raw_bytes, items_bytes, lens_bytes, plain_blocks,
+//   zstd_blocks and common_prefix_bytes (u64 each),
+//   checksum (u64) - Hash64 of all the preceding bytes.
+void PartHeader::Marshal(bytes &dst) const {
+  auto start = dst.size();
+  dst.insert(dst.end(), kPartHeaderMagic.begin(), kPartHeaderMagic.end());
+  EncodingUtil::MarshalUint32(dst, kPartHeaderVersion);
+  EncodingUtil::MarshalUint64(dst, items_count_);
+  EncodingUtil::MarshalUint64(dst, blocks_count_);
+  EncodingUtil::MarshalBytes(dst, first_item_);
+  EncodingUtil::MarshalBytes(dst, last_item_);
+  for (auto v : {stats_.raw_bytes, stats_.items_bytes, stats_.lens_bytes,
+                 stats_.plain_blocks, stats_.zstd_blocks,
+                 stats_.common_prefix_bytes}) {
+    EncodingUtil::MarshalUint64(dst, v);
+  }
+  EncodingUtil::MarshalUint64(
+      dst, HashUtil::Hash64(bytes_const_span(dst).subspan(start)));
+}
 
-  first_item_ =
-      StringUtil::DecodeHex(StringUtil::BytesConstSpan(phj.first_item));
-  last_item_ = StringUtil::DecodeHex(StringUtil::BytesConstSpan(phj.last_item));
+void PartHeader::Unmarshal(bytes_const_span src) {
+  Reset();
+  const size_t fixed_size = kPartHeaderMagic.size() + 4 + 8 + 8;
+  if (src.size() < fixed_size + 8) {
+    throw InvalidInputException("too short part header: %d bytes",
+                                src.size());
+  }
+  auto body = src.first(src.size() - 8);
+  auto checksum = EncodingUtil::UnmarshalUint64(src.subspan(body.size()));
+  if (HashUtil::Hash64(body) != checksum) {
+    throw InvalidInputException("part header checksum mismatch");
+  }
+  if (StringUtil::ToStringView(body.first(kPartHeaderMagic.size())) !=
+      kPartHeaderMagic) {
+    throw InvalidInputException("invalid part header magic");
+  }
+  body = body.subspan(kPartHeaderMagic.size());
+  auto version = EncodingUtil::UnmarshalUint32(body);
+  if (version < 1 || version > kPartHeaderVersion) {
+    throw InvalidInputException("unsupported part header version %d; want %d",
+                                version, kPartHeaderVersion);
+  }
+  items_count_ = EncodingUtil::UnmarshalUint64(body.subspan(4));
+  blocks_count_ = EncodingUtil::UnmarshalUint64(body.subspan(12));
+  body = body.subspan(20);
+
+  auto [first_item, n_first] = EncodingUtil::UnmarshalBytes(body);
+  if (n_first <= 0) {
+    throw InvalidInputException("cannot unmarshal first_item");
+  }
+  body = body.subspan(n_first);
+  auto [last_item, n_last] = EncodingUtil::UnmarshalBytes(body);
+  if (n_last <= 0) {
+    throw InvalidInputException("cannot unmarshal last_item");
+  }
+  body = body.subspan(n_last);
+  if (version >= 2) {
+    const size_t stats_size = 6 * 8;
+    if (body.size() < stats_size) {
+      throw InvalidInputException("cannot unmarshal part stats from %d bytes",
+                                  body.size());
+    }
+    for (auto dst : {&stats_.raw_bytes, &stats_.items_bytes,
+                     &stats_.lens_bytes, &stats_.plain_blocks,
+                     &stats_.zstd_blocks, &stats_.common_prefix_bytes}) {
+      *dst = EncodingUtil::UnmarshalUint64(body);
+      body = body.subspan(8);
+    }
+  }
+  if (!body.empty()) {
+    throw InvalidInputException("unexpected tail left after part header: %d "
+                                "bytes",
+                                body.size());
+  }
+  first_item_.assign(first_item.begin(), first_item.end());
+  last_item_.assign(last_item.begin(), last_item.end());
+}
+
+std::vector<PartHeader>
+PartHeader::MustReadMetadataBatch(const std::vector<string> &part_paths) {
+  std::vector<PartHeader> phs(part_paths.size());
+  for (size_t i = 0; i < part_paths.size(); i++) {
+    phs[i].MustReadMetadata(part_paths[i]);
+  }
+  return phs;
 }
 
 void PartHeader::MustWriteMetadata(const string &part_path) {
   fs::path base_path = part_path;
+  bytes header;
+  Marshal(header);
+  FileUtils::MustWriteSync(fs::path(base_path / kPartHeaderFilename), header);
+
+  // metadata.json isn't needed for opening the part any more; it is kept as
+  // the human readable export of the header.
   auto metadata_path = fs::path(base_path / kMetadataFilename);
 
   nlohmann::json metadata_object;
   metadata_object["items_count"] = items_count_;
   metadata_object["blocks_count"] = blocks_count_;
-  metadata_object["first_item"] = StringUtil::EncodeHex(first_item_);
-  metadata_object["last_item"] = StringUtil::EncodeHex(last_item_);
+  metadata_object["first_item"] =
+      StringUtil::ToString(StringUtil::EncodeHex(first_item_));
+  metadata_object["last_item"] =
+      StringUtil::ToString(StringUtil::EncodeHex(last_item_));
+  metadata_object["stats"] = {
+      {"raw_bytes", stats_.raw_bytes},
+      {"items_bytes", stats_.items_bytes},
+      {"lens_bytes", stats_.lens_bytes},
+      {"plain_blocks", stats_.plain_blocks},
+      {"zstd_blocks", stats_.zstd_blocks},
+      {"common_prefix_bytes", stats_.common_prefix_bytes},
+  };
 
   string metadata_data = metadata_object.dump();
   std::ofstream metadata_file(metadata_path);
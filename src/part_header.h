@@ -1,9 +1,58 @@
 #pragma once
 #include "string_util.h"
 #include "types.h"
+#include <cstdint>
 #include <fmt/core.h>
+#include <vector>
 
 namespace mergekv {
+const string kPartHeaderMagic = "MKPH";
+// version 2 adds PartStats.
+const uint32_t kPartHeaderVersion = 2;
+
+// PartStats describes how the part blocks are encoded, so compression
+// settings can be tuned from real data.
+struct PartStats {
+  // the size of the items before encoding.
+  uint64_t raw_bytes = 0;
+  // the sizes of items.bin and lens.bin.
+  uint64_t items_bytes = 0;
+  uint64_t lens_bytes = 0;
+  uint64_t plain_blocks = 0;
+  uint64_t zstd_blocks = 0;
+  // the sum of the block common prefix lengths.
+  uint64_t common_prefix_bytes = 0;
+
+  void Reset() { *this = PartStats(); }
+  void Add(const PartStats &src) {
+    raw_bytes += src.raw_bytes;
+    items_bytes += src.items_bytes;
+    lens_bytes += src.lens_bytes;
+    plain_blocks += src.plain_blocks;
+    zstd_blocks += src.zstd_blocks;
+    common_prefix_bytes += src.common_prefix_bytes;
+  }
+
+  uint64_t blocks() const { return plain_blocks + zstd_blocks; }
+  // CompressionRatio returns raw_bytes divided by the encoded size.
+  double CompressionRatio() const {
+    auto n = items_bytes + lens_bytes;
+    return n == 0 ? 0 : double(raw_bytes) / double(n);
+  }
+  double AvgCommonPrefixLen() const {
+    return blocks() == 0 ? 0 : double(common_prefix_bytes) / double(blocks());
+  }
+
+  string to_string() const {
+    return fmt::format(
+        "PartStats: {{raw_bytes: {}, items_bytes: {}, lens_bytes: {}, "
+        "plain_blocks: {}, zstd_blocks: {}, avg_common_prefix_len: {:.1f}, "
+        "compression_ratio: {:.2f}}}",
+        raw_bytes, items_bytes, lens_bytes, plain_blocks, zstd_blocks,
+        AvgCommonPrefixLen(), CompressionRatio());
+  }
+};
+
 struct PartHeaderJson {
   size_t items_count;
   size_t blocks_count;
@@ -20,14 +69,15 @@ struct PartHeader {
     blocks_count_ = 0;
     first_item_.clear();
     last_item_.clear();
+    stats_.Reset();
   }
 
   string to_string() const {
     return fmt::format("PartHeader: {{items_count: {}, blocks_count: {}, "
-                       "first_item: {}, last_item: {}}}",
+                       "first_item: {}, last_item: {}, stats: {}}}",
                        items_count_, blocks_count_,
                        StringUtil::Format(first_item_),
-                       StringUtil::Format(last_item_));
+                       StringUtil::Format(last_item_), stats_.to_string());
   }
 
   void CopyFrom(const PartHeader &src) {
@@ -35,15 +85,42 @@ struct PartHeader {
     blocks_count_ = src.blocks_count_;
     first_item_ = bytes(src.first_item_);
     last_item_ = bytes(src.last_item_);
+    stats_ = src.stats_;
   }
 
+  double AvgItemsPerBlock() const {
+    return blocks_count_ == 0 ? 0 : double(items_count_) / blocks_count_;
+  }
+
+  // MustReadMetadata reads the part header from part_path.
+  //
+  // It prefers the binary header.bin and falls back to metadata.json for the
+  // parts written without it.
+  // The JSON parser and the read buffer are reused by the calling thread, so
+  // opening many parts from a few threads doesn't allocate per part.
   void MustReadMetadata(const string &part_path);
+  // MustReadMetadataBatch reads the metadata of all the parts in part_paths
+  // with the same parser and buffer.
+  static std::vector<PartHeader>
+  MustReadMetadataBatch(const std::vector<string> &part_paths);
+  // MustWriteMetadata writes header.bin and metadata.json to part_path.
   void MustWriteMetadata(const string &part_path);
 
-  size_t items_count_;
-  size_t blocks_count_;
+  // Marshal appends the checksummed binary header to dst.
+  void Marshal(bytes &dst) const;
+  void Unmarshal(bytes_const_span src);
+
+  size_t items_count_ = 0;
+  size_t blocks_count_ = 0;
   bytes first_item_;
   bytes last_item_;
+  // zero for the parts written before the stats were recorded.
+  PartStats stats_;
+
+private:
+  void MustReadBinary(const string &header_path);
+  void MustReadJSON(const string &metadata_path);
+  void Validate() const;
 };
 
 } // namespace mergekv
\ No newline at end of file
@@ -0,0 +1,30 @@
+#include "part_reader.h"
+
+namespace mergekv {
+
+bool PartReader::Next() {
+  while (!has_block_ || !bd_.Next()) {
+    if (!NextBlock()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool PartReader::NextBlock() {
+  auto &mi = *p_->metaindex();
+  if (!has_block_ || bh_idx_ >= ib_.size()) {
+    if (mr_idx_ >= mi.size()) {
+      has_block_ = false;
+      return false;
+    }
+    p_->MustReadIndexBlock(mr_idx_++, ib_);
+    bh_idx_ = 0;
+  }
+  p_->MustInitBlockDecoder(ib_, bh_idx_, sb_, bd_);
+  bh_idx_++;
+  has_block_ = true;
+  return true;
+}
+
+} // namespace mergekv
@@ -0,0 +1,43 @@
+#pragma once
+
+#include "block_decoder.h"
+#include "index_block.h"
+#include "inmemory_block.h"
+#include "part.h"
+#include "types.h"
+#include <cstddef>
+#include <memory>
+
+namespace mergekv {
+
+// PartReader reads all the items of a part in sorted order, one block at a
+// time, so merges don't load whole parts into memory.
+class PartReader {
+public:
+  explicit PartReader(std::shared_ptr<Part> p) : p_(std::move(p)) {}
+
+  // forbid copy, since Item() points into the decoder buffers
+  PartReader(const PartReader &) = delete;
+  PartReader &operator=(const PartReader &) = delete;
+
+  // Next advances to the next item. It returns false after the last item.
+  bool Next();
+  // Item is valid until the next call to Next.
+  bytes_const_span Item() const { return bd_.Item(); }
+  const std::shared_ptr<Part> &part() const { return p_; }
+
+private:
+  bool NextBlock();
+
+  std::shared_ptr<Part> p_;
+  // the next index block and the next block in it.
+  size_t mr_idx_ = 0;
+  size_t bh_idx_ = 0;
+  bool has_block_ = false;
+
+  IndexBlock ib_;
+  StorageBlock sb_;
+  BlockDecoder bd_;
+};
+
+} // namespace mergekv
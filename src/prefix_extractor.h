@@ -0,0 +1,33 @@
+#pragma once
+
+#include "types.h"
+#include <cstddef>
+
+namespace mergekv {
+
+// PrefixExtractor maps items to the fixed-length prefixes indexed by the part
+// prefix Bloom filters, e.g. the namespace and tag prefix of the items.
+//
+// Items shorter than the prefix are outside the extractor domain and aren't
+// indexed. The zero length extractor is disabled.
+class PrefixExtractor {
+public:
+  PrefixExtractor() = default;
+  explicit PrefixExtractor(size_t len) : len_(len) {}
+
+  bool enabled() const { return len_ > 0; }
+  size_t len() const { return len_; }
+
+  bool InDomain(bytes_const_span item) const {
+    return enabled() && item.size() >= len_;
+  }
+  // Extract returns the prefix of an item from the extractor domain.
+  bytes_const_span Extract(bytes_const_span item) const {
+    return item.first(len_);
+  }
+
+private:
+  size_t len_ = 0;
+};
+
+} // namespace mergekv
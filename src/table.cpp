@@ -1 +1,570 @@
 #include "table.h"
+#include "exception.h"
+#include "file.h"
+#include "filenames.h"
+#include "metrics.h"
+#include "part_reader.h"
+#include "string_util.h"
+#include "thread_pool.h"
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstdio>
+#include <fmt/core.h>
+#include <fstream>
+#include <nlohmann/json.hpp>
+#include <queue>
+#include <semaphore>
+
+namespace mergekv {
+
+// AddItems flushes the table early only if its added items take at least
+// that fraction of the raw items limit; otherwise it stalls.
+const int64_t kEarlyFlushLimitDivisor = 8;
+
+// tableMetrics are shared by all the tables.
+struct tableMetrics {
+  Histogram &flush_duration;
+  Counter &flushed_items;
+  Histogram &merge_duration;
+  Counter &merged_items;
+  Histogram &lookup_duration;
+  Gauge &parts;
+  Counter &raw_bytes;
+  Counter &encoded_bytes;
+  Counter &plain_blocks;
+  Counter &zstd_blocks;
+  Counter &early_flushes;
+  Counter &add_stalls;
+  Histogram &add_stall_duration;
+  Gauge &inmemory_parts;
+  Counter &stored_by_age;
+  Counter &stored_by_budget;
+  Counter &stored_on_close;
+  Counter &dropped_inmemory_parts;
+
+  static tableMetrics &Get() {
+    auto &r = MetricsRegistry::Global();
+    static tableMetrics m{
+        r.GetHistogram("mergekv_flush_duration_seconds",
+                       "durations of flushing added items into parts"),
+        r.GetCounter("mergekv_flushed_items_total", "items flushed to parts"),
+        r.GetHistogram("mergekv_merge_duration_seconds",
+                       "part merge durations"),
+        r.GetCounter("mergekv_merged_items_total", "items written by merges"),
+        r.GetHistogram("mergekv_lookup_duration_seconds",
+                       "Table::Contains durations"),
+        r.GetGauge("mergekv_parts", "parts in the open tables"),
+        r.GetCounter("mergekv_part_raw_bytes_total",
+                     "item bytes written to parts before encoding"),
+        r.GetCounter("mergekv_part_encoded_bytes_total",
+                     "items and lens bytes written to parts"),
+        r.GetCounter("mergekv_part_blocks_total{type=\"plain\"}",
+                     "blocks written to parts by marshal type"),
+        r.GetCounter("mergekv_part_blocks_total{type=\"zstd\"}"),
+        r.GetCounter("mergekv_early_flushes_total",
+                     "flushes started by AddItems over the memory budget"),
+        r.GetCounter("mergekv_add_stalls_total",
+                     "AddItems calls waiting for a flush in progress"),
+        r.GetHistogram("mergekv_add_stall_duration_seconds",
+                       "AddItems waits for a flush in progress"),
+        r.GetGauge("mergekv_inmemory_parts",
+                   "flushed parts served from memory until stored"),
+        r.GetCounter("mergekv_inmemory_parts_stored_total{reason=\"age\"}",
+                     "in-memory parts stored without a merge by reason"),
+        r.GetCounter("mergekv_inmemory_parts_stored_total{reason=\"budget\"}"),
+        r.GetCounter("mergekv_inmemory_parts_stored_total{reason=\"close\"}"),
+        r.GetCounter("mergekv_inmemory_parts_dropped_total",
+                     "in-memory parts dropped by tables destroyed without "
+                     "MustClose")};
+    return m;
+  }
+
+  void UpdateEncoding(const PartStats &stats) {
+    raw_bytes.Add(stats.raw_bytes);
+    encoded_bytes.Add(stats.items_bytes + stats.lens_bytes);
+    plain_blocks.Add(stats.plain_blocks);
+    zstd_blocks.Add(stats.zstd_blocks);
+  }
+};
+
+// readPartNames returns the names of the table parts in path.
+static std::vector<string> readPartNames(const string &path) {
+  std::vector<string> names;
+  auto parts_path = fs::path(fs::path(path) / kPartsFilename);
+  if (FileUtils::IsPathExist(parts_path.string())) {
+    std::ifstream file(parts_path);
+    try {
+      names = nlohmann::json::parse(file).get<std::vector<string>>();
+    } catch (const std::exception &e) {
+      throw InvalidInputException("cannot parse %s: %s",
+                                  parts_path.string().c_str(), e.what());
+    }
+  } else {
+    for (auto &entry : fs::directory_iterator(path)) {
+      if (entry.is_directory() &&
+          fs::exists(entry.path() / kMetadataFilename)) {
+        names.push_back(entry.path().filename().string());
+      }
+    }
+  }
+  std::sort(names.begin(), names.end());
+  return names;
+}
+
+// parsePartIdx parses the hex index of the part named name. It returns
+// false for the names which aren't part names.
+static bool parsePartIdx(const string &name, uint64_t &idx) {
+  auto [ptr, ec] =
+      std::from_chars(name.data(), name.data() + name.size(), idx, 16);
+  return !name.empty() && ec == std::errc() &&
+         ptr == name.data() + name.size();
+}
+
+// removeOrphanParts removes the part directories in path which aren't
+// among names, e.g. the ones left by a crashed flush or merge, or the
+// merged parts whose removal was interrupted. It returns the index after
+// the largest part name in path, so new parts never reuse a directory.
+static uint64_t removeOrphanParts(const string &path,
+                                  const std::vector<string> &names) {
+  uint64_t next_idx = 0;
+  for (auto &entry : fs::directory_iterator(path)) {
+    auto name = entry.path().filename().string();
+    uint64_t idx = 0;
+    if (!entry.is_directory() || !parsePartIdx(name, idx)) {
+      continue;
+    }
+    next_idx = std::max(next_idx, idx + 1);
+    if (!std::binary_search(names.begin(), names.end(), name)) {
+      fs::remove_all(entry.path());
+    }
+  }
+  return next_idx;
+}
+
+std::unique_ptr<Table> Table::MustOpen(const string &path,
+                                       const TableOptions &opts) {
+  auto start = std::chrono::steady_clock::now();
+  auto tb = std::make_unique<Table>(path, opts);
+  fs::create_directories(path);
+  auto names = readPartNames(path);
+  tb->merge_idx = removeOrphanParts(path, names);
+
+  auto concurrency = opts.open_concurrency;
+  if (concurrency == 0) {
+    concurrency = ThreadPool::DefaultConcurrency();
+  }
+  concurrency = std::max<size_t>(1, std::min(concurrency, names.size()));
+  std::counting_semaphore<> io_limiter(
+      std::max<ptrdiff_t>(1, ptrdiff_t(opts.open_io_concurrency)));
+  std::vector<std::shared_ptr<Part>> parts(names.size());
+  if (!names.empty()) {
+    ThreadPool pool(concurrency);
+    pool.ParallelFor(names.size(), [&](size_t i) {
+      auto part_path = fs::path(fs::path(path) / names[i]).string();
+      parts[i] = Part::MustOpen(part_path, &tb->open_stats, &io_limiter);
+    });
+  }
+
+  tableMetrics::Get().parts.Add(int64_t(parts.size()));
+  tb->parts = std::move(parts);
+  tb->pressure_monitor = opts.pressure_monitor;
+  if (tb->pressure_monitor == nullptr && opts.memory_budget == nullptr) {
+    tb->pressure_monitor = &MemoryPressureMonitor::Global();
+  }
+  if (tb->pressure_monitor != nullptr) {
+    // flush on pressure even if no items are added to trigger it, and store
+    // the aged in-memory parts of idle tables on every refresh.
+    auto t = tb.get();
+    tb->pressure_listener = tb->pressure_monitor->Subscribe([t](bool pressure) {
+      if (pressure) {
+        std::unique_lock<std::mutex> flush_guard(t->flush_lock,
+                                                 std::try_to_lock);
+        if (flush_guard.owns_lock()) {
+          // the flush checks the in-memory parts as well.
+          if (t->FlushLocked()) {
+            tableMetrics::Get().early_flushes.Add();
+          }
+          return;
+        }
+      }
+      t->TryStoreInMemoryParts();
+    });
+  }
+  tb->open_duration_us = std::chrono::duration_cast<std::chrono::microseconds>(
+                             std::chrono::steady_clock::now() - start)
+                             .count();
+  return tb;
+}
+
+Table::~Table() {
+  if (pressure_monitor != nullptr) {
+    pressure_monitor->Unsubscribe(pressure_listener);
+  }
+  // the destructor doesn't store anything, so it never throws; MustClose
+  // stores the in-memory data.
+  auto &m = tableMetrics::Get();
+  if (!inmemory_parts.empty()) {
+    m.dropped_inmemory_parts.Add(inmemory_parts.size());
+    m.inmemory_parts.Add(-int64_t(inmemory_parts.size()));
+    // fprintf, unlike fmt::print, doesn't throw on write errors.
+    std::fprintf(stderr,
+                 "table %s is destroyed without MustClose; dropping %zu "
+                 "flushed in-memory parts\n",
+                 path.c_str(), inmemory_parts.size());
+  }
+  m.parts.Add(-int64_t(parts.size()));
+  budget().Release(MemoryConsumer::kRawItems, pending_bytes);
+}
+
+size_t Table::PartsCount() {
+  std::lock_guard<std::mutex> lock(parts_lock);
+  return parts.size();
+}
+
+TableStats Table::Stats() {
+  TableStats stats;
+  std::lock_guard<std::mutex> lock(parts_lock);
+  for (auto &p : parts) {
+    stats.parts++;
+    stats.inmemory_parts += p->InMemory();
+    stats.items_count += p->ph().items_count_;
+    stats.blocks_count += p->ph().blocks_count_;
+    stats.encoding.Add(p->ph().stats_);
+  }
+  return stats;
+}
+
+std::vector<std::shared_ptr<Part>>
+Table::PartsForPrefix(bytes_const_span prefix) {
+  std::vector<std::shared_ptr<Part>> dst;
+  std::lock_guard<std::mutex> lock(parts_lock);
+  for (auto &p : parts) {
+    if (p->MayContainPrefix(prefix)) {
+      dst.push_back(p);
+    }
+  }
+  return dst;
+}
+
+void Table::AddItems(const std::vector<bytes_const_span> &items) {
+  auto &b = budget();
+  if (b.OverLimit(MemoryConsumer::kRawItems)) {
+    auto &m = tableMetrics::Get();
+    int64_t pending = 0;
+    {
+      std::lock_guard<std::mutex> lock(pending_lock);
+      pending = pending_bytes;
+    }
+    // the limit is shared by all the tables, so only the tables holding a
+    // fair share of it flush early; flushing the few items of a small table
+    // would only pile up tiny parts while the big consumer keeps its items.
+    auto flush = pending >= b.Limit(MemoryConsumer::kRawItems) /
+                                kEarlyFlushLimitDivisor;
+    // a single early flush or stall per call, so the writers never block
+    // for long on the items of other tables.
+    std::unique_lock<std::mutex> flush_guard(flush_lock, std::defer_lock);
+    if (flush && flush_guard.try_lock()) {
+      m.early_flushes.Add();
+      FlushLocked();
+    } else {
+      m.add_stalls.Add();
+      HistogramTimer timer(m.add_stall_duration);
+      b.WaitForRelease(MemoryConsumer::kRawItems, opts.max_add_stall);
+    }
+  }
+
+  int64_t n = 0;
+  std::lock_guard<std::mutex> lock(pending_lock);
+  for (auto item : items) {
+    if (pending_blocks.empty() || !pending_blocks.back()->Add(item)) {
+      pending_blocks.push_back(InMemoryBlockPool::Get());
+      if (!pending_blocks.back()->Add(item)) {
+        b.Reserve(MemoryConsumer::kRawItems, n);
+        pending_bytes += n;
+        throw InvalidInputException("too long item: %d bytes; cannot exceed "
+                                    "%d bytes",
+                                    item.size(), kMaxInmemoryBlockSize);
+      }
+    }
+    n += int64_t(item.size() + sizeof(Item));
+  }
+  b.Reserve(MemoryConsumer::kRawItems, n);
+  pending_bytes += n;
+}
+
+bool Table::Flush() {
+  std::lock_guard<std::mutex> flush_guard(flush_lock);
+  return FlushLocked();
+}
+
+bool Table::FlushLocked() {
+  std::vector<std::unique_ptr<InMemoryBlock>> ibs;
+  int64_t raw_bytes = 0;
+  {
+    std::lock_guard<std::mutex> lock(pending_lock);
+    ibs.swap(pending_blocks);
+    std::swap(raw_bytes, pending_bytes);
+  }
+  if (ibs.empty()) {
+    // idle tables still store their aged in-memory parts.
+    TryStoreInMemoryParts();
+    return false;
+  }
+  auto &m = tableMetrics::Get();
+  HistogramTimer timer(m.flush_duration);
+  auto part_opts = opts.part_opts;
+  part_opts.compress_level = opts.compress_policy.FlushLevel();
+  auto ip = std::make_unique<InMemoryPart>(part_opts);
+  ip->InitFromBlocks(ibs, pool);
+  ibs.clear();
+  // the items now live in the part until it is stored.
+  auto size = int64_t(ip->size());
+  auto &b = budget();
+  auto defer = size < int64_t(opts.max_inmemory_part_bytes) &&
+               b.Usage(MemoryConsumer::kInMemoryParts) + size <=
+                   b.Limit(MemoryConsumer::kInMemoryParts);
+  auto part_mem =
+      std::make_unique<MemoryReservation>(b, MemoryConsumer::kInMemoryParts,
+                                          size);
+  b.Release(MemoryConsumer::kRawItems, raw_bytes);
+  m.flushed_items.Add(ip->ph().items_count_);
+  m.UpdateEncoding(ip->ph().stats_);
+  if (!defer) {
+    auto part_path = NewPartPath();
+    ip->MustStoreToDisk(part_path);
+    AddPart(Part::MustOpen(part_path), {});
+    return true;
+  }
+
+  auto p = ip->NewPart();
+  {
+    // the part is added and published under the same lock, so the stores
+    // and the merges always find it in both places.
+    std::lock_guard<std::mutex> lock(inmemory_lock);
+    AddPart(p, {});
+    inmemory_parts.push_back(deferredPart{std::move(ip), p,
+                                          std::chrono::steady_clock::now(),
+                                          std::move(part_mem)});
+    m.inmemory_parts.Add(1);
+  }
+  TryStoreInMemoryParts();
+  return true;
+}
+
+void Table::TryStoreInMemoryParts() {
+  // a running merge checks the in-memory parts once it is done, including
+  // the parts flushed after it started.
+  std::unique_lock<std::mutex> merge_guard(merge_lock, std::try_to_lock);
+  if (merge_guard.owns_lock()) {
+    StoreInMemoryPartsLocked(false);
+  }
+}
+
+void Table::MustClose() {
+  Flush();
+  MustStoreInMemoryParts();
+}
+
+void Table::MustStoreInMemoryParts() {
+  std::lock_guard<std::mutex> merge_guard(merge_lock);
+  StoreInMemoryPartsLocked(true);
+}
+
+void Table::StoreInMemoryPartsLocked(bool all) {
+  auto &m = tableMetrics::Get();
+  auto &b = budget();
+  auto now = std::chrono::steady_clock::now();
+  std::vector<std::pair<deferredPart, storeReason>> stored;
+  {
+    std::lock_guard<std::mutex> lock(inmemory_lock);
+    // the oldest parts go first, so the budget keeps the newest ones.
+    auto over = b.Usage(MemoryConsumer::kInMemoryParts) -
+                b.Limit(MemoryConsumer::kInMemoryParts);
+    std::vector<deferredPart> kept;
+    for (auto &e : inmemory_parts) {
+      auto size = int64_t(e.ip->size());
+      if (all) {
+        stored.emplace_back(std::move(e), storeReason::kClose);
+      } else if (now - e.created >= opts.max_inmemory_part_age) {
+        stored.emplace_back(std::move(e), storeReason::kAge);
+      } else if (over > 0) {
+        stored.emplace_back(std::move(e), storeReason::kBudget);
+      } else {
+        kept.push_back(std::move(e));
+        continue;
+      }
+      over -= size;
+    }
+    inmemory_parts.swap(kept);
+    m.inmemory_parts.Add(-int64_t(stored.size()));
+  }
+  for (auto &[e, reason] : stored) {
+    auto part_path = NewPartPath();
+    e.ip->MustStoreToDisk(part_path);
+    AddPart(Part::MustOpen(part_path), {e.p});
+    switch (reason) {
+    case storeReason::kAge:
+      m.stored_by_age.Add();
+      break;
+    case storeReason::kBudget:
+      m.stored_by_budget.Add();
+      break;
+    case storeReason::kClose:
+      m.stored_on_close.Add();
+      break;
+    }
+  }
+}
+
+bool Table::MergeParts() {
+  std::lock_guard<std::mutex> merge_guard(merge_lock);
+  auto src = PartsSnapshot();
+  if (src.size() < 2) {
+    return false;
+  }
+  auto &m = tableMetrics::Get();
+  HistogramTimer timer(m.merge_duration);
+
+  struct Cursor {
+    PartReader *r;
+    size_t idx;
+  };
+  // equal items are ordered by the source part index, like in
+  // InMemoryPart::InitFromBlocks.
+  auto greater = [](const Cursor &a, const Cursor &b) {
+    auto n = StringUtil::ToStringView(a.r->Item())
+                 .compare(StringUtil::ToStringView(b.r->Item()));
+    if (n != 0) {
+      return n > 0;
+    }
+    return a.idx > b.idx;
+  };
+  std::vector<std::unique_ptr<PartReader>> readers;
+  std::priority_queue<Cursor, std::vector<Cursor>, decltype(greater)> heap(
+      greater);
+  for (size_t i = 0; i < src.size(); i++) {
+    readers.push_back(std::make_unique<PartReader>(src[i]));
+    if (readers.back()->Next()) {
+      heap.push(Cursor{readers.back().get(), i});
+    }
+  }
+
+  // the merged part is streamed to disk in batches of blocks, so only a
+  // batch is held in memory however big the merge is. A batch takes up to
+  // twice its blocks with their marshaled copies.
+  size_t batch_blocks = 4 * pool.size();
+  MemoryReservation merge_mem(budget(), MemoryConsumer::kMergeBuffers,
+                              int64_t(2 * batch_blocks *
+                                      kMaxInmemoryBlockSize));
+
+  // merges keep all the items, so the source headers give the exact size.
+  uint64_t raw_bytes = 0, items_count = 0;
+  for (auto &p : src) {
+    raw_bytes += p->ph().stats_.raw_bytes;
+    items_count += p->ph().items_count_;
+  }
+  // the level depends on the merged size, so big merges compress harder.
+  auto part_opts = opts.part_opts;
+  part_opts.compress_level = opts.compress_policy.MergeLevel(raw_bytes);
+  InMemoryPart ip(part_opts);
+  auto part_path = NewPartPath();
+  ip.StartStream(part_path, items_count);
+
+  std::vector<std::unique_ptr<InMemoryBlock>> sorted;
+  sorted.push_back(InMemoryBlockPool::Get());
+  while (!heap.empty()) {
+    auto c = heap.top();
+    heap.pop();
+    auto item = c.r->Item();
+    if (!sorted.back()->Add(item)) {
+      if (sorted.size() >= batch_blocks) {
+        ip.AppendSortedBlocks(sorted, pool);
+      }
+      sorted.push_back(InMemoryBlockPool::Get());
+      if (!sorted.back()->Add(item)) {
+        throw InvalidInputException("too long item: %d bytes; cannot exceed "
+                                    "%d bytes",
+                                    item.size(), kMaxInmemoryBlockSize);
+      }
+    }
+    if (c.r->Next()) {
+      heap.push(c);
+    }
+  }
+  readers.clear();
+  ip.AppendSortedBlocks(sorted, pool);
+  ip.FinishStream();
+  m.merged_items.Add(ip.ph().items_count_);
+  m.UpdateEncoding(ip.ph().stats_);
+  AddPart(Part::MustOpen(part_path), src);
+  for (auto &p : src) {
+    p->MustRemoveOnClose();
+  }
+  {
+    // the merged in-memory parts are stored as a part of the new part.
+    std::lock_guard<std::mutex> lock(inmemory_lock);
+    auto n = std::erase_if(inmemory_parts, [&src](const deferredPart &e) {
+      return std::find(src.begin(), src.end(), e.p) != src.end();
+    });
+    m.inmemory_parts.Add(-int64_t(n));
+  }
+  // the flushes during the merge skipped the store check.
+  StoreInMemoryPartsLocked(false);
+  return true;
+}
+
+bool Table::Contains(bytes_const_span item) {
+  HistogramTimer timer(tableMetrics::Get().lookup_duration);
+  auto ps = PartsSnapshot();
+  // the newest parts go last and are the most likely to be hot.
+  for (auto it = ps.rbegin(); it != ps.rend(); it++) {
+    if ((*it)->Contains(item)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+string Table::NewPartPath() {
+  return fs::path(fs::path(path) / fmt::format("{:016X}", merge_idx++))
+      .string();
+}
+
+void Table::AddPart(std::shared_ptr<Part> p,
+                    const std::vector<std::shared_ptr<Part>> &removed) {
+  std::lock_guard<std::mutex> json_guard(parts_json_lock);
+  // parts.json lists only the stored parts, so it is rewritten only when
+  // they change.
+  auto stored_changed = !p->InMemory();
+  for (auto &x : removed) {
+    stored_changed = stored_changed || !x->InMemory();
+  }
+  std::vector<string> names;
+  {
+    std::lock_guard<std::mutex> lock(parts_lock);
+    std::erase_if(parts, [&removed](const std::shared_ptr<Part> &x) {
+      return std::find(removed.begin(), removed.end(), x) != removed.end();
+    });
+    parts.push_back(std::move(p));
+    tableMetrics::Get().parts.Add(1 - int64_t(removed.size()));
+    for (auto &x : parts) {
+      if (!x->InMemory()) {
+        names.push_back(fs::path(x->path()).filename().string());
+      }
+    }
+  }
+  if (!stored_changed) {
+    return;
+  }
+  auto data = nlohmann::json(names).dump();
+  FileUtils::MustWriteAtomic(fs::path(fs::path(path) / kPartsFilename),
+                             StringUtil::BytesConstSpan(data), true);
+}
+
+std::vector<std::shared_ptr<Part>> Table::PartsSnapshot() {
+  std::lock_guard<std::mutex> lock(parts_lock);
+  return parts;
+}
+
+} // namespace mergekv
@@ -1,17 +1,198 @@
 #pragma once
 
+#include "compress_policy.h"
+#include "inmemory_part.h"
+#include "memory_budget.h"
+#include "memory_pressure.h"
+#include "part.h"
+#include "thread_pool.h"
 #include "types.h"
 #include <atomic>
+#include <chrono>
 #include <cstdint>
+#include <memory>
 #include <mutex>
+#include <vector>
 
 namespace mergekv {
+
+// TableOptions controls the table behaviour.
+struct TableOptions {
+  // options for the parts created by the table, including the prefix
+  // extractor for the part prefix Bloom filters.
+  PartOptions part_opts;
+  // the number of threads opening parts; 0 means the number of CPUs.
+  size_t open_concurrency = 0;
+  // the maximum number of parts reading their files at the same time.
+  size_t open_io_concurrency = 16;
+  // the number of threads sorting and compressing blocks on flushes and
+  // merges; 0 means the number of CPUs.
+  size_t flush_concurrency = 0;
+  // the ZSTD levels for flushed and merged parts. It overrides
+  // part_opts.compress_level.
+  CompressLevelPolicy compress_policy;
+  // the budget accounting the added items, the flushed parts and the merge
+  // buffers; null means MemoryBudget::Global().
+  MemoryBudget *memory_budget = nullptr;
+  // the monitor whose pressure events flush the table early; null means
+  // MemoryPressureMonitor::Global() for the global budget and none for the
+  // other budgets.
+  MemoryPressureMonitor *pressure_monitor = nullptr;
+  // how long AddItems waits for the memory of other tables or of a flush in
+  // progress once the added items exceed their memory share.
+  std::chrono::milliseconds max_add_stall{100};
+  // flushed parts smaller than that stay in memory until they are merged,
+  // get older than max_inmemory_part_age or the table is closed, which
+  // saves the file creations and fsyncs of small parts; 0 stores every
+  // flushed part right away. The in-memory parts are stored early once
+  // they exceed their share of the memory budget. The age and the budget
+  // are checked on flushes, after merges and on every refresh of the
+  // pressure monitor, so tables without a monitor store the parts of idle
+  // periods on their next Flush.
+  size_t max_inmemory_part_bytes = 0;
+  std::chrono::milliseconds max_inmemory_part_age{30000};
+};
+
+// TableStats aggregates the part headers of a table.
+struct TableStats {
+  size_t parts = 0;
+  // the parts among parts which aren't stored yet.
+  size_t inmemory_parts = 0;
+  uint64_t items_count = 0;
+  uint64_t blocks_count = 0;
+  PartStats encoding;
+
+  double AvgItemsPerBlock() const {
+    return blocks_count == 0 ? 0 : double(items_count) / blocks_count;
+  }
+  string to_string() const {
+    return fmt::format("TableStats: {{parts: {}, inmemory_parts: {}, "
+                       "items_count: {}, blocks_count: {}, "
+                       "avg_items_per_block: {:.1f}, {}}}",
+                       parts, inmemory_parts, items_count, blocks_count,
+                       AvgItemsPerBlock(), encoding.to_string());
+  }
+};
+
 class Table {
 public:
+  explicit Table(const string &path, const TableOptions &opts = {})
+      : path(path), opts(opts),
+        pool(opts.flush_concurrency == 0 ? ThreadPool::DefaultConcurrency()
+                                         : opts.flush_concurrency) {}
+  ~Table();
+
+  // MustOpen opens the table at path with all its parts.
+  //
+  // The parts are listed in parts.json; all the part directories are opened
+  // if it is missing. The part directories which aren't listed are left by
+  // crashed flushes and merges, so they are removed. The parts are opened
+  // on a thread pool, while at most opts.open_io_concurrency of them read
+  // files at the same time.
+  static std::unique_ptr<Table> MustOpen(const string &path,
+                                         const TableOptions &opts = {});
+
+  // PartsForPrefix returns the parts which may contain items starting with
+  // prefix, so prefix scans skip the rest of the parts without touching
+  // their indexes.
+  std::vector<std::shared_ptr<Part>> PartsForPrefix(bytes_const_span prefix);
+
+  // AddItems adds items to the table. They become visible to Contains after
+  // the next Flush.
+  //
+  // Once the added items of all the tables exceed their share of the memory
+  // budget, AddItems flushes them early if this table holds at least 1/8 of
+  // that share and no flush is in progress. Otherwise it waits up to
+  // opts.max_add_stall for the other tables to release memory.
+  void AddItems(const std::vector<bytes_const_span> &items);
+  // Flush stores the added items into a new part. It returns false if there
+  // were no items to flush.
+  //
+  // With opts.max_inmemory_part_bytes set, the new part may stay in memory,
+  // so a flushed part is durable only after it is stored, merged or the
+  // table is closed with MustClose. Tables destroyed without MustClose
+  // drop such parts and report them in
+  // mergekv_inmemory_parts_dropped_total.
+  bool Flush();
+  // MergeParts merges all the parts into a single one, which is streamed to
+  // disk block by block, so the merge memory doesn't grow with the table.
+  // The source parts are removed once their readers are done. It returns
+  // false if there was nothing to merge.
+  bool MergeParts();
+  // MustStoreInMemoryParts stores all the in-memory parts.
+  void MustStoreInMemoryParts();
+  // MustClose flushes the added items and stores all the in-memory parts,
+  // so nothing is lost on shutdown. The destructor stores nothing, so the
+  // tables destroyed without MustClose drop the added items and the
+  // in-memory parts.
+  void MustClose();
+  // Contains returns true if one of the parts contains item.
+  bool Contains(bytes_const_span item);
+
+  const TableOptions &options() const { return opts; }
+  size_t PartsCount();
+  // Stats sums the headers of the current parts.
+  TableStats Stats();
+  // OpenStats returns the phase timings of the parts opened by MustOpen.
+  const PartOpenStats &OpenStats() const { return open_stats; }
+  uint64_t OpenDurationUs() const { return open_duration_us; }
+
 private:
-  std::atomic<uint64_t> merge_idx;
+  MemoryBudget &budget() {
+    return opts.memory_budget ? *opts.memory_budget : MemoryBudget::Global();
+  }
+  // deferredPart is a flushed part served from memory until it is stored.
+  struct deferredPart {
+    std::unique_ptr<InMemoryPart> ip;
+    std::shared_ptr<Part> p;
+    std::chrono::steady_clock::time_point created;
+    std::unique_ptr<MemoryReservation> mem;
+  };
+  enum class storeReason { kAge, kBudget, kClose };
+
+  bool FlushLocked();
+  // TryStoreInMemoryParts stores the in-memory parts which are too old or
+  // over the budget, unless a merge is running; the merge checks them
+  // itself once it is done.
+  void TryStoreInMemoryParts();
+  // StoreInMemoryPartsLocked stores the in-memory parts which are too old or
+  // over the budget, or all of them if all is set. merge_lock must be held.
+  void StoreInMemoryPartsLocked(bool all);
+  string NewPartPath();
+  // AddPart replaces the parts in removed with p and updates parts.json.
+  void AddPart(std::shared_ptr<Part> p,
+               const std::vector<std::shared_ptr<Part>> &removed);
+  std::vector<std::shared_ptr<Part>> PartsSnapshot();
+
+  std::atomic<uint64_t> merge_idx{0};
   string path;
+  TableOptions opts;
+  PartOpenStats open_stats;
+  uint64_t open_duration_us = 0;
+
+  ThreadPool pool;
+
+  std::mutex pending_lock;
+  std::vector<std::unique_ptr<InMemoryBlock>> pending_blocks;
+  // the bytes of pending_blocks reserved from the budget.
+  int64_t pending_bytes = 0;
+
+  // serializes flushes, so AddItems knows if one is in progress.
+  std::mutex flush_lock;
+  MemoryPressureMonitor *pressure_monitor = nullptr;
+  uint64_t pressure_listener = 0;
 
+  // serializes merges, so every part is merged at most once. It also
+  // serializes storing the in-memory parts, so they aren't stored while
+  // being merged.
+  std::mutex merge_lock;
+  // the in-memory parts from the oldest to the newest. The flushes add them
+  // to parts under this lock, so they are in both or in neither.
+  std::mutex inmemory_lock;
+  std::vector<deferredPart> inmemory_parts;
+  // serializes parts.json updates, so the file follows the parts order.
+  std::mutex parts_json_lock;
   std::mutex parts_lock;
+  std::vector<std::shared_ptr<Part>> parts;
 };
 } // namespace mergekv
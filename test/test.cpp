@@ -42,4 +42,28 @@ TEST(MarshalUnmarshal, VarUint64) {
     testMarshalUnmarshalVarUint64(i << 54);
   }
 }
+
+TEST(MarshalUnmarshal, VarUint64MatchesVarUint64s) {
+  // MarshalData writes lens one by one, so they must be encoded the same
+  // way as MarshalVarUint64s does.
+  u64s ls;
+  for (uint64_t i = 0; i < 64; i++) {
+    ls.push_back(uint64_t(1) << i);
+    ls.push_back((uint64_t(1) << i) - 1);
+    ls.push_back((uint64_t(1) << i) + 1);
+  }
+  ls.push_back(~uint64_t(0));
+
+  bytes one_by_one, batch;
+  for (auto l : ls) {
+    EncodingUtil::MarshalVarUint64(one_by_one, l);
+  }
+  EncodingUtil::MarshalVarUint64s(batch, ls);
+  EXPECT_EQ(one_by_one, batch);
+
+  u64s dst(ls.size());
+  auto tail = EncodingUtil::UnmarshalVarUint64s(dst, one_by_one);
+  EXPECT_TRUE(tail.empty());
+  EXPECT_EQ(dst, ls);
+}
 } // namespace mergekv
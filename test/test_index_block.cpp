@@ -0,0 +1,80 @@
+#include "block_header.h"
+#include "encoding_util.h"
+#include "exception.h"
+#include "index_block.h"
+#include "string_util.h"
+#include "types.h"
+#include "gtest/gtest.h"
+#include <fmt/core.h>
+#include <vector>
+
+namespace mergekv {
+namespace {
+
+// marshalBlockHeaders returns n marshaled block headers sorted by
+// first_item.
+bytes marshalBlockHeaders(size_t n) {
+  bytes data;
+  for (size_t i = 0; i < n; i++) {
+    BlockHeader bh;
+    bh.common_prefix = StringUtil::Bytes(fmt::format("cp_{:04}", i));
+    bh.first_item = StringUtil::Bytes(fmt::format("cp_{:04}_first", i));
+    bh.mt = i % 2 == 0 ? marshalTypePlain : marshalTypeSZTD;
+    bh.items_count = uint32_t(i + 1);
+    bh.items_block_offset = i * 100;
+    bh.lens_block_offset = i * 10;
+    bh.items_block_size = uint32_t(100);
+    bh.lens_block_size = uint32_t(10);
+    bh.Marshal(data);
+  }
+  return data;
+}
+
+} // namespace
+
+TEST(IndexBlock, Init) {
+  const size_t n = 300;
+  auto data = marshalBlockHeaders(n);
+  bytes compressed;
+  EncodingUtil::CompressZSTDLevel(compressed, data, 1);
+
+  IndexBlock ib;
+  ib.Init(compressed, n);
+  ASSERT_EQ(ib.size(), n);
+
+  std::vector<BlockHeader> bhs;
+  BlockHeader::UnmarshalBHs(bhs, data, n);
+  for (size_t i = 0; i < n; i++) {
+    EXPECT_EQ(StringUtil::ToStringView(ib.FirstItem(i)),
+              StringUtil::ToStringView(bhs[i].first_item));
+    EXPECT_EQ(StringUtil::ToStringView(ib.CommonPrefix(i)),
+              StringUtil::ToStringView(bhs[i].common_prefix));
+    EXPECT_EQ(ib[i].mt, bhs[i].mt);
+    EXPECT_EQ(ib[i].items_count, bhs[i].items_count);
+    EXPECT_EQ(ib[i].items_block_offset, bhs[i].items_block_offset);
+    EXPECT_EQ(ib[i].lens_block_offset, bhs[i].lens_block_offset);
+  }
+
+  auto search = [&ib](const string &s) {
+    return ib.Search(StringUtil::BytesConstSpan(s));
+  };
+  EXPECT_EQ(search("a"), ib.size());
+  EXPECT_EQ(search("cp_0000_first"), 0);
+  EXPECT_EQ(search("cp_0042_first_x"), 42);
+  EXPECT_EQ(search("cp_0043"), 42);
+  EXPECT_EQ(search("z"), n - 1);
+
+  // re-decoding a smaller block reuses the buffers.
+  ib.InitDecompressed(marshalBlockHeaders(10), 10);
+  EXPECT_EQ(ib.size(), 10);
+  EXPECT_EQ(StringUtil::ToStringView(ib.FirstItem(9)), "cp_0009_first");
+}
+
+TEST(IndexBlock, Invalid) {
+  auto data = marshalBlockHeaders(5);
+  IndexBlock ib;
+  EXPECT_THROW(ib.InitDecompressed(data, 4), InvalidInputException);
+  EXPECT_THROW(ib.InitDecompressed(data, 6), InvalidInputException);
+}
+
+} // namespace mergekv
@@ -1,3 +1,4 @@
+#include "block_decoder.h"
 #include "encoding.h"
 #include "inmemory_block.h"
 #include "string_util.h"
@@ -120,6 +121,90 @@ TEST(InmemoryBlock, Sort) {
   }
 }
 
+TEST(InmemoryBlock, SortSharedPrefix) {
+  std::random_device rd;
+  std::mt19937 gen(rd());
+
+  // items share long prefixes and differ after the first 8 bytes following
+  // the common prefix, including duplicates and zero bytes.
+  for (size_t i = 0; i < 50; i++) {
+    InMemoryBlock block;
+    std::vector<string> items;
+    for (size_t j = 0; j < 2000; j++) {
+      auto s = fmt::format("metric_{}{{instance=\"host-{}\"}}",
+                           get_randown_num(gen, 3), get_randown_num(gen, 500));
+      if (j % 7 == 0) {
+        s.push_back('\0');
+      }
+      auto bd = to_bytes(s);
+      if (!block.Add(bd)) {
+        break;
+      }
+      items.push_back(s);
+    }
+
+    block.SortItems();
+    std::sort(items.begin(), items.end());
+
+    ASSERT_EQ(block.items().size(), items.size());
+    for (size_t j = 0; j < items.size(); j++) {
+      EXPECT_EQ(block.items()[j].GetString(block.data()), items[j]);
+    }
+  }
+}
+
+TEST(PrefixedItem, Compare) {
+  auto f = [](const string &a, const string &b, size_t skip) {
+    bytes data = to_bytes(a + b);
+    auto ia = Item(0, a.size());
+    auto ib = Item(a.size(), a.size() + b.size());
+    auto pa = PrefixedItem(ia, data, skip);
+    auto pb = PrefixedItem(ib, data, skip);
+    auto n = PrefixedItem::Compare(pa, data, pb, data, skip);
+    auto expect = a.substr(skip).compare(b.substr(skip));
+    EXPECT_EQ(n < 0, expect < 0) << a << " vs " << b;
+    EXPECT_EQ(n == 0, expect == 0) << a << " vs " << b;
+  };
+
+  f("", "", 0);
+  f("a", "", 0);
+  f("", "a", 0);
+  f("ab", string("ab\0", 3), 0);
+  f(string("ab\0", 3), "ab", 0);
+  f("01234567", "012345678", 0);
+  f("0123456789a", "0123456789b", 0);
+  f("0123456789a", "0123456789", 0);
+  f("prefix_01234567x", "prefix_01234567y", 7);
+  f("prefix_0", "prefix_", 7);
+  f("prefix_abc", "prefix_abd", 7);
+}
+
+TEST(InMemoryBlockPool, GetPut) {
+  auto ib = InMemoryBlockPool::Get();
+  auto item = to_bytes("foobar");
+  EXPECT_TRUE(ib->Add(item));
+  auto data_ptr = ib->data().data();
+  InMemoryBlockPool::Put(std::move(ib));
+
+  // the recycled block is empty, but keeps its buffers.
+  ib = InMemoryBlockPool::Get();
+  EXPECT_TRUE(ib->items().empty());
+  EXPECT_TRUE(ib->data().empty());
+  EXPECT_TRUE(ib->Add(item));
+  EXPECT_EQ(ib->data().data(), data_ptr);
+  InMemoryBlockPool::Put(std::move(ib));
+
+  // the pool doesn't grow beyond MaxFreeBlocks.
+  std::vector<std::unique_ptr<InMemoryBlock>> ibs;
+  for (size_t i = 0; i < InMemoryBlockPool::MaxFreeBlocks() + 10; i++) {
+    ibs.push_back(InMemoryBlockPool::Get());
+  }
+  for (auto &b : ibs) {
+    InMemoryBlockPool::Put(std::move(b));
+  }
+  EXPECT_EQ(InMemoryBlockPool::FreeBlocks(), InMemoryBlockPool::MaxFreeBlocks());
+}
+
 auto to_hex_string = [](bytes_const_span b) -> string {
   string hex_str = "";
   for (auto byte : b) {
@@ -198,4 +283,108 @@ TEST(InmemoryBlock, MarshalUnmarshal) {
   }
 }
 
+TEST(InmemoryBlock, MarshalUnmarshalReuseScratch) {
+  std::random_device rd;
+  std::mt19937 gen(rd());
+
+  // the scratch, the storage block and the blocks are reused for all the
+  // iterations, so stale data in any of them breaks the roundtrip.
+  BlockCodecScratch scratch;
+  StorageBlock block;
+  InMemoryBlock b1, b2;
+  bytes first_item, common_prefix;
+  for (size_t i = 0; i < 100; i++) {
+    std::vector<string> items;
+    b1.Reset();
+    first_item.clear();
+    common_prefix.clear();
+    auto prefix = fmt::format("prefix_{}_", i);
+    auto items_count = get_randown_num(gen, 500) + 1;
+    for (size_t j = 0; j < items_count; j++) {
+      auto s = prefix + fmt::format("{:06}", get_randown_num(gen, 100000));
+      if (!b1.Add(to_bytes(s))) {
+        break;
+      }
+      items.push_back(s);
+    }
+    std::sort(items.begin(), items.end());
+
+    auto [items_len, mt] = b1.MarshalUnSortedData(block, first_item,
+                                                  common_prefix, 0, &scratch);
+    b2.UnmarshalData(block, first_item, common_prefix, items_len, mt,
+                     &scratch);
+    ASSERT_EQ(b2.items().size(), items.size());
+    for (size_t j = 0; j < items.size(); j++) {
+      EXPECT_EQ(b2.items()[j].GetString(b2.data()), items[j]);
+    }
+  }
+}
+
+TEST(BlockDecoder, DecodeMarshaledBlock) {
+  std::random_device rd;
+  std::mt19937 gen(rd());
+
+  for (size_t i = 0; i < 1000; i += 10) {
+    std::vector<string> items;
+    StorageBlock block;
+    InMemoryBlock b;
+    bytes first_item, common_prefix;
+
+    auto prefix = string("prefix");
+    auto items_count = get_randown_num(gen, i + 1) + 1;
+    for (size_t j = 0; j < items_count; j++) {
+      // mix incompressible and compressible items, so both plain and
+      // zstd blocks are decoded.
+      auto tmp = i % 20 == 0
+                     ? get_random_bytes(gen)
+                     : to_bytes(fmt::format("{:08}", get_randown_num(gen, j)));
+      bytes data(prefix.begin(), prefix.end());
+      if (j % 3 != 0) {
+        data.insert(data.end(), tmp.begin(), tmp.end());
+      }
+      if (!b.Add(data)) {
+        break;
+      }
+      items.push_back(to_string(data));
+    }
+    std::sort(items.begin(), items.end());
+
+    auto [items_len, mt] =
+        b.MarshalUnSortedData(block, first_item, common_prefix, 0);
+    EXPECT_EQ(items_len, items.size());
+
+    BlockDecoder bd;
+    bd.Init(block, first_item, common_prefix, items_len, mt);
+    EXPECT_EQ(bd.items_count(), items.size());
+
+    // iterate twice to make sure the decoder can be rewound.
+    for (size_t k = 0; k < 2; k++) {
+      size_t idx = 0;
+      for (auto item : bd) {
+        ASSERT_LT(idx, items.size());
+        EXPECT_EQ(StringUtil::ToStringView(item), items[idx]);
+        idx++;
+      }
+      EXPECT_EQ(idx, items.size());
+    }
+
+    // stop early
+    bd.Rewind();
+    EXPECT_TRUE(bd.Next());
+    EXPECT_EQ(bd.ItemString(), items.front());
+
+    // the same block decoded from spans, as for in-memory parts.
+    BlockDecoder span_bd;
+    span_bd.Init(*block.items_data, *block.lens_data, first_item,
+                 common_prefix, items_len, mt);
+    size_t idx = 0;
+    for (auto item : span_bd) {
+      ASSERT_LT(idx, items.size());
+      EXPECT_EQ(StringUtil::ToStringView(item), items[idx]);
+      idx++;
+    }
+    EXPECT_EQ(idx, items.size());
+  }
+}
+
 } // namespace mergekv
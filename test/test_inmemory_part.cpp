@@ -0,0 +1,384 @@
+#include "block_decoder.h"
+#include "block_header.h"
+#include "encoding_util.h"
+#include "file.h"
+#include "filenames.h"
+#include "huge_pages.h"
+#include "inmemory_block.h"
+#include "inmemory_part.h"
+#include "metaindex_row.h"
+#include "part.h"
+#include "part_reader.h"
+#include "string_util.h"
+#include "thread_pool.h"
+#include "types.h"
+#include "gtest/gtest.h"
+#include <algorithm>
+#include <filesystem>
+#include <fmt/core.h>
+#include <memory>
+#include <random>
+#include <vector>
+
+namespace mergekv {
+namespace {
+
+// readPartItems decodes all the items from ip in the order they are stored.
+std::vector<string> readPartItems(InMemoryPart &ip) {
+  std::vector<string> items;
+  bytes metaindex;
+  EncodingUtil::DecompressZSTD(metaindex, *ip.metaindex_data().data());
+  auto &index_data = *ip.index_data().data();
+  auto &items_data = *ip.items_data().data();
+  auto &lens_data = *ip.lens_data().data();
+
+  bytes_const_span mrs_data = metaindex;
+  while (!mrs_data.empty()) {
+    MetaIndexRow mr;
+    mrs_data = mr.Unmarshal(mrs_data);
+    bytes index_block;
+    EncodingUtil::DecompressZSTD(
+        index_block, bytes_const_span(index_data).subspan(
+                         mr.index_block_offset, mr.index_block_size));
+    std::vector<BlockHeader> bhs;
+    BlockHeader::UnmarshalBHs(bhs, index_block, mr.bhs_count);
+    EXPECT_EQ(StringUtil::ToStringView(mr.first_item),
+              StringUtil::ToStringView(bhs.front().first_item));
+    for (auto &bh : bhs) {
+      StorageBlock sb;
+      sb.items_data->assign(items_data.begin() + bh.items_block_offset,
+                            items_data.begin() + bh.items_block_offset +
+                                bh.items_block_size);
+      sb.lens_data->assign(lens_data.begin() + bh.lens_block_offset,
+                           lens_data.begin() + bh.lens_block_offset +
+                               bh.lens_block_size);
+      BlockDecoder bd;
+      bd.Init(sb, bh.first_item, bh.common_prefix, bh.items_count, bh.mt);
+      for (auto item : bd) {
+        items.emplace_back(StringUtil::ToString(item));
+      }
+    }
+  }
+  return items;
+}
+
+std::vector<std::unique_ptr<InMemoryBlock>>
+newRandomBlocks(std::vector<string> &items, size_t blocks_count,
+                uint32_t seed) {
+  std::mt19937 gen(seed);
+  std::uniform_int_distribution<> dis(0, 100000);
+  std::vector<std::unique_ptr<InMemoryBlock>> ibs;
+  for (size_t i = 0; i < blocks_count; i++) {
+    auto ib = std::make_unique<InMemoryBlock>();
+    while (true) {
+      auto item = fmt::format("metric_{}{{job=\"{}\"}}", dis(gen) % 10,
+                              dis(gen));
+      if (!ib->Add(StringUtil::BytesConstSpan(item))) {
+        break;
+      }
+      items.push_back(item);
+    }
+    ibs.push_back(std::move(ib));
+  }
+  return ibs;
+}
+
+// newSortedBlocks packs the sorted items into full blocks.
+std::vector<std::unique_ptr<InMemoryBlock>>
+newSortedBlocks(const std::vector<string> &items) {
+  std::vector<std::unique_ptr<InMemoryBlock>> sorted;
+  sorted.push_back(std::make_unique<InMemoryBlock>());
+  for (auto &item : items) {
+    if (!sorted.back()->Add(StringUtil::BytesConstSpan(item))) {
+      sorted.push_back(std::make_unique<InMemoryBlock>());
+      sorted.back()->Add(StringUtil::BytesConstSpan(item));
+    }
+  }
+  return sorted;
+}
+
+} // namespace
+
+TEST(InMemoryPart, InitFromBlocks) {
+  ThreadPool pool(4);
+  for (size_t blocks_count = 1; blocks_count < 20; blocks_count += 3) {
+    std::vector<string> items;
+    auto ibs = newRandomBlocks(items, blocks_count, blocks_count);
+    std::sort(items.begin(), items.end());
+
+    InMemoryPart ip;
+    ip.InitFromBlocks(ibs, pool);
+    EXPECT_EQ(ip.ph().items_count_, items.size());
+    EXPECT_EQ(StringUtil::ToStringView(ip.ph().first_item_), items.front());
+    EXPECT_EQ(StringUtil::ToStringView(ip.ph().last_item_), items.back());
+
+    auto got = readPartItems(ip);
+    ASSERT_EQ(got.size(), items.size());
+    for (size_t i = 0; i < items.size(); i++) {
+      ASSERT_EQ(got[i], items[i]);
+    }
+  }
+}
+
+TEST(InMemoryPart, InitFromBlocksDeterministic) {
+  std::vector<string> items1, items2;
+  auto ibs1 = newRandomBlocks(items1, 16, 42);
+  auto ibs2 = newRandomBlocks(items2, 16, 42);
+
+  ThreadPool pool1(1), pool2(8);
+  InMemoryPart ip1, ip2;
+  ip1.InitFromBlocks(ibs1, pool1);
+  ip2.InitFromBlocks(ibs2, pool2);
+  EXPECT_EQ(*ip1.items_data().data(), *ip2.items_data().data());
+  EXPECT_EQ(*ip1.lens_data().data(), *ip2.lens_data().data());
+  EXPECT_EQ(*ip1.index_data().data(), *ip2.index_data().data());
+  EXPECT_EQ(*ip1.metaindex_data().data(), *ip2.metaindex_data().data());
+}
+
+TEST(InMemoryPart, HugePages) {
+  // the buffers grow in whole huge pages once they are big enough.
+  ByteBuffer bb;
+  bb.SetHugePages(true);
+  bytes chunk(64 * 1024, 'x');
+  for (size_t i = 0; i < 48; i++) {
+    bb.Write(chunk);
+  }
+  EXPECT_EQ(bb.size(), 48 * chunk.size());
+  if (HugePageUtil::Enabled()) {
+    EXPECT_EQ(bb.data()->capacity() % kHugePageSize, 0);
+  }
+  EXPECT_EQ(HugePageUtil::Advise(bb.data()->data(), 4096), 0);
+
+  // the part doesn't depend on the buffers backing.
+  std::vector<string> items1, items2;
+  auto ibs1 = newRandomBlocks(items1, 40, 5);
+  auto ibs2 = newRandomBlocks(items2, 40, 5);
+  ThreadPool pool(4);
+  PartOptions opts;
+  opts.huge_pages = true;
+  InMemoryPart ip1, ip2(opts);
+  ip1.InitFromBlocks(ibs1, pool);
+  ip2.InitFromBlocks(ibs2, pool);
+  EXPECT_EQ(*ip1.items_data().data(), *ip2.items_data().data());
+  EXPECT_EQ(*ip1.lens_data().data(), *ip2.lens_data().data());
+  EXPECT_EQ(*ip1.index_data().data(), *ip2.index_data().data());
+}
+
+TEST(InMemoryPart, Init) {
+  std::vector<string> items;
+  auto ibs = newRandomBlocks(items, 1, 7);
+  std::sort(items.begin(), items.end());
+
+  InMemoryPart ip;
+  ip.Init(*ibs.front());
+  EXPECT_EQ(ip.ph().blocks_count_, 1);
+  EXPECT_EQ(readPartItems(ip), items);
+}
+
+TEST(InMemoryPart, NewPart) {
+  std::vector<string> items;
+  auto ibs = newRandomBlocks(items, 12, 13);
+  std::sort(items.begin(), items.end());
+
+  ThreadPool pool(4);
+  PartOptions opts;
+  opts.bloom_bits_per_item = kDefaultBloomBitsPerItem;
+  InMemoryPart ip(opts);
+  ip.InitFromBlocks(ibs, pool);
+  auto p = ip.NewPart();
+  ASSERT_TRUE(p->InMemory());
+  EXPECT_TRUE(p->path().empty());
+  EXPECT_EQ(p->ph().items_count_, items.size());
+  auto items_data = ip.items_data().data().get();
+
+  // the part outlives the reuse of ip, which detaches from the shared
+  // buffers.
+  std::vector<string> other;
+  auto other_ibs = newRandomBlocks(other, 3, 17);
+  ip.InitFromBlocks(other_ibs, pool);
+  EXPECT_NE(ip.items_data().data().get(), items_data);
+
+  for (size_t i = 0; i < items.size(); i += 97) {
+    ASSERT_TRUE(p->Contains(StringUtil::BytesConstSpan(items[i]))) << i;
+  }
+  auto missing = string("metric_0{job=\"missing\"}");
+  EXPECT_FALSE(p->Contains(StringUtil::BytesConstSpan(missing)));
+
+  PartReader r(p);
+  std::vector<string> got;
+  while (r.Next()) {
+    got.emplace_back(StringUtil::ToString(r.Item()));
+  }
+  EXPECT_EQ(got, items);
+}
+
+TEST(InMemoryPart, BloomFilter) {
+  std::vector<string> items;
+  auto ibs = newRandomBlocks(items, 8, 11);
+  std::sort(items.begin(), items.end());
+
+  ThreadPool pool(4);
+  PartOptions opts;
+  opts.bloom_bits_per_item = kDefaultBloomBitsPerItem;
+  InMemoryPart ip(opts);
+  ip.InitFromBlocks(ibs, pool);
+  ASSERT_FALSE(ip.bloom().empty());
+  for (auto &item : items) {
+    ASSERT_TRUE(ip.bloom().MayContain(StringUtil::BytesConstSpan(item)));
+  }
+
+  // 10 bits per item gives ~1% false positives; allow some slack.
+  size_t false_positives = 0, n = 10000;
+  for (size_t i = 0; i < n; i++) {
+    auto item = fmt::format("missing_{}", i);
+    false_positives += ip.bloom().MayContain(StringUtil::BytesConstSpan(item));
+  }
+  EXPECT_LT(false_positives, n / 20);
+
+  auto part_path =
+      (std::filesystem::temp_directory_path() / "mergekv_test_bloom_part")
+          .string();
+  std::filesystem::remove_all(part_path);
+  ip.MustStoreToDisk(part_path);
+
+  auto p = Part::MustOpen(part_path);
+  EXPECT_EQ(p->ph().items_count_, items.size());
+  EXPECT_EQ(StringUtil::ToStringView(p->ph().first_item_), items.front());
+  EXPECT_EQ(StringUtil::ToStringView(p->ph().last_item_), items.back());
+  EXPECT_EQ(p->bloom().size_bytes(), ip.bloom().size_bytes());
+  size_t bhs_count = 0;
+  for (size_t i = 0; i < p->metaindex()->size(); i++) {
+    bhs_count += p->metaindex()->BhsCount(i);
+    std::vector<BlockHeader> bhs;
+    p->MustReadIndexBlock(i, bhs);
+    ASSERT_EQ(bhs.size(), p->metaindex()->BhsCount(i));
+    EXPECT_EQ(StringUtil::ToStringView(bhs.front().first_item),
+              StringUtil::ToStringView(p->metaindex()->FirstItem(i)));
+    IndexBlock ib;
+    p->MustReadIndexBlock(i, ib);
+    ASSERT_EQ(ib.size(), bhs.size());
+    EXPECT_EQ(StringUtil::ToStringView(ib.FirstItem(ib.size() - 1)),
+              StringUtil::ToStringView(bhs.back().first_item));
+  }
+  EXPECT_EQ(bhs_count, ip.ph().blocks_count_);
+  for (auto &item : items) {
+    ASSERT_TRUE(p->MayContain(StringUtil::BytesConstSpan(item)));
+  }
+  auto before = string("a");
+  auto after = string("zzz");
+  EXPECT_FALSE(p->MayContain(StringUtil::BytesConstSpan(before)));
+  EXPECT_FALSE(p->MayContain(StringUtil::BytesConstSpan(after)));
+  std::filesystem::remove_all(part_path);
+}
+
+TEST(InMemoryPart, PrefixBloomFilter) {
+  std::vector<string> items;
+  auto ibs = newRandomBlocks(items, 8, 13);
+
+  // the prefix covers the metric name and the first digits of the job.
+  const size_t prefix_len = 16;
+  PartOptions opts;
+  opts.prefix_extractor = PrefixExtractor(prefix_len);
+  opts.flat_metaindex = true;
+  ThreadPool pool(4);
+  InMemoryPart ip(opts);
+  ip.InitFromBlocks(ibs, pool);
+  ASSERT_TRUE(ip.bloom().empty());
+  ASSERT_FALSE(ip.prefix_bloom().empty());
+
+  auto part_path =
+      (std::filesystem::temp_directory_path() / "mergekv_test_prefix_part")
+          .string();
+  std::filesystem::remove_all(part_path);
+  ip.MustStoreToDisk(part_path);
+  EXPECT_TRUE(std::filesystem::exists(
+      std::filesystem::path(part_path) / kFlatMetaindexFilename));
+  auto p = Part::MustOpen(part_path);
+  std::filesystem::remove_all(part_path);
+  EXPECT_EQ(p->prefix_bloom_len(), prefix_len);
+  EXPECT_EQ(StringUtil::ToStringView(p->metaindex()->FirstItem(0)),
+            StringUtil::ToStringView(ip.ph().first_item_));
+
+  for (auto &item : items) {
+    ASSERT_TRUE(p->MayContainPrefix(StringUtil::BytesConstSpan(item)));
+    auto prefix = item.substr(0, prefix_len);
+    ASSERT_TRUE(p->MayContainPrefix(StringUtil::BytesConstSpan(prefix)));
+    // shorter prefixes can't use the filter.
+    auto short_prefix = item.substr(0, 7);
+    ASSERT_TRUE(p->MayContainPrefix(StringUtil::BytesConstSpan(short_prefix)));
+  }
+
+  size_t false_positives = 0, n = 10000;
+  for (size_t i = 0; i < n; i++) {
+    auto prefix = fmt::format("metric_{}{{job=\"x{}", i % 10, i);
+    false_positives += p->MayContainPrefix(StringUtil::BytesConstSpan(prefix));
+  }
+  EXPECT_LT(false_positives, n / 20);
+
+  // prefixes outside of the part range are rejected without the filter.
+  auto before = string("a");
+  auto after = string("metric_9{job=\"A");
+  EXPECT_FALSE(p->MayContainPrefix(StringUtil::BytesConstSpan(before)));
+  EXPECT_FALSE(p->MayContainPrefix(StringUtil::BytesConstSpan(after)));
+}
+
+TEST(InMemoryPart, StreamToDisk) {
+  std::vector<string> items;
+  newRandomBlocks(items, 20, 3);
+  std::sort(items.begin(), items.end());
+
+  PartOptions opts;
+  opts.bloom_bits_per_item = kDefaultBloomBitsPerItem;
+  opts.prefix_extractor = PrefixExtractor(16);
+  ThreadPool pool(4);
+  auto base_path =
+      std::filesystem::temp_directory_path() / "mergekv_test_stream_part";
+  std::filesystem::remove_all(base_path);
+  auto built_path = (base_path / "built").string();
+  auto streamed_path = (base_path / "streamed").string();
+
+  auto sorted = newSortedBlocks(items);
+  ASSERT_GT(sorted.size(), 5);
+  InMemoryPart built(opts);
+  built.InitFromSortedBlocks(sorted, pool);
+  built.MustStoreToDisk(built_path);
+
+  // the streamed part only holds a batch of blocks, but matches the part
+  // built in memory file by file.
+  sorted = newSortedBlocks(items);
+  InMemoryPart streamed(opts);
+  streamed.StartStream(streamed_path, items.size());
+  std::vector<std::unique_ptr<InMemoryBlock>> batch;
+  for (auto &ib : sorted) {
+    batch.push_back(std::move(ib));
+    if (batch.size() == 3) {
+      streamed.AppendSortedBlocks(batch, pool);
+      EXPECT_TRUE(batch.empty());
+      EXPECT_EQ(streamed.items_data().size(), 0);
+    }
+  }
+  streamed.AppendSortedBlocks(batch, pool);
+  streamed.FinishStream();
+  EXPECT_EQ(streamed.ph().items_count_, items.size());
+
+  for (auto &entry : std::filesystem::directory_iterator(built_path)) {
+    auto name = entry.path().filename();
+    bytes want, got;
+    FileUtils::MustReadFile(entry.path().string(), want);
+    FileUtils::MustReadFile(
+        (std::filesystem::path(streamed_path) / name).string(), got);
+    EXPECT_EQ(got, want) << name;
+  }
+
+  auto p = Part::MustOpen(streamed_path);
+  PartReader r(p);
+  std::vector<string> got;
+  while (r.Next()) {
+    got.emplace_back(StringUtil::ToString(r.Item()));
+  }
+  EXPECT_EQ(got, items);
+  p.reset();
+  std::filesystem::remove_all(base_path);
+}
+
+} // namespace mergekv
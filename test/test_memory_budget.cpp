@@ -0,0 +1,254 @@
+#include "exception.h"
+#include "memory.h"
+#include "memory_budget.h"
+#include "memory_pressure.h"
+#include "metrics.h"
+#include "string_util.h"
+#include "table.h"
+#include "types.h"
+#include "gtest/gtest.h"
+#include <chrono>
+#include <fmt/core.h>
+#include <fstream>
+#include <thread>
+
+namespace mergekv {
+
+TEST(MemoryBudget, Limits) {
+  MemoryBudget budget(1000, {0.5, 0.2, 0.2, 0.1});
+  EXPECT_EQ(budget.Limit(MemoryConsumer::kRawItems), 500);
+  EXPECT_EQ(budget.Limit(MemoryConsumer::kMergeBuffers), 100);
+
+  budget.Reserve(MemoryConsumer::kRawItems, 400);
+  EXPECT_FALSE(budget.OverLimit(MemoryConsumer::kRawItems));
+  budget.Reserve(MemoryConsumer::kRawItems, 200);
+  EXPECT_TRUE(budget.OverLimit(MemoryConsumer::kRawItems));
+  // the consumers are accounted separately.
+  EXPECT_FALSE(budget.OverLimit(MemoryConsumer::kInMemoryParts));
+  budget.SetTotal(2000);
+  EXPECT_FALSE(budget.OverLimit(MemoryConsumer::kRawItems));
+  budget.SetTotal(1000);
+  EXPECT_FALSE(budget.WaitForRelease(MemoryConsumer::kRawItems,
+                                     std::chrono::milliseconds(1)));
+
+  std::thread releaser([&budget]() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    budget.Release(MemoryConsumer::kRawItems, 200);
+  });
+  EXPECT_TRUE(budget.WaitForRelease(MemoryConsumer::kRawItems,
+                                    std::chrono::seconds(10)));
+  releaser.join();
+  {
+    MemoryReservation r(budget, MemoryConsumer::kCaches, 300);
+    EXPECT_EQ(budget.Usage(MemoryConsumer::kCaches), 300);
+  }
+  EXPECT_EQ(budget.Usage(MemoryConsumer::kCaches), 0);
+  budget.Release(MemoryConsumer::kRawItems, 400);
+  // over-releases are clamped, since they may come from destructors.
+  EXPECT_NO_THROW(budget.Release(MemoryConsumer::kRawItems, 1));
+  EXPECT_EQ(budget.Usage(MemoryConsumer::kRawItems), 0);
+
+  EXPECT_THROW(MemoryBudget(1000, {0.5, 0.5, 0.5, 0}), InvalidInputException);
+  EXPECT_GT(MemoryBudget::Global().Total(), 0);
+}
+
+TEST(MemoryBudget, TableEarlyFlush) {
+  auto path = (fs::temp_directory_path() / "mergekv_test_budget").string();
+  fs::remove_all(path);
+  // the added items get over their share after a few batches.
+  MemoryBudget budget(4000, {0.5, 0.5, 0, 0});
+  TableOptions opts;
+  opts.memory_budget = &budget;
+  auto tb = Table::MustOpen(path, opts);
+  auto &early_flushes =
+      MetricsRegistry::Global().GetCounter("mergekv_early_flushes_total");
+  auto before = early_flushes.Value();
+
+  std::vector<string> items;
+  for (size_t i = 0; i < 1000; i++) {
+    items.push_back(fmt::format("budget_item_{:04}", i));
+  }
+  for (size_t i = 0; i < items.size(); i += 10) {
+    std::vector<bytes_const_span> batch;
+    for (size_t j = i; j < i + 10; j++) {
+      batch.push_back(StringUtil::BytesConstSpan(items[j]));
+    }
+    tb->AddItems(batch);
+    EXPECT_LE(budget.Usage(MemoryConsumer::kRawItems), 2000 + 1000);
+  }
+  EXPECT_GT(early_flushes.Value(), before);
+  EXPECT_GT(tb->PartsCount(), 1);
+  tb->Flush();
+  EXPECT_EQ(budget.Usage(MemoryConsumer::kRawItems), 0);
+  EXPECT_EQ(budget.Usage(MemoryConsumer::kInMemoryParts), 0);
+
+  ASSERT_TRUE(tb->MergeParts());
+  EXPECT_EQ(budget.Usage(MemoryConsumer::kMergeBuffers), 0);
+  for (size_t i = 0; i < items.size(); i += 37) {
+    EXPECT_TRUE(tb->Contains(StringUtil::BytesConstSpan(items[i]))) << i;
+  }
+  tb.reset();
+  fs::remove_all(path);
+}
+
+TEST(MemoryBudget, TableEarlyFlushShare) {
+  auto big_path = (fs::temp_directory_path() / "mergekv_test_big").string();
+  auto small_path =
+      (fs::temp_directory_path() / "mergekv_test_small").string();
+  fs::remove_all(big_path);
+  fs::remove_all(small_path);
+  MemoryBudget budget(4000, {0.5, 0.5, 0, 0});
+  TableOptions opts;
+  opts.memory_budget = &budget;
+  opts.max_add_stall = std::chrono::milliseconds(1);
+  auto big = Table::MustOpen(big_path, opts);
+  auto small = Table::MustOpen(small_path, opts);
+
+  // the big table alone gets the added items over their limit.
+  std::vector<string> items;
+  for (size_t i = 0; i < 100; i++) {
+    items.push_back(fmt::format("big_item_{:04}", i));
+  }
+  std::vector<bytes_const_span> batch;
+  for (auto &item : items) {
+    batch.push_back(StringUtil::BytesConstSpan(item));
+  }
+  big->AddItems(batch);
+  ASSERT_TRUE(budget.OverLimit(MemoryConsumer::kRawItems));
+
+  // the small table stalls instead of flushing its few items into parts.
+  auto &add_stalls =
+      MetricsRegistry::Global().GetCounter("mergekv_add_stalls_total");
+  auto stalls = add_stalls.Value();
+  for (size_t i = 0; i < 10; i++) {
+    auto item = fmt::format("small_item_{}", i);
+    small->AddItems({StringUtil::BytesConstSpan(item)});
+  }
+  EXPECT_EQ(small->PartsCount(), 0);
+  EXPECT_EQ(add_stalls.Value(), stalls + 10);
+
+  // the big table flushes early on its next call.
+  auto item = string("big_item_last");
+  big->AddItems({StringUtil::BytesConstSpan(item)});
+  EXPECT_EQ(big->PartsCount(), 1);
+  EXPECT_FALSE(budget.OverLimit(MemoryConsumer::kRawItems));
+  big.reset();
+  small.reset();
+  fs::remove_all(big_path);
+  fs::remove_all(small_path);
+}
+
+TEST(MemoryPressure, CgroupFiles) {
+  EXPECT_EQ(MemoryPressureMonitor::ParseAvg10(
+                "some avg10=12.50 avg60=1.00 avg300=0.10 total=123\n"
+                "full avg10=3.00 avg60=0.00 avg300=0.00 total=45\n"),
+            12.5);
+  EXPECT_EQ(MemoryPressureMonitor::ParseAvg10("full avg10=3.00\n"), -1);
+
+  auto dir = (fs::temp_directory_path() / "mergekv_test_cgroup").string();
+  fs::remove_all(dir);
+  fs::create_directories(dir);
+  EXPECT_EQ(CgroupUtil::ReadMemoryLimitV2(dir), 0);
+  std::ofstream(dir + "/memory.max") << "max\n";
+  EXPECT_EQ(CgroupUtil::ReadMemoryLimitV2(dir), 0);
+  std::ofstream(dir + "/memory.high") << "1073741824\n";
+  EXPECT_EQ(CgroupUtil::ReadMemoryLimitV2(dir), int64_t(1) << 30);
+  // the limits above 2GiB don't overflow.
+  std::ofstream(dir + "/memory.max") << "8589934592\n";
+  std::ofstream(dir + "/memory.high") << "max\n";
+  EXPECT_EQ(CgroupUtil::ReadMemoryLimitV2(dir), int64_t(8) << 30);
+  EXPECT_GT(CgroupUtil::Refresh(), 0);
+  fs::remove_all(dir);
+}
+
+TEST(MemoryPressure, ShrinkAndFlush) {
+  auto dir = (fs::temp_directory_path() / "mergekv_test_pressure").string();
+  auto path = (fs::temp_directory_path() / "mergekv_test_pressure_tb").string();
+  fs::remove_all(dir);
+  fs::remove_all(path);
+  fs::create_directories(dir);
+  std::ofstream(dir + "/memory.pressure")
+      << "some avg10=50.00 avg60=10.00 avg300=1.00 total=1000\n";
+
+  MemoryBudget budget(CgroupUtil::AllowedMemory());
+  MemoryPressureMonitor::Options mopts;
+  mopts.hold = std::chrono::milliseconds(0);
+  // not started, so the test drives the checks.
+  MemoryPressureMonitor monitor(budget, dir, mopts);
+  TableOptions opts;
+  opts.memory_budget = &budget;
+  opts.pressure_monitor = &monitor;
+  auto tb = Table::MustOpen(path, opts);
+  string item = "pressure_item";
+  tb->AddItems({StringUtil::BytesConstSpan(item)});
+
+  auto limit = budget.Limit(MemoryConsumer::kCaches);
+  monitor.Check(false);
+  EXPECT_TRUE(monitor.UnderPressure());
+  EXPECT_LT(budget.Limit(MemoryConsumer::kCaches), limit);
+  // the pressure flushes the added items.
+  EXPECT_EQ(tb->PartsCount(), 1);
+  EXPECT_TRUE(tb->Contains(StringUtil::BytesConstSpan(item)));
+
+  std::ofstream(dir + "/memory.pressure")
+      << "some avg10=0.00 avg60=0.00 avg300=0.00 total=1000\n";
+  monitor.Check(false);
+  EXPECT_FALSE(monitor.UnderPressure());
+  EXPECT_EQ(budget.Limit(MemoryConsumer::kCaches), limit);
+  tb.reset();
+  fs::remove_all(path);
+  fs::remove_all(dir);
+}
+
+TEST(MemoryPressure, StoreIdleInMemoryParts) {
+  auto path = (fs::temp_directory_path() / "mergekv_test_idle_tb").string();
+  fs::remove_all(path);
+  auto partDirs = [&path]() {
+    size_t dirs = 0;
+    for (auto &entry : fs::directory_iterator(path)) {
+      dirs += entry.is_directory();
+    }
+    return dirs;
+  };
+
+  MemoryBudget budget(int64_t(1) << 30);
+  // not started and without a cgroup, so the checks are plain ticks.
+  MemoryPressureMonitor monitor(budget, "");
+  TableOptions opts;
+  opts.memory_budget = &budget;
+  opts.pressure_monitor = &monitor;
+  opts.max_inmemory_part_bytes = 1 << 20;
+  opts.max_inmemory_part_age = std::chrono::milliseconds(50);
+  auto tb = Table::MustOpen(path, opts);
+  string item = "idle_item";
+  tb->AddItems({StringUtil::BytesConstSpan(item)});
+  ASSERT_TRUE(tb->Flush());
+  EXPECT_EQ(tb->Stats().inmemory_parts, 1);
+  monitor.Check(false);
+  EXPECT_EQ(tb->Stats().inmemory_parts, 1);
+
+  // no more items are added, but the refresh stores the aged part.
+  std::this_thread::sleep_for(std::chrono::milliseconds(60));
+  monitor.Check(false);
+  EXPECT_EQ(tb->Stats().inmemory_parts, 0);
+  EXPECT_EQ(partDirs(), 1);
+  EXPECT_EQ(budget.Usage(MemoryConsumer::kInMemoryParts), 0);
+  EXPECT_TRUE(tb->Contains(StringUtil::BytesConstSpan(item)));
+
+  // the tables destroyed without MustClose report the dropped parts.
+  auto &dropped = MetricsRegistry::Global().GetCounter(
+      "mergekv_inmemory_parts_dropped_total");
+  auto before = dropped.Value();
+  opts.max_inmemory_part_age = std::chrono::hours(1);
+  tb.reset();
+  tb = Table::MustOpen(path, opts);
+  string dropped_item = "dropped_item";
+  tb->AddItems({StringUtil::BytesConstSpan(dropped_item)});
+  ASSERT_TRUE(tb->Flush());
+  tb.reset();
+  EXPECT_EQ(dropped.Value(), before + 1);
+  EXPECT_EQ(budget.Usage(MemoryConsumer::kInMemoryParts), 0);
+  fs::remove_all(path);
+}
+
+} // namespace mergekv
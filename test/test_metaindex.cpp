@@ -0,0 +1,106 @@
+#include "encoding_util.h"
+#include "exception.h"
+#include "io.h"
+#include "metaindex.h"
+#include "metaindex_row.h"
+#include "string_util.h"
+#include "types.h"
+#include "gtest/gtest.h"
+#include <fmt/core.h>
+#include <vector>
+
+namespace mergekv {
+namespace {
+
+bytes marshalRows(std::vector<MetaIndexRow> &mrs) {
+  bytes data, compressed;
+  for (auto &mr : mrs) {
+    mr.Marshal(data);
+  }
+  EncodingUtil::CompressZSTDLevel(compressed, data, 1);
+  return compressed;
+}
+
+std::vector<MetaIndexRow> newRows(size_t n) {
+  std::vector<MetaIndexRow> mrs(n);
+  for (size_t i = 0; i < n; i++) {
+    auto fi = fmt::format("item_{:06}", i * 10);
+    mrs[i].first_item = StringUtil::Bytes(fi);
+    mrs[i].bhs_count = uint32_t(i + 1);
+    mrs[i].index_block_offset = i * 1000;
+    mrs[i].index_block_size = uint32_t(100 + i);
+  }
+  return mrs;
+}
+
+} // namespace
+
+TEST(MetaIndex, FromCompressed) {
+  auto mrs = newRows(100);
+  auto mi = MetaIndex::FromCompressed(marshalRows(mrs));
+  ASSERT_EQ(mi->size(), mrs.size());
+  for (size_t i = 0; i < mrs.size(); i++) {
+    EXPECT_EQ(StringUtil::ToStringView(mi->FirstItem(i)),
+              StringUtil::ToStringView(mrs[i].first_item));
+    EXPECT_EQ(mi->BhsCount(i), mrs[i].bhs_count);
+    EXPECT_EQ(mi->IndexBlockOffset(i), mrs[i].index_block_offset);
+    EXPECT_EQ(mi->IndexBlockSize(i), mrs[i].index_block_size);
+  }
+
+  // the flat buffer is loaded as is.
+  auto flat = bytes(mi->data().begin(), mi->data().end());
+  auto mi2 = MetaIndex::FromFlat(std::move(flat));
+  ASSERT_EQ(mi2->size(), mi->size());
+  auto mr = mi2->Row(42);
+  EXPECT_EQ(StringUtil::ToStringView(mr.first_item), "item_000420");
+  EXPECT_EQ(mr.bhs_count, 43);
+}
+
+TEST(MetaIndex, Stream) {
+  // enough rows for several stream chunks.
+  auto mrs = newRows(20000);
+  auto compressed = marshalRows(mrs);
+
+  BytesReader r(compressed);
+  auto mi = MetaIndex::FromReader(r);
+  ASSERT_EQ(mi->size(), mrs.size());
+  EXPECT_EQ(StringUtil::ToStringView(mi->FirstItem(12345)),
+            StringUtil::ToStringView(mrs[12345].first_item));
+
+  BytesReader r2(compressed);
+  std::vector<MetaIndexRow> got;
+  MetaIndexRow::UnmarshalMIRows(got, r2);
+  ASSERT_EQ(got.size(), mrs.size());
+  for (size_t i = 0; i < got.size(); i++) {
+    ASSERT_EQ(got[i].first_item, mrs[i].first_item);
+    ASSERT_EQ(got[i].index_block_offset, mrs[i].index_block_offset);
+  }
+}
+
+TEST(MetaIndex, Search) {
+  auto mrs = newRows(50);
+  auto mi = MetaIndex::FromCompressed(marshalRows(mrs));
+  auto search = [&](const string &s) {
+    return mi->Search(StringUtil::BytesConstSpan(s));
+  };
+  EXPECT_EQ(search("a"), mi->size());
+  EXPECT_EQ(search("item_000000"), 0);
+  EXPECT_EQ(search("item_000005"), 0);
+  EXPECT_EQ(search("item_000010"), 1);
+  EXPECT_EQ(search("item_000255"), 25);
+  EXPECT_EQ(search("z"), 49);
+}
+
+TEST(MetaIndex, Invalid) {
+  auto mrs = newRows(10);
+  auto mi = MetaIndex::FromCompressed(marshalRows(mrs));
+  auto flat = bytes(mi->data().begin(), mi->data().end());
+  flat.pop_back();
+  EXPECT_THROW(MetaIndex::FromFlat(std::move(flat)), InvalidInputException);
+
+  mrs[3].first_item.swap(mrs[4].first_item);
+  EXPECT_THROW(MetaIndex::FromCompressed(marshalRows(mrs)),
+               InvalidInputException);
+}
+
+} // namespace mergekv
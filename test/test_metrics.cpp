@@ -0,0 +1,124 @@
+#include "exception.h"
+#include "metrics.h"
+#include "types.h"
+#include "gtest/gtest.h"
+#include <thread>
+#include <vector>
+
+namespace mergekv {
+
+TEST(Metrics, HistogramBuckets) {
+  // every value falls into the bucket below its upper bound.
+  for (uint64_t v : {0ULL, 1ULL, 7ULL, 8ULL, 9ULL, 15ULL, 16ULL, 17ULL, 100ULL,
+                     1000ULL, 123456789ULL, 1ULL << 40}) {
+    auto i = Histogram::BucketIndex(v);
+    ASSERT_LT(i, Histogram::kBuckets);
+    EXPECT_LT(v, Histogram::BucketUpperBound(i)) << v;
+    if (i > 0) {
+      EXPECT_GE(v, Histogram::BucketUpperBound(i - 1)) << v;
+    }
+  }
+  EXPECT_EQ(Histogram::BucketIndex(~uint64_t(0)), Histogram::kBuckets - 1);
+  for (size_t i = 1; i < Histogram::kBuckets; i++) {
+    ASSERT_GT(Histogram::BucketUpperBound(i),
+              Histogram::BucketUpperBound(i - 1));
+  }
+}
+
+TEST(Metrics, HistogramQuantile) {
+  Histogram h;
+  for (uint64_t v = 1; v <= 1000; v++) {
+    h.Update(v);
+  }
+  auto snap = h.Snapshot();
+  EXPECT_EQ(snap.count, 1000);
+  EXPECT_EQ(snap.sum, 500500);
+  // the buckets are within 1/8 of the values.
+  auto p50 = snap.Quantile(0.5);
+  EXPECT_GE(p50, 500);
+  EXPECT_LE(p50, 500 + 500 / 8 + 1);
+  auto p99 = snap.Quantile(0.99);
+  EXPECT_GE(p99, 990);
+  EXPECT_LE(p99, 990 + 990 / 8 + 1);
+  EXPECT_EQ(HistogramSnapshot().Quantile(0.5), 0);
+}
+
+TEST(Metrics, ConcurrentUpdates) {
+  Counter c;
+  Histogram h;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 8; t++) {
+    threads.emplace_back([&]() {
+      for (int i = 0; i < 10000; i++) {
+        c.Add();
+        h.Update(i);
+      }
+    });
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+  EXPECT_EQ(c.Value(), 80000);
+  EXPECT_EQ(h.Snapshot().count, 80000);
+}
+
+TEST(Metrics, WritePrometheus) {
+  MetricsRegistry r;
+  r.GetCounter("test_requests_total{op=\"a\"}", "requests").Add(3);
+  r.GetCounter("test_requests_total{op=\"b\"}").Add(4);
+  r.GetCounter("test_requests_errors_total").Add(1);
+  r.GetGauge("test_parts", "parts").Set(-2);
+  auto &h = r.GetHistogram("test_duration_seconds{op=\"x\"}", "durations");
+  h.Update(1000);
+  h.Update(3000);
+  EXPECT_EQ(&r.GetCounter("test_requests_total{op=\"a\"}"),
+            &r.GetCounter("test_requests_total{op=\"a\"}"));
+  EXPECT_THROW(r.GetGauge("test_requests_errors_total"), FatalException);
+  EXPECT_EQ(&r.GetHistogram("test_duration_seconds{op=\"x\"}"), &h);
+  EXPECT_THROW(r.GetHistogram("test_duration_seconds{op=\"x\"}", "", 1),
+               FatalException);
+  r.GetHistogram("test_duration_seconds{op=\"y\"}");
+
+  string out;
+  r.WritePrometheus(out);
+  auto contains = [&out](const string &s) {
+    return out.find(s) != string::npos;
+  };
+  EXPECT_TRUE(contains("# HELP test_requests_total requests\n"
+                       "# TYPE test_requests_total counter\n"
+                       "test_requests_total{op=\"a\"} 3\n"
+                       "test_requests_total{op=\"b\"} 4\n"));
+  EXPECT_TRUE(contains("# TYPE test_requests_errors_total counter\n"
+                       "test_requests_errors_total 1\n"));
+  EXPECT_TRUE(contains("# TYPE test_parts gauge\ntest_parts -2\n"));
+  EXPECT_TRUE(contains("# TYPE test_duration_seconds histogram\n"));
+  EXPECT_TRUE(
+      contains("test_duration_seconds_bucket{op=\"x\",le=\"+Inf\"} 2\n"));
+  EXPECT_TRUE(contains(
+      "test_duration_seconds_bucket{op=\"x\",le=\"5.12e-07\"} 0\n"));
+  EXPECT_TRUE(contains(
+      "test_duration_seconds_bucket{op=\"x\",le=\"1.024e-06\"} 1\n"));
+  EXPECT_TRUE(contains(
+      "test_duration_seconds_bucket{op=\"x\",le=\"4.096e-06\"} 2\n"));
+  // the empty histograms have the same le series.
+  auto countOf = [&out](const string &s) {
+    size_t n = 0;
+    for (auto pos = out.find(s); pos != string::npos;
+         pos = out.find(s, pos + 1)) {
+      n++;
+    }
+    return n;
+  };
+  EXPECT_EQ(countOf("test_duration_seconds_bucket{op=\"x\""),
+            Histogram::kMaxBits + 1);
+  EXPECT_EQ(countOf("test_duration_seconds_bucket{op=\"y\""),
+            Histogram::kMaxBits + 1);
+  EXPECT_TRUE(contains("test_duration_seconds_sum{op=\"x\"} 4e-06\n"));
+  EXPECT_TRUE(contains("test_duration_seconds_count{op=\"x\"} 2\n"));
+
+  string from_callback;
+  r.WritePrometheus([&](string_view s) { from_callback = s; });
+  EXPECT_EQ(from_callback, out);
+}
+
+} // namespace mergekv
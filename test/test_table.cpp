@@ -0,0 +1,320 @@
+#include "exception.h"
+#include "filenames.h"
+#include "inmemory_block.h"
+#include "inmemory_part.h"
+#include "metrics.h"
+#include "string_util.h"
+#include "table.h"
+#include "types.h"
+#include "gtest/gtest.h"
+#include <filesystem>
+#include <fmt/core.h>
+#include <fstream>
+
+namespace mergekv {
+namespace {
+
+// createTableParts stores parts_count single block parts under path. The
+// items of the part i start with "part_{i}".
+void createTableParts(const string &path, size_t parts_count) {
+  for (size_t i = 0; i < parts_count; i++) {
+    InMemoryBlock ib;
+    for (size_t j = 0; j < 100; j++) {
+      auto item = fmt::format("part_{}_item_{:04}", i, j);
+      ASSERT_TRUE(ib.Add(StringUtil::BytesConstSpan(item)));
+    }
+    InMemoryPart ip;
+    ip.Init(ib);
+    ip.MustStoreToDisk((fs::path(path) / fmt::format("{:016X}", i)).string());
+  }
+}
+
+} // namespace
+
+TEST(Table, MustOpen) {
+  auto path = (fs::temp_directory_path() / "mergekv_test_table").string();
+  fs::remove_all(path);
+  createTableParts(path, 10);
+
+  TableOptions opts;
+  opts.open_concurrency = 4;
+  opts.open_io_concurrency = 2;
+  auto tb = Table::MustOpen(path, opts);
+  EXPECT_EQ(tb->PartsCount(), 10);
+  EXPECT_EQ(tb->OpenStats().parts.load(), 10);
+  EXPECT_GT(tb->OpenStats().bytes_read.load(), 0);
+
+  auto prefix = string("part_3_");
+  auto parts = tb->PartsForPrefix(StringUtil::BytesConstSpan(prefix));
+  ASSERT_EQ(parts.size(), 1);
+  EXPECT_EQ(fs::path(parts[0]->path()).filename(), "0000000000000003");
+
+  // parts.json limits the opened parts.
+  {
+    std::ofstream f(fs::path(path) / kPartsFilename);
+    f << R"(["0000000000000001", "0000000000000005"])";
+  }
+  // the directories missing from parts.json, e.g. the leftovers of a
+  // crashed flush, are removed, and new parts never reuse their names.
+  auto orphan = fs::path(path) / "000000000000000C";
+  fs::create_directories(orphan);
+  std::ofstream(orphan / kBloomFilterFilename) << "stale";
+  tb = Table::MustOpen(path, opts);
+  EXPECT_EQ(tb->PartsCount(), 2);
+  EXPECT_FALSE(fs::exists(orphan));
+  EXPECT_FALSE(fs::exists(fs::path(path) / "0000000000000003"));
+  EXPECT_TRUE(fs::exists(fs::path(path) / "0000000000000005"));
+  auto item = string("part_new_item");
+  tb->AddItems({StringUtil::BytesConstSpan(item)});
+  ASSERT_TRUE(tb->Flush());
+  EXPECT_TRUE(fs::exists(fs::path(path) / "000000000000000D"));
+  EXPECT_TRUE(tb->Contains(StringUtil::BytesConstSpan(item)));
+  tb.reset();
+  fs::remove_all(path);
+}
+
+TEST(Table, AddFlushMerge) {
+  auto path = (fs::temp_directory_path() / "mergekv_test_table_add").string();
+  fs::remove_all(path);
+  std::vector<string> items;
+  {
+    auto tb = Table::MustOpen(path);
+    for (size_t flush = 0; flush < 3; flush++) {
+      std::vector<string> batch;
+      for (size_t i = 0; i < 5000; i++) {
+        batch.push_back(fmt::format("item_{:06}", i * 3 + flush));
+      }
+      std::vector<bytes_const_span> spans;
+      for (auto &item : batch) {
+        spans.push_back(StringUtil::BytesConstSpan(item));
+      }
+      tb->AddItems(spans);
+      auto missing = batch.front();
+      EXPECT_FALSE(tb->Contains(StringUtil::BytesConstSpan(missing)));
+      ASSERT_TRUE(tb->Flush());
+      items.insert(items.end(), batch.begin(), batch.end());
+    }
+    EXPECT_FALSE(tb->Flush());
+    ASSERT_EQ(tb->PartsCount(), 3);
+
+    auto before = tb->Stats();
+    EXPECT_EQ(before.parts, 3);
+    EXPECT_EQ(before.items_count, items.size());
+    EXPECT_EQ(before.encoding.blocks(), before.blocks_count);
+    EXPECT_GT(before.encoding.CompressionRatio(), 1);
+
+    ASSERT_TRUE(tb->MergeParts());
+    ASSERT_EQ(tb->PartsCount(), 1);
+    auto after = tb->Stats();
+    EXPECT_EQ(after.items_count, before.items_count);
+    EXPECT_EQ(after.encoding.raw_bytes, before.encoding.raw_bytes);
+    EXPECT_FALSE(tb->MergeParts());
+    // every lookup reads the part files, so check a sample.
+    for (size_t i = 0; i < items.size(); i += 97) {
+      ASSERT_TRUE(tb->Contains(StringUtil::BytesConstSpan(items[i])));
+    }
+    auto missing = string("item_9");
+    EXPECT_FALSE(tb->Contains(StringUtil::BytesConstSpan(missing)));
+  }
+
+  // the merged source parts are gone and parts.json lists the merged part.
+  size_t dirs = 0;
+  for (auto &entry : fs::directory_iterator(path)) {
+    dirs += entry.is_directory();
+  }
+  EXPECT_EQ(dirs, 1);
+  auto tb = Table::MustOpen(path);
+  ASSERT_EQ(tb->PartsCount(), 1);
+  for (size_t i = 0; i < items.size(); i += 89) {
+    ASSERT_TRUE(tb->Contains(StringUtil::BytesConstSpan(items[i])));
+  }
+  fs::remove_all(path);
+}
+
+TEST(Table, InMemoryParts) {
+  auto path = (fs::temp_directory_path() / "mergekv_test_inmemory").string();
+  fs::remove_all(path);
+  auto partDirs = [&path]() {
+    size_t dirs = 0;
+    for (auto &entry : fs::directory_iterator(path)) {
+      dirs += entry.is_directory();
+    }
+    return dirs;
+  };
+  MemoryBudget budget(int64_t(1) << 30);
+  TableOptions opts;
+  opts.memory_budget = &budget;
+  opts.max_inmemory_part_bytes = 1 << 20;
+  opts.max_inmemory_part_age = std::chrono::hours(1);
+  std::vector<string> items;
+  {
+    auto tb = Table::MustOpen(path, opts);
+    auto addAndFlush = [&](size_t n) {
+      auto item = fmt::format("inmemory_item_{:03}", n);
+      tb->AddItems({StringUtil::BytesConstSpan(item)});
+      ASSERT_TRUE(tb->Flush());
+      items.push_back(item);
+    };
+    for (size_t i = 0; i < 3; i++) {
+      addAndFlush(i);
+    }
+    // the flushed parts are searchable without being stored.
+    EXPECT_EQ(tb->Stats().inmemory_parts, 3);
+    EXPECT_EQ(partDirs(), 0);
+    EXPECT_GT(budget.Usage(MemoryConsumer::kInMemoryParts), 0);
+    for (auto &item : items) {
+      EXPECT_TRUE(tb->Contains(StringUtil::BytesConstSpan(item)));
+    }
+
+    // merges store them.
+    ASSERT_TRUE(tb->MergeParts());
+    EXPECT_EQ(tb->Stats().inmemory_parts, 0);
+    EXPECT_EQ(budget.Usage(MemoryConsumer::kInMemoryParts), 0);
+    EXPECT_EQ(partDirs(), 1);
+
+    // closing the table stores the in-memory parts and the added items.
+    addAndFlush(3);
+    EXPECT_EQ(tb->Stats().inmemory_parts, 1);
+    auto pending = string("inmemory_item_pending");
+    tb->AddItems({StringUtil::BytesConstSpan(pending)});
+    items.push_back(pending);
+    tb->MustClose();
+    EXPECT_EQ(tb->Stats().inmemory_parts, 0);
+    EXPECT_EQ(budget.Usage(MemoryConsumer::kRawItems), 0);
+  }
+  EXPECT_EQ(partDirs(), 3);
+  EXPECT_EQ(budget.Usage(MemoryConsumer::kInMemoryParts), 0);
+
+  // the old parts are stored on the next flush.
+  opts.max_inmemory_part_age = std::chrono::milliseconds(0);
+  auto tb = Table::MustOpen(path, opts);
+  ASSERT_EQ(tb->PartsCount(), 3);
+  auto old_item = string("inmemory_item_old");
+  tb->AddItems({StringUtil::BytesConstSpan(old_item)});
+  ASSERT_TRUE(tb->Flush());
+  EXPECT_EQ(tb->Stats().inmemory_parts, 0);
+  EXPECT_EQ(partDirs(), 4);
+  for (auto &item : items) {
+    EXPECT_TRUE(tb->Contains(StringUtil::BytesConstSpan(item)));
+  }
+  tb.reset();
+  fs::remove_all(path);
+}
+
+TEST(Table, CompressLevelPolicy) {
+  CompressLevelPolicy policy(-3, {{0, 1}, {1000, 4}, {100000, 9}});
+  EXPECT_EQ(policy.FlushLevel(), -3);
+  EXPECT_EQ(policy.MergeLevel(0), 1);
+  EXPECT_EQ(policy.MergeLevel(999), 1);
+  EXPECT_EQ(policy.MergeLevel(1000), 4);
+  EXPECT_EQ(policy.MergeLevel(uint64_t(1) << 40), 9);
+  EXPECT_EQ(CompressLevelPolicy(-2, {}).MergeLevel(1 << 20), -2);
+
+  // the merged part is compressed with the merge level.
+  auto path = (fs::temp_directory_path() / "mergekv_test_levels").string();
+  fs::remove_all(path);
+  TableOptions opts;
+  opts.compress_policy = CompressLevelPolicy(-4, {{0, 11}});
+  auto tb = Table::MustOpen(path, opts);
+  auto &merge_cpu = MetricsRegistry::Global().GetHistogram(
+      "mergekv_zstd_compress_cpu_seconds{level=\"11\"}");
+  auto merges_before = merge_cpu.Snapshot().count;
+  for (size_t i = 0; i < 2; i++) {
+    auto item = fmt::format("level_item_{}", i);
+    tb->AddItems({StringUtil::BytesConstSpan(item)});
+    ASSERT_TRUE(tb->Flush());
+  }
+  EXPECT_EQ(merge_cpu.Snapshot().count, merges_before);
+  ASSERT_TRUE(tb->MergeParts());
+  EXPECT_GT(merge_cpu.Snapshot().count, merges_before);
+  tb.reset();
+  fs::remove_all(path);
+}
+
+TEST(PartHeader, MustReadMetadataBatch) {
+  auto path = (fs::temp_directory_path() / "mergekv_test_metadata").string();
+  fs::remove_all(path);
+  createTableParts(path, 5);
+
+  std::vector<string> part_paths;
+  for (size_t i = 0; i < 5; i++) {
+    part_paths.push_back((fs::path(path) / fmt::format("{:016X}", i)).string());
+  }
+  // read twice, so the second pass reuses the parser buffers.
+  for (int pass = 0; pass < 2; pass++) {
+    auto phs = PartHeader::MustReadMetadataBatch(part_paths);
+    ASSERT_EQ(phs.size(), 5);
+    for (size_t i = 0; i < phs.size(); i++) {
+      EXPECT_EQ(phs[i].items_count_, 100);
+      EXPECT_EQ(phs[i].blocks_count_, 1);
+      EXPECT_EQ(StringUtil::ToStringView(phs[i].first_item_),
+                fmt::format("part_{}_item_0000", i));
+      EXPECT_EQ(StringUtil::ToStringView(phs[i].last_item_),
+                fmt::format("part_{}_item_0099", i));
+    }
+  }
+  fs::remove_all(path);
+}
+
+TEST(PartHeader, MarshalUnmarshal) {
+  PartHeader ph;
+  ph.items_count_ = 123;
+  ph.blocks_count_ = 4;
+  ph.first_item_ = StringUtil::Bytes(string("first\0item", 10));
+  ph.last_item_ = StringUtil::Bytes("last_item");
+  ph.stats_.raw_bytes = 1000;
+  ph.stats_.items_bytes = 300;
+  ph.stats_.lens_bytes = 20;
+  ph.stats_.plain_blocks = 1;
+  ph.stats_.zstd_blocks = 3;
+  ph.stats_.common_prefix_bytes = 40;
+  bytes buf;
+  ph.Marshal(buf);
+
+  PartHeader ph2;
+  ph2.Unmarshal(buf);
+  EXPECT_EQ(ph2.items_count_, ph.items_count_);
+  EXPECT_EQ(ph2.blocks_count_, ph.blocks_count_);
+  EXPECT_EQ(ph2.first_item_, ph.first_item_);
+  EXPECT_EQ(ph2.last_item_, ph.last_item_);
+  EXPECT_EQ(ph2.stats_.raw_bytes, 1000);
+  EXPECT_EQ(ph2.stats_.items_bytes, 300);
+  EXPECT_EQ(ph2.stats_.lens_bytes, 20);
+  EXPECT_EQ(ph2.stats_.plain_blocks, 1);
+  EXPECT_EQ(ph2.stats_.zstd_blocks, 3);
+  EXPECT_EQ(ph2.stats_.common_prefix_bytes, 40);
+  EXPECT_DOUBLE_EQ(ph2.stats_.AvgCommonPrefixLen(), 10);
+
+  for (size_t i = 0; i < buf.size(); i++) {
+    auto corrupted = buf;
+    corrupted[i] ^= 1;
+    EXPECT_THROW(ph2.Unmarshal(corrupted), InvalidInputException);
+  }
+}
+
+TEST(PartHeader, FallbackToJSON) {
+  auto path = (fs::temp_directory_path() / "mergekv_test_json").string();
+  fs::remove_all(path);
+  createTableParts(path, 1);
+  auto part_path = (fs::path(path) / fmt::format("{:016X}", 0)).string();
+  PartHeader binary_ph;
+  binary_ph.MustReadMetadata(part_path);
+
+  fs::remove(fs::path(part_path) / kPartHeaderFilename);
+  PartHeader json_ph;
+  json_ph.MustReadMetadata(part_path);
+  EXPECT_EQ(json_ph.items_count_, binary_ph.items_count_);
+  EXPECT_EQ(json_ph.blocks_count_, binary_ph.blocks_count_);
+  EXPECT_EQ(json_ph.first_item_, binary_ph.first_item_);
+  EXPECT_EQ(json_ph.last_item_, binary_ph.last_item_);
+  EXPECT_GT(binary_ph.stats_.raw_bytes, 0);
+  EXPECT_EQ(json_ph.stats_.raw_bytes, binary_ph.stats_.raw_bytes);
+  EXPECT_EQ(json_ph.stats_.items_bytes, binary_ph.stats_.items_bytes);
+  EXPECT_EQ(json_ph.stats_.lens_bytes, binary_ph.stats_.lens_bytes);
+  EXPECT_EQ(json_ph.stats_.blocks(), binary_ph.stats_.blocks());
+  EXPECT_EQ(json_ph.stats_.common_prefix_bytes,
+            binary_ph.stats_.common_prefix_bytes);
+  fs::remove_all(path);
+}
+
+} // namespace mergekv
@@ -1,4 +1,6 @@
 #include "encoding_util.h"
+#include "exception.h"
+#include "io.h"
 #include "types.h"
 #include <fmt/core.h>
 #include <fmt/format.h>
@@ -89,4 +91,40 @@ TEST(TestCompressDecompress, multi_frames) {
   EXPECT_EQ(plain_data, src);
 }
 
+TEST(ZstdReader, StreamFromReader) {
+  fmt::memory_buffer bb;
+  while (bb.size() < 1024 * 1024) {
+    fmt::format_to(std::back_inserter(bb), "streamed zstd data {}, ",
+                   bb.size() * 7919 % 100003);
+  }
+  auto src = bytes(bb.begin(), bb.end());
+  // two frames in a row must be read as a single stream.
+  bytes cd;
+  EncodingUtil::CompressZSTDLevel(cd, bytes_const_span(src).first(1000), 3);
+  EncodingUtil::CompressZSTDLevel(cd, bytes_const_span(src).subspan(1000), 3);
+
+  BytesReader br(cd);
+  ZstdReader zr(br);
+  bytes got, chunk;
+  while (true) {
+    chunk.resize(777);
+    auto [n, eof] = zr.Read(chunk);
+    got.insert(got.end(), chunk.begin(), chunk.end());
+    if (eof) {
+      break;
+    }
+  }
+  EXPECT_EQ(got, src);
+
+  bytes all;
+  ZstdReader(bytes_const_span(cd)).WriteTo(all);
+  EXPECT_EQ(all, src);
+
+  // a truncated stream is an error rather than a silent eof.
+  bytes truncated(cd.begin(), cd.end() - 10);
+  bytes dst;
+  EXPECT_THROW(ZstdReader(bytes_const_span(truncated)).WriteTo(dst),
+               InvalidInputException);
+}
+
 } // namespace mergekv
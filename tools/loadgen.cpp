@@ -0,0 +1,378 @@
+// mergekv_loadgen drives a table with concurrent writers and readers for a
+// fixed duration and reports the throughput and the latency percentiles of
+// every operation as JSON.
+//
+// Usage:
+//   mergekv_loadgen --path=/tmp/loadgen --writers=4 --readers=4
+//                   --duration_s=30 --distribution=metric_names
+//                   --output=result.json --metrics_output=metrics.prom
+#include "huge_pages.h"
+#include "key_gen.h"
+#include "metrics.h"
+#include "string_util.h"
+#include "table.h"
+#include "types.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fmt/core.h>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <nlohmann/json.hpp>
+#include <random>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace mergekv {
+namespace {
+
+struct LoadgenOptions {
+  // the table goes into a new subdirectory of path, which is removed after
+  // the run; nothing else under path is touched.
+  string path = "/tmp/mergekv_loadgen";
+  size_t writers = 4;
+  size_t readers = 4;
+  uint64_t duration_s = 10;
+  KeyDistribution distribution = KeyDistribution::kMetricNames;
+  // the number of distinct keys per writer; writers cycle over them.
+  size_t keys_per_writer = 200000;
+  size_t batch_size = 100;
+  uint64_t flush_interval_ms = 1000;
+  uint64_t merge_interval_ms = 5000;
+  // merges start once the table has at least that many parts.
+  size_t merge_min_parts = 8;
+  uint64_t seed = 1;
+  string output;
+  // the file for the Prometheus metrics after the run.
+  string metrics_output;
+  // whether the parts grow their buffers in transparent huge pages.
+  bool huge_pages = false;
+  // flushed parts below that size stay in memory up to the max age.
+  size_t max_inmemory_part_bytes = 0;
+  uint64_t max_inmemory_part_age_ms = 30000;
+};
+
+void usage() {
+  fmt::print(stderr,
+             "usage: mergekv_loadgen [--path=DIR] [--writers=N] "
+             "[--readers=M] [--duration_s=S]\n"
+             "  [--distribution=metric_names|uuids|monotonic_ids] "
+             "[--keys_per_writer=K] [--batch_size=B]\n"
+             "  [--flush_interval_ms=MS] [--merge_interval_ms=MS] "
+             "[--merge_min_parts=P] [--seed=S] [--output=FILE]\n"
+             "  [--metrics_output=FILE] [--huge_pages=0|1]\n"
+             "  [--max_inmemory_part_bytes=N] "
+             "[--max_inmemory_part_age_ms=MS]\n");
+}
+
+LoadgenOptions parseOptions(int argc, char **argv) {
+  LoadgenOptions opts;
+  for (int i = 1; i < argc; i++) {
+    string arg = argv[i];
+    auto eq = arg.find('=');
+    if (!arg.starts_with("--") || eq == string::npos) {
+      usage();
+      std::exit(2);
+    }
+    auto name = arg.substr(2, eq - 2);
+    auto value = arg.substr(eq + 1);
+    if (name == "path") {
+      opts.path = value;
+    } else if (name == "writers") {
+      opts.writers = std::stoull(value);
+    } else if (name == "readers") {
+      opts.readers = std::stoull(value);
+    } else if (name == "duration_s") {
+      opts.duration_s = std::stoull(value);
+    } else if (name == "distribution") {
+      bool found = false;
+      for (auto dist : {KeyDistribution::kMetricNames, KeyDistribution::kUUIDs,
+                        KeyDistribution::kMonotonicIDs}) {
+        if (value == KeyDistributionName(dist)) {
+          opts.distribution = dist;
+          found = true;
+        }
+      }
+      if (!found) {
+        usage();
+        std::exit(2);
+      }
+    } else if (name == "keys_per_writer") {
+      opts.keys_per_writer = std::max<size_t>(1, std::stoull(value));
+    } else if (name == "batch_size") {
+      opts.batch_size = std::max<size_t>(1, std::stoull(value));
+    } else if (name == "flush_interval_ms") {
+      opts.flush_interval_ms = std::stoull(value);
+    } else if (name == "merge_interval_ms") {
+      opts.merge_interval_ms = std::stoull(value);
+    } else if (name == "merge_min_parts") {
+      opts.merge_min_parts = std::max<size_t>(2, std::stoull(value));
+    } else if (name == "seed") {
+      opts.seed = std::stoull(value);
+    } else if (name == "output") {
+      opts.output = value;
+    } else if (name == "metrics_output") {
+      opts.metrics_output = value;
+    } else if (name == "huge_pages") {
+      opts.huge_pages = value == "1" || value == "true";
+    } else if (name == "max_inmemory_part_bytes") {
+      opts.max_inmemory_part_bytes = std::stoull(value);
+    } else if (name == "max_inmemory_part_age_ms") {
+      opts.max_inmemory_part_age_ms = std::stoull(value);
+    } else {
+      usage();
+      std::exit(2);
+    }
+  }
+  return opts;
+}
+
+// LatencyRecorder collects the latencies of an operation into a histogram
+// per thread, so recording neither contends nor grows with the run length.
+// The percentiles are the bucket upper bounds, within 1/8 of the exact
+// values.
+class LatencyRecorder {
+public:
+  explicit LatencyRecorder(size_t threads) : slots_(threads) {
+    for (auto &s : slots_) {
+      s.h = std::make_unique<Histogram>();
+    }
+  }
+
+  void Record(size_t thread, std::chrono::steady_clock::duration d) {
+    auto ns = uint64_t(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(d).count());
+    auto &s = slots_[thread];
+    s.h->Update(ns);
+    s.max = std::max(s.max, ns);
+  }
+
+  // Summary returns the operations count, the rate and the latency
+  // percentiles in microseconds.
+  nlohmann::json Summary(double elapsed_s, uint64_t items) const {
+    HistogramSnapshot all;
+    uint64_t max = 0;
+    for (auto &s : slots_) {
+      auto snap = s.h->Snapshot();
+      all.buckets.resize(snap.buckets.size());
+      for (size_t i = 0; i < snap.buckets.size(); i++) {
+        all.buckets[i] += snap.buckets[i];
+      }
+      all.count += snap.count;
+      all.sum += snap.sum;
+      max = std::max(max, s.max);
+    }
+    auto percentile = [&all](double q) {
+      return all.count == 0 ? 0.0 : double(all.Quantile(q)) / 1000;
+    };
+    nlohmann::json j;
+    j["count"] = all.count;
+    j["ops_per_s"] = elapsed_s > 0 ? double(all.count) / elapsed_s : 0;
+    if (items > 0) {
+      j["items"] = items;
+      j["items_per_s"] = elapsed_s > 0 ? double(items) / elapsed_s : 0;
+    }
+    j["p50_us"] = percentile(0.5);
+    j["p99_us"] = percentile(0.99);
+    j["p999_us"] = percentile(0.999);
+    j["max_us"] = double(max) / 1000;
+    return j;
+  }
+
+private:
+  struct slot {
+    std::unique_ptr<Histogram> h;
+    // only the owning thread updates max, and Summary runs after it exits.
+    uint64_t max = 0;
+  };
+  std::vector<slot> slots_;
+};
+
+// timed calls f and records its latency.
+template <class F>
+auto timed(LatencyRecorder &rec, size_t thread, F &&f) -> decltype(f()) {
+  auto start = std::chrono::steady_clock::now();
+  if constexpr (std::is_void_v<decltype(f())>) {
+    f();
+    rec.Record(thread, std::chrono::steady_clock::now() - start);
+  } else {
+    auto res = f();
+    rec.Record(thread, std::chrono::steady_clock::now() - start);
+    return res;
+  }
+}
+
+// newRunPath creates a unique directory for the table under path.
+string newRunPath(const string &path) {
+  fs::create_directories(path);
+  auto ts = std::chrono::system_clock::now().time_since_epoch().count();
+  for (int i = 0;; i++) {
+    auto run_path =
+        fs::path(fs::path(path) / fmt::format("run_{}_{}_{}", getpid(), ts, i));
+    if (fs::create_directory(run_path)) {
+      return run_path.string();
+    }
+  }
+}
+
+int run(const LoadgenOptions &opts) {
+  auto run_path = newRunPath(opts.path);
+  TableOptions tb_opts;
+  tb_opts.part_opts.huge_pages = opts.huge_pages;
+  tb_opts.max_inmemory_part_bytes = opts.max_inmemory_part_bytes;
+  tb_opts.max_inmemory_part_age =
+      std::chrono::milliseconds(opts.max_inmemory_part_age_ms);
+  auto tb = Table::MustOpen(run_path, tb_opts);
+
+  std::vector<std::vector<string>> keys(opts.writers);
+  for (size_t i = 0; i < opts.writers; i++) {
+    keys[i] = GenerateKeys(opts.distribution, opts.keys_per_writer,
+                           opts.seed + i);
+  }
+
+  LatencyRecorder add_lat(opts.writers), lookup_lat(opts.readers);
+  LatencyRecorder flush_lat(1), merge_lat(1);
+  std::atomic<uint64_t> items_added{0}, lookups{0}, lookup_hits{0};
+  std::atomic<bool> stop{false};
+  auto start = std::chrono::steady_clock::now();
+  auto deadline = start + std::chrono::seconds(opts.duration_s);
+
+  std::vector<std::thread> threads;
+  for (size_t w = 0; w < opts.writers; w++) {
+    threads.emplace_back([&, w]() {
+      auto &ks = keys[w];
+      std::vector<bytes_const_span> batch;
+      size_t next = 0;
+      while (!stop.load(std::memory_order_relaxed)) {
+        batch.clear();
+        for (size_t i = 0; i < opts.batch_size; i++) {
+          batch.push_back(StringUtil::BytesConstSpan(ks[next]));
+          next = (next + 1) % ks.size();
+        }
+        timed(add_lat, w, [&]() { tb->AddItems(batch); });
+        items_added.fetch_add(batch.size(), std::memory_order_relaxed);
+      }
+    });
+  }
+  for (size_t r = 0; r < opts.readers; r++) {
+    threads.emplace_back([&, r]() {
+      // readers look up the writers keys, so the hit rate grows as they
+      // get flushed.
+      std::mt19937_64 gen(opts.seed * 1000 + r);
+      while (!stop.load(std::memory_order_relaxed)) {
+        auto &ks = keys[gen() % keys.size()];
+        auto &key = ks[gen() % ks.size()];
+        auto found = timed(lookup_lat, r, [&]() {
+          return tb->Contains(StringUtil::BytesConstSpan(key));
+        });
+        lookups.fetch_add(1, std::memory_order_relaxed);
+        lookup_hits.fetch_add(found, std::memory_order_relaxed);
+      }
+    });
+  }
+  threads.emplace_back([&]() {
+    auto next = std::chrono::steady_clock::now();
+    while (!stop.load(std::memory_order_relaxed)) {
+      next += std::chrono::milliseconds(opts.flush_interval_ms);
+      std::this_thread::sleep_until(std::min(next, deadline));
+      timed(flush_lat, 0, [&]() { tb->Flush(); });
+    }
+  });
+  threads.emplace_back([&]() {
+    auto next = std::chrono::steady_clock::now();
+    while (!stop.load(std::memory_order_relaxed)) {
+      next += std::chrono::milliseconds(opts.merge_interval_ms);
+      std::this_thread::sleep_until(std::min(next, deadline));
+      if (!stop.load() && tb->PartsCount() >= opts.merge_min_parts) {
+        timed(merge_lat, 0, [&]() { tb->MergeParts(); });
+      }
+    }
+  });
+
+  std::this_thread::sleep_until(deadline);
+  stop = true;
+  for (auto &t : threads) {
+    t.join();
+  }
+  auto elapsed_s = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+
+  nlohmann::json result;
+  result["config"] = {
+      {"path", run_path},
+      {"writers", opts.writers},
+      {"readers", opts.readers},
+      {"duration_s", opts.duration_s},
+      {"distribution", KeyDistributionName(opts.distribution)},
+      {"keys_per_writer", opts.keys_per_writer},
+      {"batch_size", opts.batch_size},
+      {"flush_interval_ms", opts.flush_interval_ms},
+      {"merge_interval_ms", opts.merge_interval_ms},
+      {"merge_min_parts", opts.merge_min_parts},
+      {"seed", opts.seed},
+      {"huge_pages", opts.huge_pages},
+      {"max_inmemory_part_bytes", opts.max_inmemory_part_bytes},
+      {"max_inmemory_part_age_ms", opts.max_inmemory_part_age_ms},
+  };
+  result["elapsed_s"] = elapsed_s;
+  result["add"] = add_lat.Summary(elapsed_s, items_added.load());
+  result["flush"] = flush_lat.Summary(elapsed_s, 0);
+  result["merge"] = merge_lat.Summary(elapsed_s, 0);
+  result["lookup"] = lookup_lat.Summary(elapsed_s, 0);
+  result["lookup"]["hits"] = lookup_hits.load();
+  auto stats = tb->Stats();
+  result["table"] = {
+      {"parts", stats.parts},
+      {"inmemory_parts", stats.inmemory_parts},
+      {"items_count", stats.items_count},
+      {"blocks_count", stats.blocks_count},
+      {"avg_items_per_block", stats.AvgItemsPerBlock()},
+      {"raw_bytes", stats.encoding.raw_bytes},
+      {"items_bytes", stats.encoding.items_bytes},
+      {"lens_bytes", stats.encoding.lens_bytes},
+      {"plain_blocks", stats.encoding.plain_blocks},
+      {"zstd_blocks", stats.encoding.zstd_blocks},
+      {"avg_common_prefix_len", stats.encoding.AvgCommonPrefixLen()},
+      {"compression_ratio", stats.encoding.CompressionRatio()},
+      {"huge_page_bytes", HugePageUtil::ProcessHugePageBytes()},
+  };
+
+  auto out = result.dump(2);
+  if (opts.output.empty()) {
+    fmt::print("{}\n", out);
+  } else {
+    std::ofstream f(opts.output);
+    f << out << "\n";
+    if (!f) {
+      fmt::print(stderr, "cannot write {}\n", opts.output);
+      return 1;
+    }
+  }
+  tb->MustClose();
+  if (!opts.metrics_output.empty()) {
+    MetricsRegistry::Global().MustWritePrometheusFile(opts.metrics_output);
+  }
+  tb.reset();
+  fs::remove_all(run_path);
+  return 0;
+}
+
+} // namespace
+} // namespace mergekv
+
+int main(int argc, char **argv) {
+  auto opts = mergekv::parseOptions(argc, argv);
+  try {
+    return mergekv::run(opts);
+  } catch (const std::exception &e) {
+    fmt::print(stderr, "mergekv_loadgen: {}\n", e.what());
+    return 1;
+  }
+}